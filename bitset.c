@@ -1,948 +1,6076 @@
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef BITSET_NDEBUG
+#define NDEBUG
+#endif
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "bitset.h"
 
 #define DIVMOD(a,b,q,r) { q = (a)/(b); r = (a)%(b); }
 
+/* the block_shift of a bitset with the default BLOCKSIZE */
+#define BITSET_BLOCK_SHIFT	16
+
+/* split a bit number of bset into its block and the bit within the block */
+#define BLOCK_DIVMOD(bset,a,q,r) { q = (a) >> (bset)->block_shift; r = (a) & (BITSET_BLOCK_IDS(bset) - 1); }
+
+/* the ref_count of a page which lives in a read-only mapping.  it is never
+ * freed, and is copied before being written like a shared page.  the
+ * references to it are counted by its mapping instead */
+#define BITSET_IMMORTAL -1
+
 static int block_allocs = 0;
 static int block_mem = 0;
 
+/* when set, reference counts and memory stats are updated atomically */
+static int threadsafe = 0;
+
+/* STAT adds n to a counter of bset, if it is not NULL, and to the global
+ * counter.  it compiles to nothing unless BITSET_STATS is defined */
+#ifdef BITSET_STATS
+static struct bitset_stats global_stats;
+
+#define STAT(bset, field, n)	bitset_stat((bset), offsetof(struct bitset_stats, field), (n))
+#else
+#define STAT(bset, field, n)
+#endif
+
+
+/* BITSET FUNCTION DECLARATIONS */
+static int bitset_reblock(struct bitset *s, int shift, struct bitset **r);
+
+
+/* SNAPSHOT FUNCTION DECLARATIONS */
+static void bitset_mvcc_reclaim(struct bitset_mvcc *mvcc);
+static void bitset_mvcc_free(struct bitset_mvcc *mvcc);
+
+
+/* JOURNAL FUNCTION DECLARATIONS */
+
+/* journal record ops */
+#define JOURNAL_SET			1
+#define JOURNAL_CLR			2
+#define JOURNAL_TOGGLE		3
+#define JOURNAL_BULK		4
+#define JOURNAL_OR			5
+#define JOURNAL_AND			6
+#define JOURNAL_SUBTRACT	7
+#define JOURNAL_INVERT		8
+
+static int bitset_journal_log(struct bitset *bset, int op, uint32_t arg);
+static int bitset_journal_log_bulk(struct bitset *bset, const int *bits, int count);
+
+
+/* SMALL SET FUNCTION DECLARATIONS */
+static int bitset_small_find(struct bitset *bset, int bit);
+static int bitset_small_test(struct bitset *bset, int bit);
+static int bitset_small_set(struct bitset *bset, int bit);
+static void bitset_small_clr(struct bitset *bset, int bit);
+static int bitset_small_promote(struct bitset *bset);
+static int bitset_small_expand(struct bitset *bset, struct bitset **r);
+static int bitset_small_or(struct bitset *a, struct bitset *b);
+static int bitset_small_and(struct bitset *a, struct bitset *b);
+static int bitset_small_subtract(struct bitset *a, struct bitset *b);
+
 
 /* BLOCK FUNCTION DECLARATIONS */
-static int bitset_block_new(struct bitset_block **blk_out);
+static int bitset_block_new(int pages, struct bitset_block **blk_out);
 
 static int bitset_block_alloc(struct bitset *bset, int block, struct bitset_block **blk_out);
 static int bitset_block_realloc(struct bitset *bset, int block, struct bitset_block **blk_out);
+static int bitset_block_install(struct bitset *bset, int block, struct bitset_block **blk_out);
 
 static void bitset_block_incref(struct bitset_block *blk);
 static void bitset_block_decref(struct bitset_block *blk);
+static int bitset_block_shared(struct bitset_block *blk);
 
-static void bitset_block_set_bit(struct bitset_block *blk, int bit);
-static void bitset_block_clr_bit(struct bitset_block *blk, int bit);
-static void bitset_block_toggle_bit(struct bitset_block *blk, int bit);
+static int bitset_block_set_bit(struct bitset_block *blk, int bit);
+static int bitset_block_clr_bit(struct bitset_block *blk, int bit);
+static int bitset_block_toggle_bit(struct bitset_block *blk, int bit);
 
 static int bitset_block_test_bit(struct bitset_block *blk, int bit);
+static int bitset_block_find_next_on_bit(struct bitset_block *block, int pos);
 
-static void bitset_block_or(struct bitset_block *a, struct bitset_block *b);
-static void bitset_block_and(struct bitset_block *a, struct bitset_block *b);
-static void bitset_block_subtract(struct bitset_block *a, struct bitset_block *b);
-static void bitset_block_invert(struct bitset_block *b);
+static int bitset_block_or(struct bitset_block *a, struct bitset_block *b);
+static int bitset_block_and(struct bitset_block *a, struct bitset_block *b);
+static int bitset_block_subtract(struct bitset_block *a, struct bitset_block *b);
+static int bitset_block_invert(struct bitset_block *b);
 
+static void bitset_block_share_page(struct bitset_block *a, int p, struct bitset_page *b);
+static void bitset_block_drop_page(struct bitset_block *a, int p);
 
 
-/******************************************************************************
- * GLOBAL OPERATIONS
- */
+/* PAGE FUNCTION DECLARATIONS */
+static int bitset_page_new(struct bitset_page **page_out);
 
-void bitset_get_alloc_stats(int *allocs, int *bytes)
-{
-	*allocs = block_allocs;
-	*bytes = block_mem;
-}
+static int bitset_page_alloc(struct bitset_block *blk, int p, struct bitset_page **page_out);
+static int bitset_page_realloc(struct bitset_block *blk, int p, struct bitset_page **page_out);
+static int bitset_page_writable(struct bitset_block *blk, int p, struct bitset_page **page_out);
+static int bitset_page_install(struct bitset_block *blk, int p, struct bitset_page **page_out);
+
+static void bitset_page_incref(struct bitset_page *page);
+static void bitset_page_decref(struct bitset_page *page);
+static int bitset_page_shared(struct bitset_page *page);
+static int bitset_page_immortal(struct bitset_page *page);
+
+static void bitset_page_set_bit(struct bitset_page *page, int bit);
+static int bitset_page_set_bit_atomic(struct bitset_page *page, int bit);
+static void bitset_page_clr_bit(struct bitset_page *page, int bit);
+static int bitset_page_toggle_bit(struct bitset_page *page, int bit);
+
+static int bitset_page_test_bit(struct bitset_page *page, int bit);
+
+static void bitset_page_or(struct bitset_page *a, struct bitset_page *b);
+static void bitset_page_and(struct bitset_page *a, struct bitset_page *b);
+static void bitset_page_subtract(struct bitset_page *a, struct bitset_page *b);
+static void bitset_page_invert(struct bitset_page *b);
+
+static int bitset_page_find_next_on_bit(struct bitset_page *page, int pos);
 
 
 
 /******************************************************************************
- * OBJECT ALLOCATION AND DESTRUCTION
+ * GLOBAL OPERATIONS
  */
 
-/* allocate a bitset with count bits in it, numbered 0 - (count-1)
- * all bits are initially set to 0 */
-int bitset_alloc(int bitcount, struct bitset **bset_out) 
+void bitset_get_alloc_stats(int *allocs, int *bytes)
 {
-	struct bitset *bset = NULL;
-	int ret;
-
-	if (bset_out == NULL || *bset_out != NULL) 
+	if (threadsafe)
 	{
-		ret = ERRINPUT;
-		goto exit;
+		*allocs = __atomic_load_n(&block_allocs, __ATOMIC_RELAXED);
+		*bytes = __atomic_load_n(&block_mem, __ATOMIC_RELAXED);
 	}
-
-	bset = (struct bitset *)malloc(sizeof(struct bitset));
-	if (bset == NULL) 
+	else
 	{
-		ret = ERRMEM;
-		goto exit;
+		*allocs = block_allocs;
+		*bytes = block_mem;
 	}
+}
 
-	block_allocs++;
-	block_mem += sizeof(struct bitset);
+#ifdef BITSET_STATS
+static void bitset_stat_add(struct bitset_stats *stats, size_t field, uint64_t n)
+{
+	uint64_t *counter = (uint64_t *)((char *)stats + field);
 
-	if ((ret = bitset_init(bset, bitcount)) != OK)
-	{
-		goto exit;
-	}
+	if (threadsafe)
+		__atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+	else
+		*counter += n;
+}
 
-	*bset_out = bset;
-	bset = NULL;
+static void bitset_stat(struct bitset *bset, size_t field, uint64_t n)
+{
+	bitset_stat_add(&global_stats, field, n);
+	if (bset != NULL && bset->stats != NULL)
+		bitset_stat_add(bset->stats, field, n);
+}
+#endif
 
-exit:
-	if (bset != NULL) 
-	{
-		bitset_free(bset);
-	}
+/* Copy the event counters of a bitset, or the global ones */
+int bitset_get_stats(struct bitset *bset, struct bitset_stats *stats)
+{
+#ifdef BITSET_STATS
+	if (stats == NULL || (bset != NULL && bset->stats == NULL))
+		return ERRINPUT;
 
-	return ret;
+	memcpy(stats, bset != NULL ? bset->stats : &global_stats, sizeof(*stats));
+	return OK;
+#else
+	(void)bset;
+	(void)stats;
+	return ERRNOTIMPL;
+#endif
 }
 
-
-/* initialize a bitset structure */
-int bitset_init(struct bitset *bset, int bitcount) 
+/* Zero the event counters of a bitset, or the global ones */
+int bitset_reset_stats(struct bitset *bset)
 {
-	size_t sz;
-
-	memset(bset, 0, sizeof(struct bitset));
+#ifdef BITSET_STATS
+	if (bset != NULL && bset->stats == NULL)
+		return ERRINPUT;
 
-	bset->bitcount = bitcount;
-	bset->block_count = BLOCKCOUNT(bitcount);
+	memset(bset != NULL ? bset->stats : &global_stats, 0, sizeof(struct bitset_stats));
+	return OK;
+#else
+	(void)bset;
+	return ERRNOTIMPL;
+#endif
+}
 
-	sz = sizeof(struct bitset_block *) * bset->block_count;
-	bset->blocks = (struct bitset_block **) malloc(sz);
-	if (bset->blocks == NULL)
+/* allocate the event counters of a new bitset, when they are kept */
+static int bitset_alloc_stats(struct bitset *bset)
+{
+#ifdef BITSET_STATS
+	bset->stats = (struct bitset_stats *)calloc(1, sizeof(struct bitset_stats));
+	if (bset->stats == NULL)
 		return ERRMEM;
-	
-	block_allocs++;
-	block_mem += sz;
-
-	memset(bset->blocks, 0, sz);
-
+#else
+	(void)bset;
+#endif
 	return OK;
 }
 
-
-/* free a bitset structure */
-void bitset_free(struct bitset *bset)
+/* Turn thread-safe reference counting on or off */
+void bitset_set_threadsafe(int enable)
 {
-	int i;
+	threadsafe = enable;
+}
 
-	if (bset) 
+/* update the memory allocation counters */
+static void bitset_count_alloc(size_t sz)
+{
+	if (threadsafe)
 	{
-		if (bset->blocks)
-		{
-			for (i = 0; i < bset->block_count; i++)
-			{
-				if (bset->blocks[i] != NULL)
-					bitset_block_decref(bset->blocks[i]);
-			}
-			free(bset->blocks);
-		}
+		__atomic_add_fetch(&block_allocs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&block_mem, (int)sz, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		block_allocs++;
+		block_mem += sz;
+	}
+}
 
-		free(bset);
+/* take back an allocation counted by bitset_count_alloc, for memory freed
+ * again before it was ever used */
+static void bitset_uncount_alloc(size_t sz)
+{
+	if (threadsafe)
+	{
+		__atomic_sub_fetch(&block_allocs, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&block_mem, (int)sz, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		block_allocs--;
+		block_mem -= sz;
 	}
 }
 
 
-/* duplicate a bitset and return it */
-int bitset_dup(struct bitset *s, struct bitset **r)
+
+/******************************************************************************
+ * BLOCK DIRECTORY
+ *
+ * a directory is dense or sparse.  a dense directory is an array with a
+ * pointer for every block, and a bit per block which is set once the block
+ * has been non-NULL.  whole-set operations and the iterator use these bits
+ * to skip empty blocks a word of 64 at a time.
+ *
+ * a sparse directory holds the sorted indexes, or keys, of the blocks which
+ * have been non-NULL and a pointer for each, so its size follows the number
+ * of occupied blocks rather than the size of the bitset.  a large bitset
+ * starts out with a sparse directory, which is made dense once more than 1
+ * in BITSET_SPARSE_RATIO of its blocks are occupied.  a block is found by a
+ * binary search of the keys, and whole-set operations step from key to key,
+ * merging the keys of both bitsets.
+ *
+ * neither kind forgets a block once it has been non-NULL, so a block which
+ * has since become NULL may be visited, but a non-NULL block never missed.
+ */
+
+/* bitsets with at least this many blocks start with a sparse directory */
+#define BITSET_SPARSE_BLOCKS	256
+
+/* a sparse directory is made dense when more than 1 in this many of its
+ * blocks are occupied */
+#define BITSET_SPARSE_RATIO		16
+
+/* note that block i of a dense directory is non-NULL.  must be called
+ * whenever a block is stored in a NULL slot of the directory */
+static void bitset_mark_block(struct bitset *bset, int i)
 {
-	struct bitset *bset = NULL;
-	int i, ret;
-	size_t sz;
+	uint64_t m = 1ull << (i % 64);
 
-	if (!s)
+	if (threadsafe)
 	{
-		ret = ERRINPUT;
-		goto exit;
+		if ((__atomic_load_n(&bset->occupied[i / 64], __ATOMIC_RELAXED) & m) == 0)
+			__atomic_fetch_or(&bset->occupied[i / 64], m, __ATOMIC_RELAXED);
 	}
-		
-	if (r == NULL || *r != NULL) 
+	else
 	{
-		ret = ERRINPUT;
-		goto exit;
+		bset->occupied[i / 64] |= m;
 	}
+}
 
-	bset = (struct bitset *)malloc(sizeof(struct bitset));
-	if (bset == NULL) 
+/* get the bits for blocks [64*w, 64*w + 64) of a dense directory.  blocks
+ * past the end of a smaller bitset are never occupied */
+static uint64_t bitset_occupied(struct bitset *bset, int w)
+{
+	if (w >= (bset->block_count + 63) / 64)
+		return 0;
+
+	return __atomic_load_n(&bset->occupied[w], __ATOMIC_RELAXED);
+}
+
+/* find the position of the first key of a sparse directory which is i or
+ * greater */
+static int bitset_key_find(struct bitset *bset, int i)
+{
+	int lo = 0, hi = bset->key_count, mid;
+
+	while (lo < hi)
 	{
-		ret = ERRMEM;
-		goto exit;
+		mid = (lo + hi) / 2;
+		if (bset->keys[mid] < i)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	memset(bset, 0, sizeof(struct bitset));
 
-	block_allocs++;
-	block_mem += sizeof(struct bitset);
+	return lo;
+}
 
-	bset->bitcount = s->bitcount;
-	bset->block_count = s->block_count;
+/* get block i of bset, or NULL if bset is too small to have one */
+static struct bitset_block *bitset_block_at(struct bitset *bset, int i)
+{
+	return i < bset->block_count ? bitset_block_lookup(bset, i) : NULL;
+}
+
+/* find the first block at index i or greater which may be non-NULL, or
+ * block_count if there is none */
+static int bitset_next_block(struct bitset *bset, int i)
+{
+	int k, words = (bset->block_count + 63) / 64;
+	uint64_t w;
 
-	sz = sizeof(struct bitset_block *) * bset->block_count;
-	bset->blocks = (struct bitset_block **) malloc(sz);
-	if (bset->blocks == NULL)
+	if (i >= bset->block_count)
+		return bset->block_count;
+
+	if (bset->keys != NULL)
 	{
-		ret = ERRMEM;
-		goto exit;
+		k = bitset_key_find(bset, i);
+		return k < bset->key_count ? bset->keys[k] : bset->block_count;
 	}
-	
-	block_allocs++;
-	block_mem += sz;
 
-	memcpy(bset->blocks, s->blocks, sz);
-	for (i = 0; i < bset->block_count; i++) 
+	w = bitset_occupied(bset, i / 64) & (~0ull << (i % 64));
+	for (i /= 64; w == 0; w = bitset_occupied(bset, i))
 	{
-		if (bset->blocks[i] != NULL)
-		{
-			bitset_block_incref(bset->blocks[i]);
-		}
+		if (++i == words)
+			return bset->block_count;
 	}
 
-	*r = bset;
-	bset = NULL;
+	return i * 64 + __builtin_ctzll(w);
+}
 
-	ret = OK;
+/* the most blocks of bset which can be non-NULL */
+static int bitset_block_slots(struct bitset *bset)
+{
+	return bset->keys != NULL ? bset->key_count : bset->block_count;
+}
 
-exit:
-	if (bset != NULL) 
+/* allocate the pointers and occupancy bits of an empty dense directory */
+static int bitset_dense_alloc(int block_count, struct bitset_block ***blocks_out, uint64_t **occupied_out)
+{
+	struct bitset_block **blocks;
+	uint64_t *occupied;
+	size_t sz, osz;
+
+	sz = sizeof(struct bitset_block *) * block_count;
+	osz = sizeof(uint64_t) * ((block_count + 63) / 64);
+
+	blocks = (struct bitset_block **) calloc(1, sz);
+	occupied = (uint64_t *) calloc(1, osz);
+	if (blocks == NULL || occupied == NULL)
 	{
-		bitset_free(bset);
+		free(blocks);
+		free(occupied);
+		return ERRMEM;
 	}
 
-	return ret;
+	bitset_count_alloc(sz);
+	bitset_count_alloc(osz);
+
+	*blocks_out = blocks;
+	*occupied_out = occupied;
+
+	return OK;
 }
 
+/* make room for at least n keys in a sparse directory */
+static int bitset_keys_reserve(struct bitset *bset, int n)
+{
+	struct bitset_block **blocks;
+	int *keys;
+	int alloc;
 
+	if (n <= bset->key_alloc)
+		return OK;
 
-/******************************************************************************
- * OBJECT INFORMATION
- */
+	alloc = bset->key_alloc * 2 > n ? bset->key_alloc * 2 : n;
+	if (alloc < 8)
+		alloc = 8;
 
-/* get the count of total bits in the bitset */
-int bitset_bitcount(struct bitset *b)
-{
-	if (!b)
-		return ERRINPUT;
-	return b->bitcount;
+	keys = (int *) realloc(bset->keys, sizeof(int) * alloc);
+	if (keys == NULL)
+		return ERRMEM;
+	bset->keys = keys;
+
+	blocks = (struct bitset_block **) realloc(bset->blocks, sizeof(struct bitset_block *) * alloc);
+	if (blocks == NULL)
+		return ERRMEM;
+	bset->blocks = blocks;
+
+	bitset_count_alloc((sizeof(int) + sizeof(struct bitset_block *)) * (alloc - bset->key_alloc));
+	bset->key_alloc = alloc;
+
+	return OK;
 }
 
-/* get the count of bits in the bitset which are set to 1 */
-int bitset_set_count(struct bitset *b)
+/* replace the sparse directory of bset with a dense one.  on failure the
+ * sparse one is kept */
+static int bitset_directory_dense(struct bitset *bset)
 {
-	int n, i;
+	struct bitset_block **blocks;
+	uint64_t *occupied;
+	int k, i, ret;
 
-	if (!b)
-		return ERRINPUT;
+	if ((ret = bitset_dense_alloc(bset->block_count, &blocks, &occupied)) != OK)
+		return ret;
 
-	for (n = 0, i = 0; i < b->block_count; i++)
+	for (k = 0; k < bset->key_count; k++)
 	{
-		if (b->blocks[i] != NULL)
-			n += b->blocks[i]->set_count;
+		i = bset->keys[k];
+		blocks[i] = bset->blocks[k];
+		occupied[i / 64] |= 1ull << (i % 64);
 	}
 
-	return n;
+	free(bset->keys);
+	free(bset->blocks);
+	bset->keys = NULL;
+	bset->key_count = 0;
+	bset->key_alloc = 0;
+	bset->blocks = blocks;
+	bset->occupied = occupied;
+
+	return OK;
 }
 
-/* find the first allocated block in the bitset at index start or greater
- * if bset->blocks[start] is an allocated block, then start will be returned
- * if there is not a block at blocks[start], then the lowest index containing
- * an allocated block which is greater than start will be returned.
- * if there is no allocated block, then the value returned will be
- * equal to bset->block_count */
-static int bitset_find_allocated_block(struct bitset *bset, int start)
+/* count the occupied blocks of a dense directory */
+static int bitset_occupied_count(struct bitset *bset)
 {
-	assert(start >= 0 && start < bset->block_count);
+	int i, n = 0;
 
-	/* locate the first allocated block in the structure */
-	for (; start < bset->block_count; start++) 
-	{
-		if (bset->blocks[start] != NULL)
-			break;
-	}
+	for (i = 0; i < (bset->block_count + 63) / 64; i++)
+		n += __builtin_popcountll(bset->occupied[i]);
 
-	return start;
+	return n;
 }
 
-
-/******************************************************************************
- * BIT OPERATIONS
- */
-
-int bitset_set(struct bitset *bset, int bit)
+/* replace the dense directory of bset with a sparse one holding its
+ * occupied blocks.  on failure the dense one is kept */
+static int bitset_directory_sparse(struct bitset *bset)
 {
-	int block, block_bit, ret;
-	struct bitset_block *blk;
-
-	if (bit < 0 || bit >= bset->bitcount)
-		return ERRINPUT;
+	struct bitset_block **blocks = bset->blocks;
+	uint64_t *occupied = bset->occupied;
+	int i, k, n = 0, ret;
 
-	DIVMOD(bit, IDSPERBLOCK, block, block_bit);
-	assert(block < bset->block_count);
+	n = bitset_occupied_count(bset);
 
-	if ((blk = bset->blocks[block]) == NULL) 
+	/* keys is never NULL for a sparse directory, even an empty one */
+	bset->blocks = NULL;
+	bset->occupied = NULL;
+	if ((ret = bitset_keys_reserve(bset, n > 0 ? n : 1)) != OK)
 	{
-		/* need to allocate the block */
-		if ((ret = bitset_block_alloc(bset, block, &blk)) != OK)
-			return ret;
+		free(bset->keys);
+		free(bset->blocks);
+		bset->keys = NULL;
+		bset->key_alloc = 0;
+		bset->blocks = blocks;
+		bset->occupied = occupied;
+		return ret;
 	}
-	else
-	{
-		/* if the bit is already set, this is a no-op */
-		if (bitset_block_test_bit(blk, block_bit))
-			return OK;
 
-		/* if the block is a shared block, need to allocate a new one */
-		if (bset->blocks[block]->ref_count > 1) 
+	for (i = 0, k = 0; k < n; i++)
+	{
+		if (occupied[i / 64] & (1ull << (i % 64)))
 		{
-			if ((ret = bitset_block_realloc(bset, block, &blk)) != OK)
-				return ret;
+			bset->keys[k] = i;
+			bset->blocks[k++] = blocks[i];
 		}
 	}
+	bset->key_count = n;
 
-	bitset_block_set_bit(blk, block_bit);
+	free(blocks);
+	free(occupied);
 
 	return OK;
 }
 
-
-/* set a bit to 0 in the bitset */
-int bitset_clr(struct bitset *bset, int bit)
+/* store blk as block i of bset.  a sparse directory gets a key for the
+ * block if it has none, which is the only way this can fail */
+static int bitset_block_store(struct bitset *bset, int i, struct bitset_block *blk)
 {
-	int block, block_bit, ret;
-	struct bitset_block *blk;
-
-	if (bit < 0 || bit >= bset->bitcount)
-		return ERRINPUT;
+	int k, ret;
 
-	DIVMOD(bit, IDSPERBLOCK, block, block_bit);
-	assert(block < bset->block_count);
+	if (bset->keys == NULL)
+	{
+		if (blk != NULL)
+			bitset_mark_block(bset, i);
+		bset->blocks[i] = blk;
+		return OK;
+	}
 
-	if ((blk = bset->blocks[block]) == NULL) 
+	k = bitset_key_find(bset, i);
+	if (k < bset->key_count && bset->keys[k] == i)
 	{
-		/* no need to clear if there is no block there */
+		bset->blocks[k] = blk;
 		return OK;
 	}
 
-	/* if the bit is already clear, this is a no-op */
-	if (bitset_block_test_bit(blk, block_bit) == 0)
+	if (blk == NULL)
 		return OK;
 
-	/* if the block is a shared block, need to allocate a new one */
-	if (bset->blocks[block]->ref_count > 1) 
-	{
-		if ((ret = bitset_block_realloc(bset, block, &blk)) != OK)
-			return ret;
-	}
+	/* a directory with many occupied blocks is smaller and faster dense */
+	if (bset->key_count >= bset->block_count / BITSET_SPARSE_RATIO && bitset_directory_dense(bset) == OK)
+		return bitset_block_store(bset, i, blk);
+
+	if ((ret = bitset_keys_reserve(bset, bset->key_count + 1)) != OK)
+		return ret;
 
-	bitset_block_clr_bit(blk, block_bit);
+	memmove(bset->keys + k + 1, bset->keys + k, sizeof(int) * (bset->key_count - k));
+	memmove(bset->blocks + k + 1, bset->blocks + k, sizeof(struct bitset_block *) * (bset->key_count - k));
+	bset->keys[k] = i;
+	bset->blocks[k] = blk;
+	bset->key_count++;
 
 	return OK;
 }
 
-
-/* invert a single bit in the bitset */
-int bitset_toggle_bit(struct bitset *bset, int bit)
+/* release all of the blocks of bset and free its directory */
+static void bitset_free_directory(struct bitset *bset)
+{
+	int i, n;
+
+	n = bset->keys != NULL ? bset->key_count : bset->block_count;
+	if (bset->blocks != NULL && (bset->keys != NULL || bset->occupied != NULL))
+	{
+		for (i = 0; i < n; i++)
+		{
+			if (bset->keys == NULL && (i = bitset_next_block(bset, i)) >= n)
+				break;
+			if (bset->blocks[i] != NULL)
+				bitset_block_decref(bset->blocks[i]);
+		}
+	}
+
+	free(bset->blocks);
+	free(bset->occupied);
+	free(bset->keys);
+	bset->blocks = NULL;
+	bset->occupied = NULL;
+	bset->keys = NULL;
+	bset->key_count = 0;
+	bset->key_alloc = 0;
+}
+
+
+
+/******************************************************************************
+ * PARALLEL EXECUTION
+ *
+ * whole-set operations are written as a function applied to each block index.
+ * small sets run that function in a simple loop.  large sets split the block
+ * range between the threads of the pool: each thread takes chunks from the
+ * front of its own range, and when its range runs out it steals the back half
+ * of the range of another thread, so skewed block occupancy still keeps every
+ * thread busy.
+ */
+
+#define BITSET_MAX_THREADS   64
+#define BITSET_CHUNK_BLOCKS  16
+
+/* pack and unpack a [lo, hi) range of block indexes into a 64 bit word so it
+ * can be updated with a single compare and swap */
+#define RANGE(lo,hi)  (((uint64_t)(lo) << 32) | (uint32_t)(hi))
+#define RANGE_LO(r)   ((int)((r) >> 32))
+#define RANGE_HI(r)   ((int)((r) & 0xffffffffu))
+
+/* a function applied to each block of a bitset.  returns a count which is
+ * summed over all the blocks, or an error code */
+typedef int (*bitset_block_op)(struct bitset *a, struct bitset *b, int i);
+
+/* the blocks a job visits: all of them, or only those which may be non-NULL
+ * in a, in b, or in both */
+#define VISIT_ALL	0
+#define VISIT_A		1
+#define VISIT_B		2
+#define VISIT_BOTH	3
+
+struct bitset_job {
+	struct bitset *a;
+	struct bitset *b;
+	bitset_block_op op;
+	int visit;
+
+	/* the sum of the op results, and the first error returned by the op */
+	int result;
+	int error;
+};
+
+struct bitset_worker {
+	/* the packed range of blocks still to be processed by this worker */
+	uint64_t range;
+
+	/* the last job generation this worker ran */
+	unsigned generation;
+
+	pthread_t thread;
+};
+
+static struct {
+	/* number of threads to use for a job, including the calling thread */
+	int nthreads;
+
+	/* bitsets with fewer blocks than this are processed serially */
+	int min_blocks;
+
+	/* serializes jobs and pool reconfiguration */
+	pthread_mutex_t run_lock;
+
+	/* protects the fields below and signals job start and completion */
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+
+	unsigned generation;
+	int running;
+	int stop;
+	struct bitset_job *job;
+
+	struct bitset_worker workers[BITSET_MAX_THREADS];
+} pool = {
+	1, 0,
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	0, 0, 0, NULL,
+	{ { 0 } }
+};
+
+
+/* get the bits for the blocks of directory word w which the job visits */
+static uint64_t bitset_job_blocks(struct bitset_job *job, int w)
+{
+	switch (job->visit)
+	{
+	case VISIT_A:
+		return bitset_occupied(job->a, w);
+	case VISIT_B:
+		return bitset_occupied(job->b, w);
+	case VISIT_BOTH:
+		return bitset_occupied(job->a, w) & bitset_occupied(job->b, w);
+	default:
+		return ~0ull;
+	}
+}
+
+/* find the first block at index i or greater which the job visits */
+static int bitset_job_next(struct bitset_job *job, int i)
+{
+	int j;
+
+	switch (job->visit)
+	{
+	case VISIT_A:
+		return bitset_next_block(job->a, i);
+	case VISIT_B:
+		return bitset_next_block(job->b, i);
+	case VISIT_BOTH:
+		/* step each set up to the other until they meet */
+		for (;;)
+		{
+			i = bitset_next_block(job->a, i);
+			if (i >= job->a->block_count || i >= job->b->block_count)
+				return job->a->block_count;
+			if ((j = bitset_next_block(job->b, i)) == i)
+				return i;
+			i = j;
+		}
+	default:
+		return i;
+	}
+}
+
+/* run the job over the blocks [lo, hi) */
+static int bitset_job_run(struct bitset_job *job, int lo, int hi)
+{
+	uint64_t w;
+	int i, base, ret, n = 0;
+
+	/* a sparse directory has no occupancy bits, so its blocks are found
+	 * one at a time */
+	if (job->a->keys != NULL || (job->b != NULL && job->b->keys != NULL))
+	{
+		for (i = lo; (i = bitset_job_next(job, i)) < hi; i++)
+		{
+			ret = job->op(job->a, job->b, i);
+			if (ret < 0)
+				return ret;
+			n += ret;
+		}
+		return n;
+	}
+
+	for (i = lo; i < hi; i = base + 64)
+	{
+		base = i & ~63;
+
+		w = bitset_job_blocks(job, base / 64) & (~0ull << (i - base));
+		if (hi - base < 64)
+			w &= ~(~0ull << (hi - base));
+
+		/* the blocks in the range which are not visited are all NULL */
+		STAT(job->a, null_skips, (hi - base < 64 ? hi - base : 64) - (i - base) - __builtin_popcountll(w));
+
+		for (; w != 0; w &= w - 1)
+		{
+			ret = job->op(job->a, job->b, base + __builtin_ctzll(w));
+			if (ret < 0)
+				return ret;
+			n += ret;
+		}
+	}
+
+	return n;
+}
+
+/* take a chunk from the front of a worker's range */
+static int bitset_pool_take(struct bitset_worker *w, int *lo, int *hi)
+{
+	uint64_t r;
+	int l, h, n;
+
+	r = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+	do
+	{
+		l = RANGE_LO(r);
+		h = RANGE_HI(r);
+		if (l >= h)
+			return 0;
+		n = h - l < BITSET_CHUNK_BLOCKS ? h - l : BITSET_CHUNK_BLOCKS;
+	}
+	while (!__atomic_compare_exchange_n(&w->range, &r, RANGE(l + n, h), 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	*lo = l;
+	*hi = l + n;
+
+	return 1;
+}
+
+/* steal the back half of the range of another worker, and make it the range
+ * of worker id */
+static int bitset_pool_steal(int id, int nthreads)
+{
+	struct bitset_worker *victim;
+	uint64_t r;
+	int i, l, h, mid;
+
+	for (i = 1; i < nthreads; i++)
+	{
+		victim = &pool.workers[(id + i) % nthreads];
+
+		r = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+		do
+		{
+			l = RANGE_LO(r);
+			h = RANGE_HI(r);
+			mid = l + (h - l) / 2;
+		}
+		while (l < h && !__atomic_compare_exchange_n(&victim->range, &r, RANGE(l, mid), 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+		if (l < h)
+		{
+			__atomic_store_n(&pool.workers[id].range, RANGE(mid, h), __ATOMIC_RELEASE);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* process chunks of the job as worker id until no work is left */
+static void bitset_pool_work(struct bitset_job *job, int id, int nthreads)
+{
+	int lo, hi, ret, err;
+
+	for (;;)
+	{
+		if (!bitset_pool_take(&pool.workers[id], &lo, &hi))
+		{
+			if (!bitset_pool_steal(id, nthreads))
+				break;
+			continue;
+		}
+
+		/* once any chunk fails there is no point in doing more work */
+		if (__atomic_load_n(&job->error, __ATOMIC_RELAXED) != OK)
+			break;
+
+		ret = bitset_job_run(job, lo, hi);
+		if (ret < 0)
+		{
+			err = OK;
+			__atomic_compare_exchange_n(&job->error, &err, ret, 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			break;
+		}
+
+		__atomic_add_fetch(&job->result, ret, __ATOMIC_RELAXED);
+	}
+}
+
+static void *bitset_pool_thread(void *arg)
+{
+	struct bitset_worker *w = (struct bitset_worker *)arg;
+	struct bitset_job *job;
+	int id, nthreads;
+
+	id = w - pool.workers;
+
+	pthread_mutex_lock(&pool.lock);
+	for (;;)
+	{
+		while (!pool.stop && pool.generation == w->generation)
+			pthread_cond_wait(&pool.start, &pool.lock);
+
+		if (pool.stop)
+			break;
+
+		w->generation = pool.generation;
+		job = pool.job;
+		nthreads = pool.nthreads;
+		pthread_mutex_unlock(&pool.lock);
+
+		bitset_pool_work(job, id, nthreads);
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.running == 0)
+			pthread_cond_signal(&pool.done);
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+/* stop and join all the threads in the pool.  run_lock must be held */
+static void bitset_pool_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 1; i < pool.nthreads; i++)
+		pthread_join(pool.workers[i].thread, NULL);
+
+	pool.stop = 0;
+	pool.nthreads = 1;
+}
+
+/* Set the number of threads used by whole-set operations */
+int bitset_set_threads(int nthreads, int min_blocks)
+{
+	int i, ret = OK;
+
+	if (nthreads < 1 || nthreads > BITSET_MAX_THREADS || min_blocks < 0)
+		return ERRINPUT;
+
+	pthread_mutex_lock(&pool.run_lock);
+
+	bitset_pool_stop();
+
+	/* the pool threads share blocks between themselves, so they need the
+	 * thread-safe reference counts */
+	if (nthreads > 1)
+		bitset_set_threadsafe(1);
+
+	for (i = 1; i < nthreads; i++)
+	{
+		pool.workers[i].generation = pool.generation;
+		if (pthread_create(&pool.workers[i].thread, NULL, bitset_pool_thread, &pool.workers[i]) != 0)
+		{
+			ret = ERRMEM;
+			break;
+		}
+		pool.nthreads = i + 1;
+	}
+
+	pool.min_blocks = min_blocks;
+
+	pthread_mutex_unlock(&pool.run_lock);
+
+	return ret;
+}
+
+/* run the job over count blocks on all the threads in the pool */
+static int bitset_pool_run(struct bitset_job *job, int count)
+{
+	int i, n;
+
+	pthread_mutex_lock(&pool.run_lock);
+
+	n = pool.nthreads;
+
+	/* give each worker an equal share of the blocks to start with */
+	for (i = 0; i < n; i++)
+	{
+		__atomic_store_n(&pool.workers[i].range,
+			RANGE((int64_t)count * i / n, (int64_t)count * (i + 1) / n), __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.job = job;
+	pool.running = n - 1;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.lock);
+
+	/* the calling thread is worker 0 */
+	bitset_pool_work(job, 0, n);
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.running > 0)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pool.job = NULL;
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_mutex_unlock(&pool.run_lock);
+
+	return job->error != OK ? job->error : job->result;
+}
+
+/* apply op to the block indexes of bitset a chosen by visit, in parallel
+ * if a is large enough.  returns the sum of the op results or the first
+ * error.  a b with a different block size is first regrouped into blocks
+ * the size of a's */
+static int bitset_foreach_block(struct bitset *a, struct bitset *b, bitset_block_op op, int visit)
+{
+	struct bitset_job job = { a, b, op, visit, 0, OK };
+
+	if (b != NULL && b->block_shift != a->block_shift)
+	{
+		struct bitset *tmp = NULL;
+		int ret;
+
+		if ((ret = bitset_reblock(b, a->block_shift, &tmp)) == OK)
+			ret = bitset_foreach_block(a, tmp, op, visit);
+		bitset_free(tmp);
+		return ret;
+	}
+
+	/* blocks are inserted into a sparse directory by moving the others, so
+	 * only one thread can work on it */
+	if (pool.nthreads > 1 && a->block_count >= pool.min_blocks &&
+			a->keys == NULL && (b == NULL || b->keys == NULL))
+		return bitset_pool_run(&job, a->block_count);
+
+	return bitset_job_run(&job, 0, a->block_count);
+}
+
+
+
+/******************************************************************************
+ * OBJECT ALLOCATION AND DESTRUCTION
+ */
+
+/* allocate a bitset with count bits in it, numbered 0 - (count-1)
+ * all bits are initially set to 0 */
+int bitset_alloc(int bitcount, struct bitset **bset_out) 
+{
+	return bitset_alloc_blocksize(bitcount, BLOCKSIZE, bset_out);
+}
+
+
+/* allocate a bitset with blocks of blocksize words */
+int bitset_alloc_blocksize(int bitcount, int blocksize, struct bitset **bset_out) 
+{
+	struct bitset *bset = NULL;
+	int ret;
+
+	if (bset_out == NULL || *bset_out != NULL) 
+	{
+		ret = ERRINPUT;
+		goto exit;
+	}
+
+	bset = (struct bitset *)malloc(sizeof(struct bitset));
+	if (bset == NULL) 
+	{
+		ret = ERRMEM;
+		goto exit;
+	}
+
+	bitset_count_alloc(sizeof(struct bitset));
+
+	if ((ret = bitset_init_blocksize(bset, bitcount, blocksize)) != OK)
+	{
+		goto exit;
+	}
+
+	*bset_out = bset;
+	bset = NULL;
+
+exit:
+	if (bset != NULL) 
+	{
+		bitset_free(bset);
+	}
+
+	return ret;
+}
+
+
+/* allocate a small bitset, which holds its bits inline until there are too
+ * many of them */
+int bitset_alloc_small(int bitcount, struct bitset **bset_out) 
+{
+	struct bitset *bset;
+
+	if (bitcount < 0 || bset_out == NULL || *bset_out != NULL)
+		return ERRINPUT;
+
+	bset = (struct bitset *)malloc(sizeof(struct bitset));
+	if (bset == NULL) 
+		return ERRMEM;
+
+	bitset_count_alloc(sizeof(struct bitset));
+
+	memset(bset, 0, sizeof(struct bitset));
+	bset->bitcount = bitcount;
+	bset->block_shift = BITSET_BLOCK_SHIFT;
+	bset->block_count = BITSET_BLOCKCOUNT(bset, bitcount);
+	bset->small = 1;
+
+	if (bitset_alloc_stats(bset) != OK)
+	{
+		bitset_free(bset);
+		return ERRMEM;
+	}
+
+	*bset_out = bset;
+
+	return OK;
+}
+
+
+/* allocate the empty block directory of a bitset, sparse if it is large */
+static int bitset_alloc_directory(struct bitset *bset)
+{
+	if (bset->block_count >= BITSET_SPARSE_BLOCKS)
+		return bitset_keys_reserve(bset, 1);
+
+	return bitset_dense_alloc(bset->block_count, &bset->blocks, &bset->occupied);
+}
+
+
+/* initialize a bitset structure */
+int bitset_init(struct bitset *bset, int bitcount) 
+{
+	return bitset_init_blocksize(bset, bitcount, BLOCKSIZE);
+}
+
+
+/* initialize a bitset structure with blocks of blocksize words */
+int bitset_init_blocksize(struct bitset *bset, int bitcount, int blocksize) 
+{
+	memset(bset, 0, sizeof(struct bitset));
+
+	/* the block size is a power of two number of whole pages */
+	if (bitcount < 0 || blocksize < BITSET_MIN_BLOCKSIZE ||
+		blocksize > BITSET_MAX_BLOCKSIZE || (blocksize & (blocksize - 1)) != 0)
+		return ERRINPUT;
+
+	bset->bitcount = bitcount;
+	bset->block_shift = __builtin_ctz(blocksize * BITSPERINT);
+	bset->block_count = BITSET_BLOCKCOUNT(bset, bitcount);
+
+	if (bitset_alloc_stats(bset) != OK)
+		return ERRMEM;
+
+	return bitset_alloc_directory(bset);
+}
+
+
+/* free a bitset structure */
+void bitset_free(struct bitset *bset)
+{
+	if (bset) 
+	{
+		bitset_free_directory(bset);
+
+		if (bset->mvcc)
+			bitset_mvcc_free(bset->mvcc);
+
+		if (bset->journal)
+			bitset_journal_close(bset);
+
+		free(bset->stats);
+		free(bset);
+	}
+}
+
+
+/* duplicate a bitset and return it */
+int bitset_dup(struct bitset *s, struct bitset **r)
+{
+	struct bitset *bset = NULL;
+	int i, ret;
+	size_t sz;
+
+	if (!s)
+	{
+		ret = ERRINPUT;
+		goto exit;
+	}
+		
+	if (r == NULL || *r != NULL) 
+	{
+		ret = ERRINPUT;
+		goto exit;
+	}
+
+	bset = (struct bitset *)malloc(sizeof(struct bitset));
+	if (bset == NULL) 
+	{
+		ret = ERRMEM;
+		goto exit;
+	}
+	memset(bset, 0, sizeof(struct bitset));
+
+	bitset_count_alloc(sizeof(struct bitset));
+
+	if ((ret = bitset_alloc_stats(bset)) != OK)
+		goto exit;
+
+	bset->bitcount = s->bitcount;
+	bset->block_shift = s->block_shift;
+	bset->block_count = s->block_count;
+
+	if (s->small)
+	{
+		bset->small = 1;
+		bset->small_count = s->small_count;
+		memcpy(bset->small_ids, s->small_ids, sizeof(int) * s->small_count);
+		*r = bset;
+		return OK;
+	}
+
+	if (s->keys != NULL)
+	{
+		/* a sparse directory is copied as it is */
+		if ((ret = bitset_keys_reserve(bset, s->key_count > 0 ? s->key_count : 1)) != OK)
+			goto exit;
+
+		memcpy(bset->keys, s->keys, sizeof(int) * s->key_count);
+		memcpy(bset->blocks, s->blocks, sizeof(struct bitset_block *) * s->key_count);
+		bset->key_count = s->key_count;
+		for (i = 0; i < bset->key_count; i++)
+		{
+			if (bset->blocks[i] != NULL)
+				bitset_block_incref(bset->blocks[i]);
+		}
+	}
+	else
+	{
+		sz = sizeof(struct bitset_block *) * bset->block_count;
+		bset->blocks = (struct bitset_block **) calloc(1, sz);
+		if (bset->blocks == NULL)
+		{
+			ret = ERRMEM;
+			goto exit;
+		}
+
+		bitset_count_alloc(sz);
+
+		sz = sizeof(uint64_t) * ((bset->block_count + 63) / 64);
+		bset->occupied = (uint64_t *) malloc(sz);
+		if (bset->occupied == NULL)
+		{
+			ret = ERRMEM;
+			goto exit;
+		}
+
+		bitset_count_alloc(sz);
+
+		/* only the occupied parts of the directory are copied */
+		memcpy(bset->occupied, s->occupied, sz);
+		for (i = 0; (i = bitset_next_block(s, i)) < bset->block_count; i++) 
+		{
+			if (s->blocks[i] != NULL)
+			{
+				bset->blocks[i] = s->blocks[i];
+				bitset_block_incref(bset->blocks[i]);
+			}
+		}
+	}
+
+	*r = bset;
+	bset = NULL;
+
+	ret = OK;
+
+exit:
+	if (bset != NULL) 
+	{
+		bitset_free(bset);
+	}
+
+	return ret;
+}
+
+
+/* copy bitset S into a new bitset whose blocks hold 1 << shift bits.  the
+ * pages are shared with S, so only the directory and blocks are new */
+static int bitset_reblock(struct bitset *s, int shift, struct bitset **r)
+{
+	struct bitset *bset = NULL;
+	struct bitset_block *blk, *sblk;
+	int i, p, g, pages, ret;
+
+	if (s->small)
+	{
+		if ((ret = bitset_dup(s, r)) != OK)
+			return ret;
+		(*r)->block_shift = shift;
+		(*r)->block_count = BITSET_BLOCKCOUNT(*r, (*r)->bitcount);
+		return OK;
+	}
+
+	ret = bitset_alloc_blocksize(s->bitcount, (1 << shift) / BITSPERINT, &bset);
+	if (ret != OK)
+		goto exit;
+
+	pages = BITSET_BLOCK_PAGES(bset);
+	for (i = 0; (i = bitset_next_block(s, i)) < s->block_count; i++)
+	{
+		if ((sblk = bitset_block_at(s, i)) == NULL)
+			continue;
+
+		for (p = 0; p < sblk->page_count; p++)
+		{
+			if (sblk->pages[p] == NULL)
+				continue;
+
+			/* page p of block i is page g of the whole set */
+			g = i * sblk->page_count + p;
+			if ((blk = bitset_block_at(bset, g / pages)) == NULL &&
+				(ret = bitset_block_alloc(bset, g / pages, &blk)) != OK)
+				goto exit;
+			bitset_block_share_page(blk, g % pages, sblk->pages[p]);
+		}
+	}
+
+	*r = bset;
+	bset = NULL;
+
+	ret = OK;
+
+exit:
+	if (bset != NULL)
+		bitset_free(bset);
+
+	return ret;
+}
+
+
+/* clear the bits from bitcount to the end of the block holding it.  the
+ * pages to change are copied first, so running out of memory leaves the
+ * bits as they were */
+static int bitset_clear_tail(struct bitset *bset, int bitcount)
+{
+	struct bitset_block *blk;
+	struct bitset_page *page;
+	int block, bit, p, ret;
+
+	BLOCK_DIVMOD(bset, bitcount, block, bit);
+	if (bit == 0 || (blk = bitset_block_at(bset, block)) == NULL ||
+		bitset_block_find_next_on_bit(blk, bit) == -1)
+		return OK;
+
+	if (bitset_block_shared(blk))
+	{
+		if ((ret = bitset_block_realloc(bset, block, &blk)) != OK)
+			return ret;
+	}
+
+	for (p = bit / IDSPERPAGE; p < blk->page_count; p++)
+	{
+		if (blk->pages[p] != NULL && (ret = bitset_page_writable(blk, p, &page)) != OK)
+			return ret;
+	}
+
+	while ((bit = bitset_block_find_next_on_bit(blk, bit)) != -1)
+	{
+		if ((ret = bitset_block_clr_bit(blk, bit)) != OK)
+			return ret;
+	}
+
+	return OK;
+}
+
+/* grow the dense directory of bset to block_count blocks.  on failure the
+ * directory is left as it was */
+static int bitset_dense_grow(struct bitset *bset, int block_count)
+{
+	struct bitset_block **blocks;
+	uint64_t *occupied;
+	int words, old_words;
+
+	words = (block_count + 63) / 64;
+	old_words = (bset->block_count + 63) / 64;
+
+	/* only the directory moves.  the blocks themselves stay shared */
+	blocks = (struct bitset_block **) realloc(bset->blocks,
+		sizeof(struct bitset_block *) * (block_count ? block_count : 1));
+	if (blocks == NULL)
+		return ERRMEM;
+	bset->blocks = blocks;
+
+	occupied = (uint64_t *) realloc(bset->occupied,
+		sizeof(uint64_t) * (words ? words : 1));
+	if (occupied == NULL)
+		return ERRMEM;
+	bset->occupied = occupied;
+
+	if (block_count > bset->block_count)
+	{
+		bitset_count_alloc(sizeof(struct bitset_block *) * (block_count - bset->block_count));
+		memset(blocks + bset->block_count, 0,
+			sizeof(struct bitset_block *) * (block_count - bset->block_count));
+	}
+	if (words > old_words)
+	{
+		bitset_count_alloc(sizeof(uint64_t) * (words - old_words));
+		memset(occupied + old_words, 0, sizeof(uint64_t) * (words - old_words));
+	}
+
+	return OK;
+}
+
+/* release the blocks of bset from block_count on, and shrink its directory
+ * to block_count blocks.  this cannot fail: if shrinking a dense directory
+ * fails, the larger one is kept */
+static void bitset_directory_shrink(struct bitset *bset, int block_count)
+{
+	struct bitset_block **blocks;
+	uint64_t *occupied;
+	int i, k, words;
+
+	if (bset->keys != NULL)
+	{
+		k = bitset_key_find(bset, block_count);
+		for (i = k; i < bset->key_count; i++)
+		{
+			if (bset->blocks[i] != NULL)
+				bitset_block_decref(bset->blocks[i]);
+		}
+		bset->key_count = k;
+		return;
+	}
+
+	for (i = block_count; (i = bitset_next_block(bset, i)) < bset->block_count; i++)
+	{
+		if (bset->blocks[i] != NULL)
+		{
+			bitset_block_decref(bset->blocks[i]);
+			bset->blocks[i] = NULL;
+		}
+	}
+
+	words = (block_count + 63) / 64;
+	if (words > 0 && block_count % 64 != 0)
+		bset->occupied[words - 1] &= ~(~0ull << (block_count % 64));
+
+	blocks = (struct bitset_block **) realloc(bset->blocks,
+		sizeof(struct bitset_block *) * (block_count ? block_count : 1));
+	if (blocks != NULL)
+		bset->blocks = blocks;
+
+	occupied = (uint64_t *) realloc(bset->occupied,
+		sizeof(uint64_t) * (words ? words : 1));
+	if (occupied != NULL)
+		bset->occupied = occupied;
+}
+
+/* change the number of bits in a bitset */
+int bitset_resize(struct bitset *bset, int bitcount)
+{
+	int block_count, ret;
+
+	if (bset == NULL || bitcount < 0)
+		return ERRINPUT;
+
+	/* the journal header records the size of the bitset */
+	if (bset->journal != NULL)
+		return ERRINPUT;
+
+	if (bset->small)
+	{
+		bset->small_count = bitset_small_find(bset, bitcount);
+		bset->bitcount = bitcount;
+		bset->block_count = BITSET_BLOCKCOUNT(bset, bitcount);
+		return OK;
+	}
+
+	block_count = BITSET_BLOCKCOUNT(bset, bitcount);
+
+	if (bitcount > bset->bitcount)
+	{
+		/* the bits being added must start out 0 */
+		if ((ret = bitset_clear_tail(bset, bset->bitcount)) != OK)
+			return ret;
+
+		/* a directory which grows large with few blocks occupied is made
+		 * sparse, if there is memory for it */
+		if (bset->keys == NULL && block_count >= BITSET_SPARSE_BLOCKS &&
+			bitset_occupied_count(bset) <= block_count / BITSET_SPARSE_RATIO)
+			bitset_directory_sparse(bset);
+
+		/* a sparse directory has no entries for the new blocks to add */
+		if (bset->keys == NULL && (ret = bitset_dense_grow(bset, block_count)) != OK)
+			return ret;
+	}
+	else
+	{
+		/* a smaller bitset may end part way through its last block.  this
+		 * is the only step of a shrink which can fail */
+		if ((ret = bitset_clear_tail(bset, bitcount)) != OK)
+			return ret;
+
+		bitset_directory_shrink(bset, block_count);
+	}
+
+	bset->bitcount = bitcount;
+	bset->block_count = block_count;
+
+	return OK;
+}
+
+/* give a bitset a dense block directory */
+int bitset_set_dense(struct bitset *bset)
+{
+	if (bset == NULL)
+		return ERRINPUT;
+
+	if (bset->small || bset->keys == NULL)
+		return OK;
+
+	return bitset_directory_dense(bset);
+}
+
+
+
+/******************************************************************************
+ * OBJECT INFORMATION
+ */
+
+/* get the count of total bits in the bitset */
+int bitset_bitcount(struct bitset *b)
+{
+	if (!b)
+		return ERRINPUT;
+	return b->bitcount;
+}
+
+/* get the count of bits in block i of bitset b which are set to 1 */
+static int bitset_count_block(struct bitset *b, struct bitset *unused, int i)
+{
+	struct bitset_block *blk;
+
+	(void)unused;
+
+	if ((blk = bitset_block_at(b, i)) == NULL)
+	{
+		STAT(b, null_skips, 1);
+		return 0;
+	}
+
+	STAT(b, count_blocks, 1);
+	return blk->set_count;
+}
+
+/* get the count of bits in the bitset which are set to 1 */
+int bitset_set_count(struct bitset *b)
+{
+	if (!b)
+		return ERRINPUT;
+
+	if (b->small)
+		return b->small_count;
+
+	return bitset_foreach_block(b, NULL, bitset_count_block, VISIT_A);
+}
+
+/* find the first allocated block in the bitset at index start or greater
+ * if block start is an allocated block, then start will be returned
+ * if there is not a block at start, then the lowest index containing
+ * an allocated block which is greater than start will be returned.
+ * if there is no allocated block, then the value returned will be
+ * equal to bset->block_count */
+static int bitset_find_allocated_block(struct bitset *bset, int start)
+{
+	assert(start >= 0 && start < bset->block_count);
+
+	/* locate the first allocated block in the structure */
+	for (; (start = bitset_next_block(bset, start)) < bset->block_count; start++) 
+	{
+		if (bitset_block_at(bset, start) != NULL)
+			break;
+	}
+
+	return start;
+}
+
+
+/******************************************************************************
+ * BIT OPERATIONS
+ */
+
+/* set a bit to 1 without logging it.  returns 1 if the bit changed, 0 if it
+ * was already set, or an error code */
+static int bitset_set_unlogged(struct bitset *bset, int bit)
+{
+	int block, block_bit, ret;
+	struct bitset_block *blk;
+
+	if (bset->small)
+	{
+		if (bitset_small_test(bset, bit))
+			return 0;
+		if (bitset_small_set(bset, bit))
+			return 1;
+
+		/* there is no room left inline, so move the bits into blocks */
+		if ((ret = bitset_small_promote(bset)) != OK)
+			return ret;
+	}
+
+	BLOCK_DIVMOD(bset, bit, block, block_bit);
+	assert(block < bset->block_count);
+
+	if ((blk = bitset_block_at(bset, block)) == NULL) 
+	{
+		/* need to allocate the block */
+		if ((ret = bitset_block_alloc(bset, block, &blk)) != OK)
+			return ret;
+	}
+	else
+	{
+		/* if the bit is already set, this is a no-op */
+		if (bitset_block_test_bit(blk, block_bit))
+			return 0;
+
+		/* if the block is a shared block, need to allocate a new one */
+		if (bitset_block_shared(blk)) 
+		{
+			if ((ret = bitset_block_realloc(bset, block, &blk)) != OK)
+				return ret;
+		}
+	}
+
+	if ((ret = bitset_block_set_bit(blk, block_bit)) != OK)
+		return ret;
+
+	return 1;
+}
+
+/* set a bit to 1 in the bitset */
+int bitset_set(struct bitset *bset, int bit)
+{
+	int ret;
+
+	if (bit < 0 || bit >= bset->bitcount)
+		return ERRINPUT;
+
+	if ((ret = bitset_set_unlogged(bset, bit)) <= 0)
+		return ret;
+
+	return bitset_journal_log(bset, JOURNAL_SET, bit);
+}
+
+
+/* set a bit to 0 without logging it.  returns 1 if the bit changed, 0 if it
+ * was already clear, or an error code */
+static int bitset_clr_unlogged(struct bitset *bset, int bit)
+{
+	int block, block_bit, ret;
+	struct bitset_block *blk;
+
+	if (bset->small)
+	{
+		if (!bitset_small_test(bset, bit))
+			return 0;
+		bitset_small_clr(bset, bit);
+		return 1;
+	}
+
+	BLOCK_DIVMOD(bset, bit, block, block_bit);
+	assert(block < bset->block_count);
+
+	if ((blk = bitset_block_at(bset, block)) == NULL) 
+	{
+		/* no need to clear if there is no block there */
+		return 0;
+	}
+
+	/* if the bit is already clear, this is a no-op */
+	if (bitset_block_test_bit(blk, block_bit) == 0)
+		return 0;
+
+	/* if the block is a shared block, need to allocate a new one */
+	if (bitset_block_shared(blk)) 
+	{
+		if ((ret = bitset_block_realloc(bset, block, &blk)) != OK)
+			return ret;
+	}
+
+	if ((ret = bitset_block_clr_bit(blk, block_bit)) != OK)
+		return ret;
+
+	return 1;
+}
+
+/* set a bit to 0 in the bitset */
+int bitset_clr(struct bitset *bset, int bit)
+{
+	int ret;
+
+	if (bit < 0 || bit >= bset->bitcount)
+		return ERRINPUT;
+
+	if ((ret = bitset_clr_unlogged(bset, bit)) <= 0)
+		return ret;
+
+	return bitset_journal_log(bset, JOURNAL_CLR, bit);
+}
+
+
+/* invert a single bit in the bitset */
+int bitset_toggle_bit(struct bitset *bset, int bit)
 {
 	int block, block_bit, ret;
 	struct bitset_block *blk = NULL;
 
-	if (bit < 0 || bit >= bset->bitcount)
+	if (bit < 0 || bit >= bset->bitcount)
+		return ERRINPUT;
+
+	if (bset->small)
+	{
+		if (bitset_small_test(bset, bit))
+			ret = bitset_clr_unlogged(bset, bit);
+		else
+			ret = bitset_set_unlogged(bset, bit);
+		if (ret < 0)
+			return ret;
+
+		return bitset_journal_log(bset, JOURNAL_TOGGLE, bit);
+	}
+
+	BLOCK_DIVMOD(bset, bit, block, block_bit);
+	assert(block < bset->block_count);
+
+	if ((blk = bitset_block_at(bset, block)) == NULL) 
+	{
+		/* need to allocate the block */
+		if ((ret = bitset_block_alloc(bset, block, &blk)) != OK)
+			return ret;
+	}
+	else
+	{
+		/* if the block is a shared block, need to allocate a new one */
+		if (bitset_block_shared(blk)) 
+		{
+			if ((ret = bitset_block_realloc(bset, block, &blk)) != OK)
+				return ret;
+		}
+	}
+
+	assert(blk != NULL);
+
+	if ((ret = bitset_block_toggle_bit(blk, block_bit)) != OK)
+		return ret;
+
+	return bitset_journal_log(bset, JOURNAL_TOGGLE, bit);
+}
+
+
+/* test if a bit in the bitset is on */
+int bitset_test_bit(struct bitset *a, int bit, int *out)
+{
+	int block, block_bit;
+	struct bitset_block *blk;
+
+	if (bit < 0 || bit >= a->bitcount)
+		return ERRINPUT;
+	if (out == NULL)
+		return ERRINPUT;
+
+	if (a->small)
+	{
+		*out = bitset_small_test(a, bit);
+		return OK;
+	}
+
+	BLOCK_DIVMOD(a, bit, block, block_bit);
+	assert(block < a->block_count);
+
+	if ((blk = bitset_block_at(a, block)) == NULL) 
+	{
+		*out = 0;
+	}
+	else
+	{
+		*out = bitset_block_test_bit(blk, block_bit);
+	}
+
+	return OK;
+}
+
+
+/* set many bits to 1 in the bitset.  bits which fall in the same word are
+ * gathered and written to the word at once, and the block and page are only
+ * looked up again when the bits move on to a different page, so sorted
+ * input fills each block's words directly */
+int bitset_set_bulk(struct bitset *bset, const int *bits, int count)
+{
+	struct bitset_block *blk = NULL;
+	struct bitset_page *page = NULL;
+	int i, block, block_bit, p, n, b, page_index = -1, ret = OK;
+	uint64_t w;
+
+	if (bset == NULL || (bits == NULL && count > 0))
+		return ERRINPUT;
+
+	/* a small set takes the bits one at a time until it fills up and moves
+	 * to blocks */
+	for (i = 0; i < count && bset->small; i++)
+	{
+		if (bits[i] < 0 || bits[i] >= bset->bitcount)
+		{
+			ret = ERRINPUT;
+			goto exit;
+		}
+
+		if ((ret = bitset_set_unlogged(bset, bits[i])) < 0)
+			goto exit;
+		ret = OK;
+	}
+
+	while (i < count)
+	{
+		if (bits[i] < 0 || bits[i] >= bset->bitcount)
+		{
+			ret = ERRINPUT;
+			goto exit;
+		}
+
+		if (bits[i] / IDSPERPAGE != page_index)
+		{
+			page_index = bits[i] / IDSPERPAGE;
+
+			BLOCK_DIVMOD(bset, bits[i], block, block_bit);
+			assert(block < bset->block_count);
+
+			if ((blk = bitset_block_at(bset, block)) == NULL)
+			{
+				if ((ret = bitset_block_alloc(bset, block, &blk)) != OK)
+					goto exit;
+			}
+			else if (bitset_block_shared(blk))
+			{
+				if ((ret = bitset_block_realloc(bset, block, &blk)) != OK)
+					goto exit;
+			}
+
+			if ((ret = bitset_page_writable(blk, block_bit / IDSPERPAGE, &page)) != OK)
+				goto exit;
+		}
+
+		/* collect the run of bits that land in the same word */
+		DIVMOD(bits[i] % IDSPERPAGE, BITSPERINT, n, b);
+		w = 1ull << b;
+		for (i++; i < count && bits[i] >= 0 && bits[i] < bset->bitcount &&
+				bits[i] / BITSPERINT == bits[i-1] / BITSPERINT; i++)
+			w |= 1ull << (bits[i] % BITSPERINT);
+
+		/* count only the bits that were not already set */
+		p = __builtin_popcountll(w & ~page->ints[n]);
+		page->ints[n] |= w;
+		page->set_count += p;
+		blk->set_count += p;
+	}
+
+exit:
+	/* the bits before an error were set, so they are logged too */
+	if (i > 0 && (n = bitset_journal_log_bulk(bset, bits, i)) != OK && ret == OK)
+		ret = n;
+
+	return ret;
+}
+
+
+/* replace the bits of a whole page.  words past the end of the bitset are
+ * ignored */
+int bitset_store_page(struct bitset *bset, int page, const uint64_t *words)
+{
+	struct bitset_block *blk;
+	struct bitset_page *pg;
+	int block, p, i, end, n = 0, ret;
+	uint64_t w[PAGESIZE];
+
+	if (bset == NULL || words == NULL || page < 0 || page >= bset->block_count * BITSET_BLOCK_PAGES(bset))
+		return ERRINPUT;
+
+	/* whole pages are not journaled */
+	if (bset->journal != NULL)
+		return ERRINPUT;
+
+	/* keep only the words, and bits, before the end of the bitset */
+	end = bset->bitcount - page * IDSPERPAGE;
+	for (i = 0; i < PAGESIZE; i++)
+	{
+		if (end >= (i + 1) * BITSPERINT)
+			w[i] = words[i];
+		else if (end > i * BITSPERINT)
+			w[i] = words[i] & ~(~0ull << (end - i * BITSPERINT));
+		else
+			w[i] = 0;
+		n += __builtin_popcountll(w[i]);
+	}
+
+	if (bset->small && (ret = bitset_small_promote(bset)) != OK)
+		return ret;
+
+	DIVMOD(page, BITSET_BLOCK_PAGES(bset), block, p);
+
+	if ((blk = bitset_block_at(bset, block)) == NULL)
+	{
+		if (n == 0)
+			return OK;
+		if ((ret = bitset_block_alloc(bset, block, &blk)) != OK)
+			return ret;
+	}
+	else
+	{
+		if (n == 0 && blk->pages[p] == NULL)
+			return OK;
+		if (bitset_block_shared(blk) && (ret = bitset_block_realloc(bset, block, &blk)) != OK)
+			return ret;
+	}
+
+	/* an empty page is dropped rather than stored */
+	if (n == 0)
+	{
+		bitset_block_drop_page(blk, p);
+		return OK;
+	}
+
+	if ((ret = bitset_page_writable(blk, p, &pg)) != OK)
+		return ret;
+
+	memcpy(pg->ints, w, sizeof(w));
+	blk->set_count += n - pg->set_count;
+	pg->set_count = n;
+
+	return OK;
+}
+
+
+/* set a bit to 1 in a bitset which other threads may be setting bits in at
+ * the same time */
+int bitset_set_concurrent(struct bitset *bset, int bit)
+{
+	int block, block_bit, p, ret;
+	struct bitset_block *blk;
+	struct bitset_page *page;
+
+	/* a small set has no blocks to install bits in */
+	if (bset->small)
+		return ERRINPUT;
+
+	if (bit < 0 || bit >= bset->bitcount)
+		return ERRINPUT;
+
+	/* the shared allocation counters must be updated atomically, the
+	 * journal can only be written by one thread, and blocks can only be
+	 * installed in a dense directory with compare-and-swap */
+	if (!threadsafe || bset->journal != NULL || bset->keys != NULL)
+		return ERRINPUT;
+
+	BLOCK_DIVMOD(bset, bit, block, block_bit);
+	assert(block < bset->block_count);
+
+	if ((blk = __atomic_load_n(&bset->blocks[block], __ATOMIC_ACQUIRE)) == NULL)
+	{
+		/* need to allocate the block; another thread may beat us to it */
+		if ((ret = bitset_block_install(bset, block, &blk)) != OK)
+			return ret;
+	}
+
+	/* copy-on-write cannot be done safely while other threads are writing
+	 * to the block, so shared blocks and pages are refused */
+	if (bitset_block_shared(blk))
+		return ERRINPUT;
+
+	DIVMOD(block_bit, IDSPERPAGE, p, block_bit);
+
+	if ((page = __atomic_load_n(&blk->pages[p], __ATOMIC_ACQUIRE)) == NULL)
+	{
+		if ((ret = bitset_page_install(blk, p, &page)) != OK)
+			return ret;
+	}
+
+	if (bitset_page_shared(page))
+		return ERRINPUT;
+
+	/* only the thread which actually flipped the bit counts it */
+	if (bitset_page_set_bit_atomic(page, block_bit))
+		__atomic_add_fetch(&blk->set_count, 1, __ATOMIC_RELAXED);
+
+	return OK;
+}
+
+
+
+/******************************************************************************
+ * SET OPERATIONS
+ */
+
+/* invert all of the bits in block i of bitset a */
+static int bitset_invert_block(struct bitset *a, struct bitset *unused, int i)
+{
+	struct bitset_block *blk;
+	int ret;
+
+	(void)unused;
+
+	STAT(a, invert_blocks, 1);
+
+	if ((blk = bitset_block_at(a, i)) == NULL)
+	{
+		/* block is a NULL pointer, so the invert is a block of all 1 bits.
+		 * allocate an empty block and let the block invert fill it */
+		ret = bitset_block_alloc(a, i, &blk);
+		if (ret != OK)
+			return ret;
+
+		return bitset_block_invert(blk);
+	}
+
+	if (blk->set_count == BITSET_BLOCK_IDS(a))
+	{
+		/* the block is all 1's so the inverse will be all empty
+		 * this can be represented by a NULL block pointer, so
+		 * decref the block and set the pointer NULL */
+		bitset_block_decref(blk);
+		bitset_block_store(a, i, NULL);
+		return OK;
+	}
+
+	/* since we are going to modify the block, we need to
+	 * re-allocate it if it is a shared block */
+	if (bitset_block_shared(blk))
+	{
+		if ((ret = bitset_block_realloc(a, i, &blk)) != OK)
+			return ret;
+	}
+
+	/* do real inversion of the bits in the block */
+	return bitset_block_invert(blk);
+}
+
+/* Invert all of the bits in the bitset */
+int bitset_invert(struct bitset *a)
+{
+	int ret;
+
+	if (a == NULL)
+		return ERRINPUT;
+
+	/* the inverse of a small set is nearly full */
+	if (a->small && (ret = bitset_small_promote(a)) != OK)
+		return ret;
+
+	if ((ret = bitset_foreach_block(a, NULL, bitset_invert_block, VISIT_ALL)) != OK)
+		return ret;
+
+	return bitset_journal_log(a, JOURNAL_INVERT, 0);
+}
+
+
+/* Compute the inverse of the bitset and return it as a new bitset */
+int bitset_inverse(struct bitset *a, struct bitset **result_out)
+{
+	struct bitset *r = NULL;
+	int ret;
+
+	if (result_out == NULL || *result_out != NULL)
+		return ERRINPUT;
+
+	ret = bitset_dup(a, &r);
+	if (ret != OK)
+		goto exit;
+	
+	ret = bitset_invert(r);
+	if (ret != OK)
+		goto exit;
+
+	*result_out = r;
+	r = NULL;
+
+	ret = OK;
+
+exit:
+	if (r != NULL) 
+		bitset_free(r);
+
+	return ret;
+}
+
+
+/* OR block i of bitset B into block i of bitset A */
+static int bitset_or_block(struct bitset *a, struct bitset *b, int i)
+{
+	struct bitset_block *blk = bitset_block_at(b, i);
+	struct bitset_block *ablk = bitset_block_at(a, i);
+	int ret;
+
+	if (blk == NULL)
+	{
+		STAT(a, null_skips, 1);
+		return OK;
+	}
+
+	/* OR-ing a block into itself leaves it unchanged */
+	if (ablk == blk)
+	{
+		STAT(a, shared_skips, 1);
+		return OK;
+	}
+
+	if (ablk == NULL && blk != NULL)
+	{
+		/* OR-ing a NON null block into a NULL block is simply copying the other block over */
+		if ((ret = bitset_block_store(a, i, blk)) != OK)
+			return ret;
+		bitset_block_incref(blk);
+	}
+	else if (ablk != NULL && blk != NULL)
+	{
+		/* if both blocks are non NULL, we need to OR the contents together */
+
+		/* first, since we are going to modify block i of a, we need to
+		 * re-allocate it if it is a shared block */
+		if (bitset_block_shared(ablk)) 
+		{
+			if ((ret = bitset_block_realloc(a, i, &ablk)) != OK)
+				return ret;
+		}
+
+		STAT(a, or_blocks, 1);
+		if ((ret = bitset_block_or(ablk, blk)) != OK)
+			return ret;
+	}
+	return OK;
+}
+
+/* combine bitset A and B into bitset A by making A be the result of A | B (union) */
+int bitset_or(struct bitset *a, struct bitset *b)
+{
+	int ret;
+
+	if (a == NULL || b == NULL) 
+		return ERRINPUT;
+
+	/* the journal records the operand by its id */
+	if (a->journal != NULL && b->id <= 0)
+		return ERRINPUT;
+
+	if (a->small || b->small)
+	{
+		/* the union with a large set is large */
+		if (a->small && !b->small && (ret = bitset_small_promote(a)) != OK)
+			return ret;
+	}
+
+	if (b->small)
+	{
+		if ((ret = bitset_small_or(a, b)) != OK)
+			return ret;
+	}
+	else
+	{
+		if ((ret = bitset_foreach_block(a, b, bitset_or_block, VISIT_B)) != OK)
+			return ret;
+
+		/* a larger B may have bits past the end of A in A's last block */
+		if (b->bitcount > a->bitcount && (ret = bitset_clear_tail(a, a->bitcount)) != OK)
+			return ret;
+	}
+
+	return bitset_journal_log(a, JOURNAL_OR, b->id);
+}
+
+
+/* AND block i of bitset B into block i of bitset A */
+static int bitset_and_block(struct bitset *a, struct bitset *b, int i)
+{
+	struct bitset_block *blk = bitset_block_at(b, i);
+	struct bitset_block *ablk = bitset_block_at(a, i);
+	int ret;
+
+	if (ablk == NULL)
+	{
+		STAT(a, null_skips, 1);
+		return OK;
+	}
+
+	/* AND-ing a block with itself leaves it unchanged */
+	if (ablk == blk)
+	{
+		STAT(a, shared_skips, 1);
+		return OK;
+	}
+
+	if (ablk != NULL && blk == NULL)
+	{
+		/* AND-ing a NULL block into a not-NULL block sets all the bits to
+		 * 0 so we, drop the block of bitset A. */
+		bitset_block_decref(ablk);
+		bitset_block_store(a, i, NULL);
+	}
+	else if (ablk != NULL && blk != NULL)
+	{
+		/* if both blocks are non NULL, we need to AND the contents together */
+
+		/* first, since we are going to modify block i of a, we need to
+		 * re-allocate it if it is a shared block */
+		if (bitset_block_shared(ablk)) 
+		{
+			if ((ret = bitset_block_realloc(a, i, &ablk)) != OK)
+				return ret;
+		}
+
+		STAT(a, and_blocks, 1);
+		if ((ret = bitset_block_and(ablk, blk)) != OK)
+			return ret;
+	}
+	return OK;
+}
+
+/* combine bitset A and B into bitset A by making A be the result of A & B (intersection) */
+int bitset_and(struct bitset *a, struct bitset *b)
+{
+	int ret;
+
+	if (a == NULL || b == NULL) 
+		return ERRINPUT;
+
+	/* the journal records the operand by its id */
+	if (a->journal != NULL && b->id <= 0)
+		return ERRINPUT;
+
+	if (a->small || b->small)
+	{
+		if ((ret = bitset_small_and(a, b)) != OK)
+			return ret;
+	}
+	else if ((ret = bitset_foreach_block(a, b, bitset_and_block, VISIT_A)) != OK)
+		return ret;
+
+	return bitset_journal_log(a, JOURNAL_AND, b->id);
+}
+
+
+/* subtract block i of bitset B from block i of bitset A */
+static int bitset_subtract_block(struct bitset *a, struct bitset *b, int i)
+{
+	struct bitset_block *blk = bitset_block_at(b, i);
+	struct bitset_block *ablk = bitset_block_at(a, i);
+	int ret;
+
+	if (ablk == NULL || blk == NULL)
+	{
+		STAT(a, null_skips, 1);
+		return OK;
+	}
+
+	/* subtracting a block from itself leaves nothing */
+	if (ablk == blk)
+	{
+		STAT(a, shared_skips, 1);
+		bitset_block_decref(ablk);
+		bitset_block_store(a, i, NULL);
+		return OK;
+	}
+
+	if (ablk != NULL && blk != NULL)
+	{
+		/* if both blocks are non NULL, we subtract the bits in b from a */
+
+		/* first, since we are going to modify block i of a, we need to
+		 * re-allocate it if it is a shared block */
+		if (bitset_block_shared(ablk)) 
+		{
+			if ((ret = bitset_block_realloc(a, i, &ablk)) != OK)
+				return ret;
+		}
+
+		STAT(a, subtract_blocks, 1);
+		if ((ret = bitset_block_subtract(ablk, blk)) != OK)
+			return ret;
+	}
+	return OK;
+}
+
+/* set bitset A to be A - B */
+int bitset_subtract(struct bitset *a, struct bitset *b)
+{
+	int ret;
+
+	if (a == NULL || b == NULL) 
+		return ERRINPUT;
+
+	/* the journal records the operand by its id */
+	if (a->journal != NULL && b->id <= 0)
+		return ERRINPUT;
+
+	if (a->small || b->small)
+	{
+		if ((ret = bitset_small_subtract(a, b)) != OK)
+			return ret;
+	}
+	else if ((ret = bitset_foreach_block(a, b, bitset_subtract_block, VISIT_BOTH)) != OK)
+		return ret;
+
+	return bitset_journal_log(a, JOURNAL_SUBTRACT, b->id);
+}
+
+
+/* Compute the union of A and B and return it as a new bitset */
+int bitset_union(struct bitset *a, struct bitset *b, struct bitset **result_out)
+{
+	struct bitset *r = NULL;
+	int ret;
+
+	if (result_out == NULL || *result_out != NULL)
+		return ERRINPUT;
+
+	ret = bitset_dup(a, &r);
+	if (ret != OK)
+		goto exit;
+	
+	ret = bitset_or(r, b);
+	if (ret != OK)
+		goto exit;
+
+	*result_out = r;
+	r = NULL;
+
+	ret = OK;
+
+exit:
+	if (r != NULL) 
+		bitset_free(r);
+
+	return ret;
+}
+
+
+/* Compute the intersection of A and B (A & B) and return it as a new bitset */
+int bitset_intersect(struct bitset *a, struct bitset *b, struct bitset **result_out)
+{
+	struct bitset *r = NULL;
+	int ret;
+
+	if (result_out == NULL || *result_out != NULL)
+		return ERRINPUT;
+
+	ret = bitset_dup(a, &r);
+	if (ret != OK)
+		goto exit;
+	
+	ret = bitset_and(r, b);
+	if (ret != OK)
+		goto exit;
+
+	*result_out = r;
+	r = NULL;
+
+	ret = OK;
+
+exit:
+	if (r != NULL) 
+		bitset_free(r);
+
+	return ret;
+}
+
+
+/* Compute A - B and return it as a new bitset */
+int bitset_difference(struct bitset *a, struct bitset *b, struct bitset **result_out)
+{
+	struct bitset *r = NULL;
+	int ret;
+
+	if (result_out == NULL || *result_out != NULL)
+		return ERRINPUT;
+
+	ret = bitset_dup(a, &r);
+	if (ret != OK)
+		goto exit;
+	
+	ret = bitset_subtract(r, b);
+	if (ret != OK)
+		goto exit;
+
+	*result_out = r;
+	r = NULL;
+
+	ret = OK;
+
+exit:
+	if (r != NULL) 
+		bitset_free(r);
+
+	return ret;
+}
+
+
+
+/******************************************************************************
+ * SMALL SETS
+ *
+ * a small set keeps up to BITSET_SMALL_IDS bits as a sorted array inside the
+ * struct bitset, with no block directory and no blocks.  setting one more
+ * bit promotes it to blocks.  set operations between a small set and a large
+ * one test the bits of the small set in the large one directly.
+ */
+
+/* find the index of the first inline bit at or after bit */
+static int bitset_small_find(struct bitset *bset, int bit)
+{
+	int i;
+
+	for (i = 0; i < bset->small_count && bset->small_ids[i] < bit; i++)
+		;
+
+	return i;
+}
+
+/* test if a bit is in a small set */
+static int bitset_small_test(struct bitset *bset, int bit)
+{
+	int i = bitset_small_find(bset, bit);
+
+	return i < bset->small_count && bset->small_ids[i] == bit;
+}
+
+/* add a bit which is not yet in a small set.  returns 0 if the set is full */
+static int bitset_small_set(struct bitset *bset, int bit)
+{
+	int i;
+
+	if (bset->small_count == BITSET_SMALL_IDS)
+		return 0;
+
+	i = bitset_small_find(bset, bit);
+	memmove(&bset->small_ids[i + 1], &bset->small_ids[i], sizeof(int) * (bset->small_count - i));
+	bset->small_ids[i] = bit;
+	bset->small_count++;
+
+	return 1;
+}
+
+/* remove a bit which is in a small set */
+static void bitset_small_clr(struct bitset *bset, int bit)
+{
+	int i = bitset_small_find(bset, bit);
+
+	bset->small_count--;
+	memmove(&bset->small_ids[i], &bset->small_ids[i + 1], sizeof(int) * (bset->small_count - i));
+}
+
+/* keep only the bits of a small set for which keep(b, bit) is want */
+static void bitset_small_filter(struct bitset *a, struct bitset *b, int want)
+{
+	int i, n, x;
+
+	for (i = 0, n = 0; i < a->small_count; i++)
+	{
+		x = 0;
+		if (a->small_ids[i] < b->bitcount)
+			bitset_test_bit(b, a->small_ids[i], &x);
+		if (x == want)
+			a->small_ids[n++] = a->small_ids[i];
+	}
+	a->small_count = n;
+}
+
+/* move a small set to the block representation */
+static int bitset_small_promote(struct bitset *bset)
+{
+	int ids[BITSET_SMALL_IDS];
+	int i, n, ret;
+
+	n = bset->small_count;
+	memcpy(ids, bset->small_ids, sizeof(int) * n);
+
+	if ((ret = bitset_alloc_directory(bset)) != OK)
+		return ret;
+
+	bset->small = 0;
+	bset->small_count = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		if ((ret = bitset_set_unlogged(bset, ids[i])) < 0)
+			return ret;
+	}
+
+	return OK;
+}
+
+/* drop the blocks of a large set and keep the given bits inline instead */
+static void bitset_small_demote(struct bitset *bset, const int *ids, int n)
+{
+	bitset_free_directory(bset);
+
+	bset->small = 1;
+	bset->small_count = n;
+	memcpy(bset->small_ids, ids, sizeof(int) * n);
+}
+
+/* make a copy of a small set in the block representation, for the functions
+ * which read the blocks of a bitset directly */
+static int bitset_small_expand(struct bitset *bset, struct bitset **r)
+{
+	int ret;
+
+	if ((ret = bitset_dup(bset, r)) != OK)
+		return ret;
+
+	return bitset_small_promote(*r);
+}
+
+/* OR the bits of small set B into A */
+static int bitset_small_or(struct bitset *a, struct bitset *b)
+{
+	int i, ret;
+
+	for (i = 0; i < b->small_count && b->small_ids[i] < a->bitcount; i++)
+	{
+		if ((ret = bitset_set_unlogged(a, b->small_ids[i])) < 0)
+			return ret;
+	}
+
+	return OK;
+}
+
+/* AND B into A where either of them is small.  the result is small */
+static int bitset_small_and(struct bitset *a, struct bitset *b)
+{
+	int ids[BITSET_SMALL_IDS];
+	int i, n, x;
+
+	if (a->small)
+	{
+		bitset_small_filter(a, b, 1);
+		return OK;
+	}
+
+	/* probe the bits of B in A and keep only those */
+	for (i = 0, n = 0; i < b->small_count && b->small_ids[i] < a->bitcount; i++)
+	{
+		if (bitset_test_bit(a, b->small_ids[i], &x) == OK && x)
+			ids[n++] = b->small_ids[i];
+	}
+
+	bitset_small_demote(a, ids, n);
+
+	return OK;
+}
+
+/* subtract B from A where either of them is small */
+static int bitset_small_subtract(struct bitset *a, struct bitset *b)
+{
+	int i, ret;
+
+	if (a->small)
+	{
+		bitset_small_filter(a, b, 0);
+		return OK;
+	}
+
+	for (i = 0; i < b->small_count && b->small_ids[i] < a->bitcount; i++)
+	{
+		if ((ret = bitset_clr_unlogged(a, b->small_ids[i])) < 0)
+			return ret;
+	}
+
+	return OK;
+}
+
+
+
+/******************************************************************************
+ * SNAPSHOTS
+ *
+ * the writer publishes a version of the bitset by dup-ing it.  the version
+ * holds references on all of its blocks, so copy-on-write keeps the writer
+ * from ever changing a block the version can see.  readers pin the current
+ * epoch in a slot and then read the published version pointer; a version
+ * replaced by a later publish is retired with the epoch of the replacement,
+ * and it (along with any blocks only it still references) is freed once
+ * every pinned reader has an epoch at least that new.
+ */
+
+#define BITSET_MAX_READERS	128
+
+struct bitset_retired {
+	struct bitset *version;
+	uint64_t epoch;
+	struct bitset_retired *next;
+};
+
+struct bitset_mvcc {
+	/* the most recently published version */
+	struct bitset *current;
+
+	/* the publish epoch.  starts at 1 so a 0 reader slot is free */
+	uint64_t epoch;
+
+	/* the epoch pinned by each reader, or 0 */
+	uint64_t readers[BITSET_MAX_READERS];
+
+	/* replaced versions which readers may still be using */
+	struct bitset_retired *retired;
+};
+
+
+/* Publish the current contents of the bitset to snapshot readers */
+int bitset_publish(struct bitset *bset)
+{
+	struct bitset_mvcc *mvcc;
+	struct bitset_retired *r = NULL;
+	struct bitset *version = NULL, *old;
+	uint64_t e;
+	int ret;
+
+	if (bset == NULL)
+		return ERRINPUT;
+
+	if ((mvcc = bset->mvcc) == NULL)
+	{
+		mvcc = (struct bitset_mvcc *)malloc(sizeof(struct bitset_mvcc));
+		if (mvcc == NULL)
+			return ERRMEM;
+
+		memset(mvcc, 0, sizeof(struct bitset_mvcc));
+		mvcc->epoch = 1;
+		bset->mvcc = mvcc;
+	}
+
+	r = (struct bitset_retired *)malloc(sizeof(struct bitset_retired));
+	if (r == NULL)
+	{
+		ret = ERRMEM;
+		goto exit;
+	}
+
+	if ((ret = bitset_dup(bset, &version)) != OK)
+		goto exit;
+
+	/* swap in the new version, then advance the epoch.  any reader that can
+	 * still see the old version pinned an epoch older than e */
+	old = __atomic_exchange_n(&mvcc->current, version, __ATOMIC_SEQ_CST);
+	e = __atomic_add_fetch(&mvcc->epoch, 1, __ATOMIC_SEQ_CST);
+
+	if (old != NULL)
+	{
+		r->version = old;
+		r->epoch = e;
+		r->next = mvcc->retired;
+		mvcc->retired = r;
+		r = NULL;
+	}
+
+	bitset_mvcc_reclaim(mvcc);
+
+	ret = OK;
+
+exit:
+	if (r != NULL)
+		free(r);
+
+	return ret;
+}
+
+
+/* Get a consistent read-only view of the last published version */
+int bitset_snapshot(struct bitset *bset, struct bitset_snapshot *snap)
+{
+	struct bitset_mvcc *mvcc;
+	uint64_t e, expected;
+	int i;
+
+	if (bset == NULL || snap == NULL || (mvcc = bset->mvcc) == NULL)
+		return ERRINPUT;
+
+	/* pin the current epoch in a free reader slot */
+	for (i = 0; i < BITSET_MAX_READERS; i++)
+	{
+		expected = 0;
+		e = __atomic_load_n(&mvcc->epoch, __ATOMIC_SEQ_CST);
+		if (__atomic_compare_exchange_n(&mvcc->readers[i], &expected, e, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (i == BITSET_MAX_READERS)
+		return ERRMEM;
+
+	snap->mvcc = mvcc;
+	snap->slot = i;
+	snap->bset = __atomic_load_n(&mvcc->current, __ATOMIC_SEQ_CST);
+
+	return OK;
+}
+
+
+/* Release a snapshot taken with bitset_snapshot */
+void bitset_release(struct bitset_snapshot *snap)
+{
+	if (snap && snap->mvcc)
+	{
+		__atomic_store_n(&snap->mvcc->readers[snap->slot], 0, __ATOMIC_RELEASE);
+		snap->mvcc = NULL;
+		snap->bset = NULL;
+	}
+}
+
+
+/* free the retired versions that no reader can still be using */
+static void bitset_mvcc_reclaim(struct bitset_mvcc *mvcc)
+{
+	struct bitset_retired **rp, *r;
+	uint64_t min, e;
+	int i;
+
+	min = UINT64_MAX;
+	for (i = 0; i < BITSET_MAX_READERS; i++)
+	{
+		e = __atomic_load_n(&mvcc->readers[i], __ATOMIC_SEQ_CST);
+		if (e != 0 && e < min)
+			min = e;
+	}
+
+	for (rp = &mvcc->retired; (r = *rp) != NULL; )
+	{
+		if (r->epoch <= min)
+		{
+			*rp = r->next;
+			bitset_free(r->version);
+			free(r);
+		}
+		else
+		{
+			rp = &r->next;
+		}
+	}
+}
+
+
+/* free the snapshot state of a bitset.  there must be no readers left */
+static void bitset_mvcc_free(struct bitset_mvcc *mvcc)
+{
+	struct bitset_retired *r;
+
+	while ((r = mvcc->retired) != NULL)
+	{
+		mvcc->retired = r->next;
+		bitset_free(r->version);
+		free(r);
+	}
+
+	bitset_free(mvcc->current);
+	free(mvcc);
+}
+
+
+
+/******************************************************************************
+ * SERIALIZATION
+ *
+ * a saved bitset is a header, a directory of the indexes of the non-NULL
+ * blocks, and then a record for each of those blocks.  a block record holds
+ * the block's set_count and a mask of its non-NULL pages, followed by a
+ * record for each of those pages.  each page is stored as whichever of a
+ * bitmap, a sorted array of bit offsets or a list of runs of 1 bits is
+ * smallest.  a bitmap page record is laid out exactly like a bitset_page,
+ * with a ref_count of BITSET_IMMORTAL, so it can be read straight into one or
+ * used in place in a mapping of the file.  all records are padded to 8 bytes
+ * and stored in native (little-endian) byte order.
+ *
+ * the checksum covers the contents of the bitset rather than the encoding:
+ * it hashes the block and page index and the words of every non-NULL page.
+ */
+
+#define BITSET_FILE_MAGIC	"SPBITSET"
+#define BITSET_FILE_VERSION	1
+
+/* page record kinds.  the bitmap kind sits where a bitset_page has its
+ * ref_count */
+#define BITSET_PAGE_BITMAP	BITSET_IMMORTAL
+#define BITSET_PAGE_ARRAY	1
+#define BITSET_PAGE_RUNS	2
+
+#define BITSET_IO_BUFSIZE	(1024*1024)
+
+#define PAD8(n)	(((n) + 7) & ~(size_t)7)
+
+struct bitset_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+
+	int32_t bitcount;
+	int32_t block_count;
+	int32_t blocksize;		/* words per block */
+	int32_t pagesize;		/* words per page */
+
+	int32_t blocks;			/* number of block records */
+	int32_t reserved;
+
+	uint64_t set_count;
+	uint64_t checksum;
+};
+
+struct bitset_file_block {
+	int32_t set_count;
+	uint32_t page_mask;		/* bit p is set if page p is stored */
+};
+
+struct bitset_file_page {
+	int32_t kind;
+	int32_t set_count;
+};
+
+/* a buffered writer or reader on a file descriptor, or a reader on a
+ * mapping of the whole file if fd is -1 */
+struct bitset_stream {
+	int fd;
+	char *buf;
+	size_t pos;
+	size_t len;
+
+	/* bytes written or read so far, for padding */
+	uint64_t offset;
+
+	/* number of pages used in place in the mapping */
+	int mapped;
+
+	/* when set, every page is written as a bitmap */
+	int bitmaps;
+};
+
+
+/* a read-only mapping of a saved bitset with pages used in place.  the
+ * references to all of its pages are counted together here, since the pages
+ * have no room for a count of their own, and the mapping is unmapped when
+ * the last one is dropped */
+struct bitset_mapping {
+	char *addr;
+	size_t len;
+	long refs;
+};
+
+static struct bitset_mapping *mappings = NULL;
+static int mapping_count = 0;
+static int mapping_alloc = 0;
+static pthread_mutex_t mapping_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* start counting the refs references to pages in the mapping at addr */
+static int bitset_mapping_add(void *addr, size_t len, long refs)
+{
+	struct bitset_mapping *m;
+	int ret = OK;
+
+	pthread_mutex_lock(&mapping_lock);
+
+	if (mapping_count == mapping_alloc)
+	{
+		m = (struct bitset_mapping *)realloc(mappings, sizeof(struct bitset_mapping) * (mapping_alloc + 4));
+		if (m == NULL)
+		{
+			ret = ERRMEM;
+			goto exit;
+		}
+		mappings = m;
+		mapping_alloc += 4;
+	}
+
+	mappings[mapping_count].addr = (char *)addr;
+	mappings[mapping_count].len = len;
+	mappings[mapping_count].refs = refs;
+	mapping_count++;
+
+exit:
+	pthread_mutex_unlock(&mapping_lock);
+
+	return ret;
+}
+
+/* add n (1 or -1) to the references of the mapping holding the immortal
+ * page, and unmap it if there are none left */
+static void bitset_mapping_ref(struct bitset_page *page, int n)
+{
+	struct bitset_mapping *m;
+	int i;
+
+	pthread_mutex_lock(&mapping_lock);
+
+	for (i = 0; i < mapping_count; i++)
+	{
+		m = &mappings[i];
+		if ((char *)page >= m->addr && (char *)page < m->addr + m->len)
+		{
+			m->refs += n;
+			if (m->refs == 0)
+			{
+				munmap(m->addr, m->len);
+				mappings[i] = mappings[--mapping_count];
+			}
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&mapping_lock);
+}
+
+
+/* fold n words into the running checksum h */
+static uint64_t bitset_hash_words(uint64_t h, const uint64_t *w, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		h ^= w[i];
+		h *= 0x9e3779b97f4a7c15ull;
+		h ^= h >> 29;
+	}
+
+	return h;
+}
+
+/* fold a page at block i, page p into the running checksum h */
+static uint64_t bitset_hash_page(uint64_t h, int i, int p, struct bitset_page *page)
+{
+	uint64_t where = ((uint64_t)i << 32) | (uint32_t)p;
+
+	h = bitset_hash_words(h, &where, 1);
+	return bitset_hash_words(h, page->ints, PAGESIZE);
+}
+
+static int bitset_stream_flush(struct bitset_stream *s)
+{
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < s->pos; off += n)
+	{
+		n = write(s->fd, s->buf + off, s->pos - off);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n <= 0)
+			return ERRIO;
+	}
+
+	s->pos = 0;
+
+	return OK;
+}
+
+/* write n bytes, or n zero bytes if p is NULL */
+static int bitset_stream_write(struct bitset_stream *s, const void *p, size_t n)
+{
+	const char *src = (const char *)p;
+	size_t len;
+	int ret;
+
+	s->offset += n;
+
+	while (n > 0)
+	{
+		if (s->pos == BITSET_IO_BUFSIZE && (ret = bitset_stream_flush(s)) != OK)
+			return ret;
+
+		len = BITSET_IO_BUFSIZE - s->pos;
+		if (len > n)
+			len = n;
+
+		if (src != NULL)
+		{
+			memcpy(s->buf + s->pos, src, len);
+			src += len;
+		}
+		else
+		{
+			memset(s->buf + s->pos, 0, len);
+		}
+
+		s->pos += len;
+		n -= len;
+	}
+
+	return OK;
+}
+
+/* read n bytes, or skip n bytes if p is NULL */
+static int bitset_stream_read(struct bitset_stream *s, void *p, size_t n)
+{
+	char *dst = (char *)p;
+	size_t len;
+	ssize_t got;
+
+	s->offset += n;
+
+	while (n > 0)
+	{
+		if (s->pos == s->len)
+		{
+			if (s->fd < 0)
+				return ERRFORMAT;
+
+			got = read(s->fd, s->buf, BITSET_IO_BUFSIZE);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got < 0)
+				return ERRIO;
+			if (got == 0)
+				return ERRFORMAT;
+			s->pos = 0;
+			s->len = got;
+		}
+
+		len = s->len - s->pos;
+		if (len > n)
+			len = n;
+
+		if (dst != NULL)
+		{
+			memcpy(dst, s->buf + s->pos, len);
+			dst += len;
+		}
+
+		s->pos += len;
+		n -= len;
+	}
+
+	return OK;
+}
+
+/* pad or skip to the next multiple of 8 bytes */
+#define bitset_stream_write_pad(s)	bitset_stream_write((s), NULL, PAD8((s)->offset) - (s)->offset)
+#define bitset_stream_read_pad(s)	bitset_stream_read((s), NULL, PAD8((s)->offset) - (s)->offset)
+
+/* count the runs of 1 bits in a page */
+static int bitset_page_count_runs(struct bitset_page *page)
+{
+	uint64_t w, prev = 0;
+	int i, n = 0;
+
+	for (i = 0; i < PAGESIZE; i++)
+	{
+		w = page->ints[i];
+
+		/* a run starts at each 1 bit whose lower neighbour is 0 */
+		n += __builtin_popcountll(w & ~((w << 1) | (prev >> 63)));
+		prev = w;
+	}
+
+	return n;
+}
+
+/* write a page record, choosing the smallest encoding for it */
+static int bitset_save_page(struct bitset_stream *s, struct bitset_page *page, uint16_t *scratch)
+{
+	struct bitset_file_page rec;
+	uint32_t nruns;
+	size_t array_size, run_size;
+	int i, b, n, ret;
+	uint64_t w;
+
+	nruns = bitset_page_count_runs(page);
+	array_size = PAD8(sizeof(uint16_t) * page->set_count);
+	run_size = PAD8(sizeof(uint32_t) + sizeof(uint16_t) * 2 * nruns);
+
+	rec.set_count = page->set_count;
+
+	if (s->bitmaps || (array_size >= sizeof(page->ints) && run_size >= sizeof(page->ints)))
+	{
+		rec.kind = BITSET_PAGE_BITMAP;
+		if ((ret = bitset_stream_write(s, &rec, sizeof(rec))) != OK)
+			return ret;
+		return bitset_stream_write(s, page->ints, sizeof(page->ints));
+	}
+
+	if (array_size <= run_size)
+	{
+		/* the offsets of the 1 bits in the page, in order */
+		for (i = 0, n = 0; i < PAGESIZE; i++)
+		{
+			for (w = page->ints[i]; w != 0; w &= w - 1)
+				scratch[n++] = i * BITSPERINT + __builtin_ctzll(w);
+		}
+
+		rec.kind = BITSET_PAGE_ARRAY;
+		if ((ret = bitset_stream_write(s, &rec, sizeof(rec))) != OK)
+			return ret;
+		if ((ret = bitset_stream_write(s, scratch, sizeof(uint16_t) * n)) != OK)
+			return ret;
+		return bitset_stream_write_pad(s);
+	}
+
+	/* the runs as (first bit, length - 1) pairs, after the run count */
+	for (b = 0, n = 0; b < IDSPERPAGE; )
+	{
+		if (!bitset_page_test_bit(page, b))
+		{
+			b++;
+			continue;
+		}
+
+		scratch[n] = b;
+		while (b < IDSPERPAGE && bitset_page_test_bit(page, b))
+			b++;
+		scratch[n+1] = b - 1 - scratch[n];
+		n += 2;
+	}
+
+	rec.kind = BITSET_PAGE_RUNS;
+	if ((ret = bitset_stream_write(s, &rec, sizeof(rec))) != OK)
+		return ret;
+	if ((ret = bitset_stream_write(s, &nruns, sizeof(nruns))) != OK)
+		return ret;
+	if ((ret = bitset_stream_write(s, scratch, sizeof(uint16_t) * n)) != OK)
+		return ret;
+	return bitset_stream_write_pad(s);
+}
+
+/* write the bitset to a file descriptor, with every page as a bitmap if
+ * bitmaps is set */
+static int bitset_write(struct bitset *bset, int fd, int bitmaps)
+{
+	struct bitset_file_header hdr;
+	struct bitset_file_block brec;
+	struct bitset_stream s;
+	struct bitset_block *blk;
+	uint16_t *scratch = NULL;
+	int32_t *dir = NULL;
+	int i, p, n, ret;
+
+	if (bset == NULL || fd < 0)
+		return ERRINPUT;
+
+	/* a small set is written in the block format */
+	if (bset->small)
+	{
+		struct bitset *tmp = NULL;
+
+		if ((ret = bitset_small_expand(bset, &tmp)) == OK)
+			ret = bitset_write(tmp, fd, bitmaps);
+		bitset_free(tmp);
+		return ret;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.fd = fd;
+	s.bitmaps = bitmaps;
+
+	s.buf = (char *)malloc(BITSET_IO_BUFSIZE);
+	dir = (int32_t *)malloc(sizeof(int32_t) * (bitset_block_slots(bset) + 1));
+	scratch = (uint16_t *)malloc(sizeof(uint16_t) * IDSPERPAGE);
+	if (s.buf == NULL || dir == NULL || scratch == NULL)
+	{
+		ret = ERRMEM;
+		goto exit;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BITSET_FILE_MAGIC, sizeof(hdr.magic));
+	hdr.version = BITSET_FILE_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.bitcount = bset->bitcount;
+	hdr.block_count = bset->block_count;
+	hdr.blocksize = BITSET_BLOCK_IDS(bset) / BITSPERINT;
+	hdr.pagesize = PAGESIZE;
+
+	/* collect the directory and checksum the contents */
+	for (i = 0, n = 0; (i = bitset_next_block(bset, i)) < bset->block_count; i++)
+	{
+		/* blocks and pages with no bits set are not stored */
+		if ((blk = bitset_block_at(bset, i)) == NULL || blk->set_count == 0)
+			continue;
+
+		dir[n++] = i;
+		hdr.set_count += blk->set_count;
+
+		for (p = 0; p < blk->page_count; p++)
+		{
+			if (blk->pages[p] != NULL && blk->pages[p]->set_count > 0)
+				hdr.checksum = bitset_hash_page(hdr.checksum, i, p, blk->pages[p]);
+		}
+	}
+	hdr.blocks = n;
+
+	if ((ret = bitset_stream_write(&s, &hdr, sizeof(hdr))) != OK)
+		goto exit;
+	if ((ret = bitset_stream_write(&s, dir, sizeof(int32_t) * n)) != OK)
+		goto exit;
+	if ((ret = bitset_stream_write_pad(&s)) != OK)
+		goto exit;
+
+	for (i = 0; i < n; i++)
+	{
+		blk = bitset_block_at(bset, dir[i]);
+
+		brec.set_count = blk->set_count;
+		brec.page_mask = 0;
+		for (p = 0; p < blk->page_count; p++)
+		{
+			if (blk->pages[p] != NULL && blk->pages[p]->set_count > 0)
+				brec.page_mask |= 1u << p;
+		}
+
+		if ((ret = bitset_stream_write(&s, &brec, sizeof(brec))) != OK)
+			goto exit;
+
+		for (p = 0; p < blk->page_count; p++)
+		{
+			if ((brec.page_mask & (1u << p)) && (ret = bitset_save_page(&s, blk->pages[p], scratch)) != OK)
+				goto exit;
+		}
+	}
+
+	ret = bitset_stream_flush(&s);
+
+exit:
+	free(s.buf);
+	free(dir);
+	free(scratch);
+
+	return ret;
+}
+
+/* Write the bitset to a file descriptor */
+int bitset_save(struct bitset *bset, int fd)
+{
+	return bitset_write(bset, fd, 0);
+}
+
+/* read a page record into a new page */
+static int bitset_load_page(struct bitset_stream *s, struct bitset_page **page_out, uint16_t *scratch)
+{
+	struct bitset_file_page rec;
+	struct bitset_page *page = NULL;
+	uint32_t nruns;
+	int i, b, ret;
+
+	if ((ret = bitset_stream_read(s, &rec, sizeof(rec))) != OK)
+		return ret;
+
+	if (rec.set_count <= 0 || rec.set_count > IDSPERPAGE)
+		return ERRFORMAT;
+
+	if (rec.kind == BITSET_PAGE_BITMAP && s->fd < 0)
+	{
+		/* use the page in place.  checking its count here would read the
+		 * whole file, so it is trusted */
+		if (s->len - s->pos < sizeof(page->ints))
+			return ERRFORMAT;
+
+		*page_out = (struct bitset_page *)(s->buf + s->pos - sizeof(rec));
+		s->mapped++;
+
+		return bitset_stream_read(s, NULL, sizeof(page->ints));
+	}
+
+	if ((ret = bitset_page_new(&page)) != OK)
+		return ret;
+
+	memset(page, 0, sizeof(struct bitset_page));
+	page->ref_count = 1;
+	page->set_count = rec.set_count;
+
+	switch (rec.kind)
+	{
+	case BITSET_PAGE_BITMAP:
+		ret = bitset_stream_read(s, page->ints, sizeof(page->ints));
+		break;
+
+	case BITSET_PAGE_ARRAY:
+		if ((ret = bitset_stream_read(s, scratch, sizeof(uint16_t) * rec.set_count)) != OK)
+			break;
+		if ((ret = bitset_stream_read_pad(s)) != OK)
+			break;
+		for (i = 0; i < rec.set_count; i++)
+		{
+			if (scratch[i] >= IDSPERPAGE)
+				ret = ERRFORMAT;
+			else
+				page->ints[scratch[i] / BITSPERINT] |= 1ull << (scratch[i] % BITSPERINT);
+		}
+		break;
+
+	case BITSET_PAGE_RUNS:
+		if ((ret = bitset_stream_read(s, &nruns, sizeof(nruns))) != OK)
+			break;
+		if (nruns > IDSPERPAGE / 2)
+		{
+			ret = ERRFORMAT;
+			break;
+		}
+		if ((ret = bitset_stream_read(s, scratch, sizeof(uint16_t) * 2 * nruns)) != OK)
+			break;
+		if ((ret = bitset_stream_read_pad(s)) != OK)
+			break;
+		for (i = 0; i < (int)nruns; i++)
+		{
+			if (scratch[2*i] + scratch[2*i+1] >= IDSPERPAGE)
+			{
+				ret = ERRFORMAT;
+				break;
+			}
+			for (b = scratch[2*i]; b <= scratch[2*i] + scratch[2*i+1]; b++)
+				page->ints[b / BITSPERINT] |= 1ull << (b % BITSPERINT);
+		}
+		break;
+
+	default:
+		ret = ERRFORMAT;
+	}
+
+	/* the bits decoded must agree with the count in the record */
+	for (i = 0, b = 0; ret == OK && i < PAGESIZE; i++)
+		b += __builtin_popcountll(page->ints[i]);
+
+	if (ret == OK && b != rec.set_count)
+		ret = ERRFORMAT;
+
+	if (ret != OK)
+	{
+		bitset_page_decref(page);
+		return ret;
+	}
+
+	*page_out = page;
+
+	return OK;
+}
+
+/* read a saved bitset from the stream.  the checksum is only checked when
+ * reading from a file descriptor: on a mapping it would read every page */
+static int bitset_read(struct bitset_stream *s, struct bitset **bset_out)
+{
+	struct bitset_file_header hdr;
+	struct bitset_file_block brec;
+	struct bitset *bset = NULL;
+	struct bitset_block *blk;
+	uint16_t *scratch = NULL;
+	int32_t *dir = NULL;
+	uint64_t checksum = 0, set_count = 0;
+	int i, p, n, ret;
+
+	scratch = (uint16_t *)malloc(sizeof(uint16_t) * IDSPERPAGE);
+	if (scratch == NULL)
+	{
+		ret = ERRMEM;
+		goto exit;
+	}
+
+	if ((ret = bitset_stream_read(s, &hdr, sizeof(hdr))) != OK)
+		goto exit;
+
+	if (memcmp(hdr.magic, BITSET_FILE_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.version != BITSET_FILE_VERSION ||
+		hdr.header_size != sizeof(hdr) ||
+		hdr.blocksize < BITSET_MIN_BLOCKSIZE ||
+		hdr.blocksize > BITSET_MAX_BLOCKSIZE ||
+		(hdr.blocksize & (hdr.blocksize - 1)) != 0 ||
+		hdr.pagesize != PAGESIZE ||
+		hdr.bitcount < 0)
+	{
+		ret = ERRFORMAT;
+		goto exit;
+	}
+
+	if ((ret = bitset_alloc_blocksize(hdr.bitcount, hdr.blocksize, &bset)) != OK)
+		goto exit;
+
+	if (hdr.block_count != bset->block_count ||
+		hdr.blocks < 0 || hdr.blocks > hdr.block_count)
+	{
+		ret = ERRFORMAT;
+		goto exit;
+	}
+
+	dir = (int32_t *)malloc(sizeof(int32_t) * (hdr.blocks + 1));
+	if (dir == NULL)
+	{
+		ret = ERRMEM;
+		goto exit;
+	}
+
+	if ((ret = bitset_stream_read(s, dir, sizeof(int32_t) * hdr.blocks)) != OK)
+		goto exit;
+	if ((ret = bitset_stream_read_pad(s)) != OK)
+		goto exit;
+
+	for (i = 0; i < hdr.blocks; i++)
+	{
+		/* the directory must be in increasing order */
+		n = dir[i];
+		if (n < 0 || n >= hdr.block_count || (i > 0 && n <= dir[i-1]))
+		{
+			ret = ERRFORMAT;
+			goto exit;
+		}
+
+		if ((ret = bitset_stream_read(s, &brec, sizeof(brec))) != OK)
+			goto exit;
+
+		if ((ret = bitset_block_alloc(bset, n, &blk)) != OK)
+			goto exit;
+
+		for (p = 0; p < blk->page_count; p++)
+		{
+			if ((brec.page_mask & (1u << p)) == 0)
+				continue;
+
+			if ((ret = bitset_load_page(s, &blk->pages[p], scratch)) != OK)
+				goto exit;
+
+			blk->set_count += blk->pages[p]->set_count;
+			if (s->fd >= 0)
+				checksum = bitset_hash_page(checksum, n, p, blk->pages[p]);
+		}
+
+		if (blk->set_count != brec.set_count)
+		{
+			ret = ERRFORMAT;
+			goto exit;
+		}
+		set_count += blk->set_count;
+	}
+
+	if ((s->fd >= 0 && checksum != hdr.checksum) || set_count != hdr.set_count)
+	{
+		ret = ERRFORMAT;
+		goto exit;
+	}
+
+	*bset_out = bset;
+	bset = NULL;
+
+	ret = OK;
+
+exit:
+	if (bset != NULL)
+		bitset_free(bset);
+
+	free(dir);
+	free(scratch);
+
+	return ret;
+}
+
+/* Read a bitset written by bitset_save from a file descriptor */
+int bitset_load(int fd, struct bitset **bset_out)
+{
+	struct bitset_stream s;
+	int ret;
+
+	if (fd < 0 || bset_out == NULL || *bset_out != NULL)
+		return ERRINPUT;
+
+	memset(&s, 0, sizeof(s));
+	s.fd = fd;
+
+	s.buf = (char *)malloc(BITSET_IO_BUFSIZE);
+	if (s.buf == NULL)
+		return ERRMEM;
+
+	ret = bitset_read(&s, bset_out);
+
+	free(s.buf);
+
+	return ret;
+}
+
+/* map the saved bitset in the file open on fd */
+static int bitset_map(int fd, struct bitset **bset_out)
+{
+	struct bitset_stream s;
+	struct stat st;
+	void *map;
+	int ret;
+
+	if (fstat(fd, &st) != 0)
+		return ERRIO;
+
+	if (st.st_size == 0)
+		return ERRFORMAT;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return ERRIO;
+
+	memset(&s, 0, sizeof(s));
+	s.fd = -1;
+	s.buf = (char *)map;
+	s.len = st.st_size;
+
+	ret = bitset_read(&s, bset_out);
+
+	/* pages used in place may end up shared with any number of other
+	 * bitsets, so the mapping stays until the last reference to them goes */
+	if (ret == OK && s.mapped > 0 && (ret = bitset_mapping_add(map, st.st_size, s.mapped)) != OK)
+	{
+		bitset_free(*bset_out);
+		*bset_out = NULL;
+	}
+
+	if (ret != OK || s.mapped == 0)
+		munmap(map, st.st_size);
+
+	return ret;
+}
+
+/* Map a file written by bitset_save as a bitset */
+int bitset_mmap(const char *path, struct bitset **bset_out)
+{
+	int fd, ret;
+
+	if (path == NULL || bset_out == NULL || *bset_out != NULL)
+		return ERRINPUT;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return ERRIO;
+
+	ret = bitset_map(fd, bset_out);
+
+	close(fd);
+
+	return ret;
+}
+
+
+
+/******************************************************************************
+ * SHARED MEMORY
+ *
+ * a bitset is shared between processes by saving it into a POSIX shared
+ * memory object, with every page as a bitmap, and mapping that object in
+ * each process as bitset_mmap does.  the saved format has offsets rather
+ * than pointers, so it can be mapped at any address, and every page of bits
+ * is used in place, so the bits are in memory only once however many
+ * processes attach.  only the small block headers are private to each
+ * process.
+ *
+ * the pages are immortal, so they need no reference counts shared between
+ * processes: each process unmaps the object when it drops its last reference
+ * to the pages, and the kernel keeps the object until the last one does.
+ * a new version is published by creating the object again, which replaces
+ * the name while processes already attached keep the version they have.
+ */
+
+/* Publish the bitset in the shared memory object name */
+int bitset_shm_create(const char *name, struct bitset *bset)
+{
+	int fd, ret;
+
+	if (name == NULL || bset == NULL)
+		return ERRINPUT;
+
+	/* the old object lives on for the processes attached to it.  an attach
+	 * while the new one is being written fails, and can be retried */
+	shm_unlink(name);
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+		return ERRIO;
+
+	if ((ret = bitset_write(bset, fd, 1)) != OK)
+		shm_unlink(name);
+
+	close(fd);
+
+	return ret;
+}
+
+/* Attach to the bitset published in the shared memory object name */
+int bitset_shm_attach(const char *name, struct bitset **bset_out)
+{
+	int fd, ret;
+
+	if (name == NULL || bset_out == NULL || *bset_out != NULL)
+		return ERRINPUT;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+		return ERRIO;
+
+	ret = bitset_map(fd, bset_out);
+
+	close(fd);
+
+	return ret;
+}
+
+/* Remove the shared memory object name */
+int bitset_shm_remove(const char *name)
+{
+	if (name == NULL)
+		return ERRINPUT;
+
+	if (shm_unlink(name) != 0)
+		return ERRIO;
+
+	return OK;
+}
+
+
+
+/******************************************************************************
+ * ROARING FORMAT
+ *
+ * conversion to and from the portable serialization format of Roaring
+ * bitmaps.  a Roaring container holds the 65536 values sharing their high 16
+ * bits, which is exactly one block, so container key k is block k.  a
+ * container is a bitmap of 1024 words when it has more than 4096 values, a
+ * sorted array of 16 bit values otherwise, or a list of runs when that is
+ * smaller than either.  all values are little-endian, which like the rest of
+ * the library this assumes is the native byte order.
+ */
+
+#define ROARING_COOKIE			12347
+#define ROARING_COOKIE_NO_RUNS	12346
+#define ROARING_NO_OFFSETS		4	/* containers below which a run cookie
+									 * has no offset header */
+#define ROARING_ARRAY_MAX		4096
+
+#define ROARING_ARRAY	0
+#define ROARING_BITMAP	1
+#define ROARING_RUNS	2
+
+struct bitset_container {
+	int key;
+	int card;
+	int kind;
+	int nruns;
+};
+
+
+/* get word i of a block, where a NULL page is all 0 bits */
+static uint64_t bitset_block_word(struct bitset_block *blk, int i)
+{
+	struct bitset_page *page = blk->pages[i / PAGESIZE];
+
+	return page != NULL ? page->ints[i % PAGESIZE] : 0;
+}
+
+/* find the first bit at pos or greater in the block which equals bit.
+ * returns IDSPERBLOCK if there is none */
+static int bitset_block_scan(struct bitset_block *blk, int pos, int bit)
+{
+	uint64_t w;
+	int i;
+
+	if (pos >= IDSPERBLOCK)
+		return IDSPERBLOCK;
+
+	i = pos / BITSPERINT;
+	w = bitset_block_word(blk, i) ^ (bit ? 0 : ~0ull);
+	w &= ~0ull << (pos % BITSPERINT);
+
+	while (w == 0)
+	{
+		if (++i == BLOCKSIZE)
+			return IDSPERBLOCK;
+		w = bitset_block_word(blk, i) ^ (bit ? 0 : ~0ull);
+	}
+
+	return i * BITSPERINT + __builtin_ctzll(w);
+}
+
+/* count the runs of 1 bits in a block */
+static int bitset_block_count_runs(struct bitset_block *blk)
+{
+	uint64_t w, prev = 0;
+	int i, n = 0;
+
+	for (i = 0; i < BLOCKSIZE; i++)
+	{
+		w = bitset_block_word(blk, i);
+		n += __builtin_popcountll(w & ~((w << 1) | (prev >> 63)));
+		prev = w;
+	}
+
+	return n;
+}
+
+static char *bitset_put16(char *p, uint16_t v)
+{
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static char *bitset_put32(char *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static uint16_t bitset_get16(const char *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t bitset_get32(const char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* size in bytes of a container */
+static size_t bitset_container_size(struct bitset_container *c)
+{
+	switch (c->kind)
+	{
+	case ROARING_RUNS:
+		return sizeof(uint16_t) * (1 + 2 * c->nruns);
+	case ROARING_BITMAP:
+		return sizeof(uint64_t) * BLOCKSIZE;
+	default:
+		return sizeof(uint16_t) * c->card;
+	}
+}
+
+/* write the values of a block as a container */
+static char *bitset_put_container(char *p, struct bitset_block *blk, struct bitset_container *c)
+{
+	uint64_t w;
+	int i, start, end;
+
+	switch (c->kind)
+	{
+	case ROARING_RUNS:
+		p = bitset_put16(p, c->nruns);
+		for (end = 0; (start = bitset_block_scan(blk, end, 1)) < IDSPERBLOCK; )
+		{
+			end = bitset_block_scan(blk, start, 0);
+			p = bitset_put16(p, start);
+			p = bitset_put16(p, end - start - 1);
+		}
+		break;
+
+	case ROARING_BITMAP:
+		/* the pages are copied word for word */
+		for (i = 0; i < PAGECOUNT; i++)
+		{
+			if (blk->pages[i] != NULL)
+				memcpy(p, blk->pages[i]->ints, sizeof(uint64_t) * PAGESIZE);
+			else
+				memset(p, 0, sizeof(uint64_t) * PAGESIZE);
+			p += sizeof(uint64_t) * PAGESIZE;
+		}
+		break;
+
+	default:
+		for (i = 0; i < BLOCKSIZE; i++)
+		{
+			for (w = bitset_block_word(blk, i); w != 0; w &= w - 1)
+				p = bitset_put16(p, i * BITSPERINT + __builtin_ctzll(w));
+		}
+	}
+
+	return p;
+}
+
+/* Write the bitset in the Roaring portable format to a new buffer */
+int bitset_to_roaring(struct bitset *bset, char **buf_out, size_t *size_out)
+{
+	struct bitset_container *cs = NULL;
+	struct bitset_block *blk;
+	size_t size, offset, csize;
+	char *buf = NULL, *p;
+	int i, n, has_runs = 0, offsets, ret;
+
+	if (bset == NULL || buf_out == NULL || size_out == NULL)
+		return ERRINPUT;
+
+	if (bset->small)
+	{
+		struct bitset *tmp = NULL;
+
+		if ((ret = bitset_small_expand(bset, &tmp)) == OK)
+			ret = bitset_to_roaring(tmp, buf_out, size_out);
+		bitset_free(tmp);
+		return ret;
+	}
+
+	/* containers are always 65536 bits, the default block size */
+	if (bset->block_shift != BITSET_BLOCK_SHIFT)
+	{
+		struct bitset *tmp = NULL;
+
+		if ((ret = bitset_reblock(bset, BITSET_BLOCK_SHIFT, &tmp)) == OK)
+			ret = bitset_to_roaring(tmp, buf_out, size_out);
+		bitset_free(tmp);
+		return ret;
+	}
+
+	cs = (struct bitset_container *)malloc(sizeof(struct bitset_container) * (bitset_block_slots(bset) + 1));
+	if (cs == NULL)
+		return ERRMEM;
+
+	/* choose the kind of container for each non-empty block */
+	for (i = 0, n = 0; (i = bitset_next_block(bset, i)) < bset->block_count; i++)
+	{
+		if ((blk = bitset_block_at(bset, i)) == NULL || blk->set_count == 0)
+			continue;
+
+		cs[n].key = i;
+		cs[n].card = blk->set_count;
+		cs[n].nruns = bitset_block_count_runs(blk);
+		cs[n].kind = blk->set_count > ROARING_ARRAY_MAX ? ROARING_BITMAP : ROARING_ARRAY;
+
+		csize = bitset_container_size(&cs[n]);
+		cs[n].kind = ROARING_RUNS;
+		if (bitset_container_size(&cs[n]) < csize)
+			has_runs = 1;
+		else
+			cs[n].kind = blk->set_count > ROARING_ARRAY_MAX ? ROARING_BITMAP : ROARING_ARRAY;
+
+		n++;
+	}
+
+	/* the cookie, then the run flags or the container count, then the key
+	 * and cardinality of each container and maybe their offsets */
+	offsets = !has_runs || n >= ROARING_NO_OFFSETS;
+	size = has_runs ? sizeof(uint32_t) + (n + 7) / 8 : 2 * sizeof(uint32_t);
+	size += 2 * sizeof(uint16_t) * n;
+	if (offsets)
+		size += sizeof(uint32_t) * n;
+
+	offset = size;
+	for (i = 0; i < n; i++)
+		size += bitset_container_size(&cs[i]);
+
+	if (size > UINT32_MAX)
+	{
+		ret = ERRINPUT;
+		goto exit;
+	}
+
+	if ((buf = (char *)malloc(size)) == NULL)
+	{
+		ret = ERRMEM;
+		goto exit;
+	}
+
+	p = buf;
+	if (has_runs)
+	{
+		/* a run cookie holds the container count, and is followed by a bit
+		 * per container which is set for run containers */
+		p = bitset_put32(p, ROARING_COOKIE | (uint32_t)(n - 1) << 16);
+		memset(p, 0, (n + 7) / 8);
+		for (i = 0; i < n; i++)
+		{
+			if (cs[i].kind == ROARING_RUNS)
+				p[i / 8] |= 1 << (i % 8);
+		}
+		p += (n + 7) / 8;
+	}
+	else
+	{
+		p = bitset_put32(p, ROARING_COOKIE_NO_RUNS);
+		p = bitset_put32(p, n);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		p = bitset_put16(p, cs[i].key);
+		p = bitset_put16(p, cs[i].card - 1);
+	}
+
+	if (offsets)
+	{
+		for (i = 0; i < n; i++)
+		{
+			p = bitset_put32(p, offset);
+			offset += bitset_container_size(&cs[i]);
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		p = bitset_put_container(p, bitset_block_at(bset, cs[i].key), &cs[i]);
+
+	assert(p == buf + size);
+
+	*buf_out = buf;
+	*size_out = size;
+
+	ret = OK;
+
+exit:
+	free(cs);
+
+	return ret;
+}
+
+/* set the bits [start, end) of a block which has no bits set there yet */
+static int bitset_block_fill(struct bitset_block *blk, int start, int end)
+{
+	struct bitset_page *page;
+	uint64_t m;
+	int i, hi, c, ret;
+
+	while (start < end)
+	{
+		i = start / BITSPERINT;
+		hi = (i + 1) * BITSPERINT < end ? (i + 1) * BITSPERINT : end;
+
+		m = ~0ull << (start % BITSPERINT);
+		if (hi % BITSPERINT != 0)
+			m &= ~(~0ull << (hi % BITSPERINT));
+
+		if ((ret = bitset_page_writable(blk, i / PAGESIZE, &page)) != OK)
+			return ret;
+
+		c = __builtin_popcountll(m & ~page->ints[i % PAGESIZE]);
+		page->ints[i % PAGESIZE] |= m;
+		page->set_count += c;
+		blk->set_count += c;
+
+		start = hi;
+	}
+
+	return OK;
+}
+
+/* read a container into a new block.  returns the number of bytes read */
+static int bitset_get_container(const char *p, size_t size, int kind, int card,
+	struct bitset_block *blk)
+{
+	struct bitset_page *page;
+	int i, n, v, last = -1, start, len, ret;
+
+	switch (kind)
+	{
+	case ROARING_RUNS:
+		if (size < sizeof(uint16_t))
+			return ERRFORMAT;
+		n = bitset_get16(p);
+		if (size < sizeof(uint16_t) * (1 + 2 * (size_t)n))
+			return ERRFORMAT;
+
+		for (i = 0; i < n; i++)
+		{
+			start = bitset_get16(p + sizeof(uint16_t) * (1 + 2 * i));
+			len = bitset_get16(p + sizeof(uint16_t) * (2 + 2 * i)) + 1;
+
+			/* runs must be in order and may not overlap */
+			if (start <= last || start + len > IDSPERBLOCK)
+				return ERRFORMAT;
+			if ((ret = bitset_block_fill(blk, start, start + len)) != OK)
+				return ret;
+			last = start + len - 1;
+		}
+		n = sizeof(uint16_t) * (1 + 2 * n);
+		break;
+
+	case ROARING_BITMAP:
+		n = sizeof(uint64_t) * BLOCKSIZE;
+		if (size < (size_t)n)
+			return ERRFORMAT;
+
+		/* only pages with bits set are copied in */
+		for (i = 0; i < PAGECOUNT; i++, p += sizeof(uint64_t) * PAGESIZE)
+		{
+			for (v = 0; v < PAGESIZE * (int)sizeof(uint64_t) && p[v] == 0; v++)
+				;
+			if (v == PAGESIZE * (int)sizeof(uint64_t))
+				continue;
+
+			if ((ret = bitset_page_alloc(blk, i, &page)) != OK)
+				return ret;
+			memcpy(page->ints, p, sizeof(uint64_t) * PAGESIZE);
+			for (v = 0; v < PAGESIZE; v++)
+				page->set_count += __builtin_popcountll(page->ints[v]);
+			blk->set_count += page->set_count;
+		}
+		break;
+
+	default:
+		n = sizeof(uint16_t) * card;
+		if (size < (size_t)n)
+			return ERRFORMAT;
+
+		for (i = 0; i < card; i++)
+		{
+			/* values must be in increasing order */
+			v = bitset_get16(p + sizeof(uint16_t) * i);
+			if (v <= last)
+				return ERRFORMAT;
+			if ((ret = bitset_page_writable(blk, v / IDSPERPAGE, &page)) != OK)
+				return ret;
+			bitset_page_set_bit(page, v % IDSPERPAGE);
+			blk->set_count++;
+			last = v;
+		}
+	}
+
+	if (blk->set_count != card)
+		return ERRFORMAT;
+
+	return n;
+}
+
+/* Read a bitset in the Roaring portable format from a buffer */
+int bitset_from_roaring(const char *buf, size_t size, int bitcount, struct bitset **bset_out)
+{
+	struct bitset *bset = NULL;
+	struct bitset_block *blk;
+	const char *runs = NULL, *keys;
+	uint32_t cookie;
+	size_t pos;
+	int i, n, key, card, kind, last = -1, ret;
+
+	if (buf == NULL || bitcount < 0 || bset_out == NULL || *bset_out != NULL)
+		return ERRINPUT;
+
+	if (size < sizeof(uint32_t))
+		return ERRFORMAT;
+
+	cookie = bitset_get32(buf);
+	if ((cookie & 0xffff) == ROARING_COOKIE)
+	{
+		n = (cookie >> 16) + 1;
+		runs = buf + sizeof(uint32_t);
+		pos = sizeof(uint32_t) + (n + 7) / 8;
+	}
+	else if (cookie == ROARING_COOKIE_NO_RUNS && size >= 2 * sizeof(uint32_t))
+	{
+		n = bitset_get32(buf + sizeof(uint32_t));
+		if (n < 0 || n > 65536)
+			return ERRFORMAT;
+		pos = 2 * sizeof(uint32_t);
+	}
+	else
+	{
+		return ERRFORMAT;
+	}
+
+	keys = buf + pos;
+	pos += 2 * sizeof(uint16_t) * n;
+
+	/* the offsets are not needed since the containers are read in order */
+	if (runs == NULL || n >= ROARING_NO_OFFSETS)
+		pos += sizeof(uint32_t) * n;
+
+	if (pos > size)
+		return ERRFORMAT;
+
+	if ((ret = bitset_alloc(bitcount, &bset)) != OK)
+		return ret;
+
+	for (i = 0; i < n; i++)
+	{
+		key = bitset_get16(keys + 2 * sizeof(uint16_t) * i);
+		card = bitset_get16(keys + 2 * sizeof(uint16_t) * i + sizeof(uint16_t)) + 1;
+
+		if (key <= last)
+		{
+			ret = ERRFORMAT;
+			goto exit;
+		}
+		last = key;
+
+		if (runs != NULL && (runs[i / 8] & (1 << (i % 8))))
+			kind = ROARING_RUNS;
+		else if (card > ROARING_ARRAY_MAX)
+			kind = ROARING_BITMAP;
+		else
+			kind = ROARING_ARRAY;
+
+		if (key >= bset->block_count)
+		{
+			ret = ERRINPUT;
+			goto exit;
+		}
+
+		if ((ret = bitset_block_alloc(bset, key, &blk)) != OK)
+			goto exit;
+
+		if ((ret = bitset_get_container(buf + pos, size - pos, kind, card, blk)) < 0)
+			goto exit;
+		pos += ret;
+	}
+
+	/* the last block may hold bits past the end of the bitset */
+	if (last >= 0 && bitset_block_scan(bitset_block_at(bset, last),
+			bitcount - last * IDSPERBLOCK, 1) < IDSPERBLOCK)
+	{
+		ret = ERRINPUT;
+		goto exit;
+	}
+
+	*bset_out = bset;
+	bset = NULL;
+
+	ret = OK;
+
+exit:
+	if (bset != NULL)
+		bitset_free(bset);
+
+	return ret;
+}
+
+
+
+/******************************************************************************
+ * DIFFS
+ *
+ * a diff holds the changes needed to turn one bitset into another.  it is a
+ * header followed by a record for each block which differs.  a block record
+ * holds the block index and a mask of the pages which differ, and for each
+ * of those a mask of the words which differ followed by the XOR of the old
+ * and new value of each of those words.  blocks and pages which are the same
+ * object in both bitsets, as they are after a bitset_dup, are skipped
+ * without being read, so encoding and applying a diff costs time in
+ * proportion to the changes rather than to the size of the bitset.
+ *
+ * the header holds a hash of the old values of the changed words, so a
+ * diff applied to a bitset other than the one it was made from is caught.
+ */
+
+#define BITSET_DIFF_MAGIC	"SPBITDIF"
+#define BITSET_DIFF_VERSION	1
+
+/* the most bytes a block record can take */
+#define BITSET_DIFF_MAXBLOCK	(2 * sizeof(uint32_t) + \
+	BITSET_MAX_BLOCKSIZE / PAGESIZE * (sizeof(uint64_t) + PAGESIZE * sizeof(uint64_t)))
+
+struct bitset_diff_header {
+	char magic[8];
+	uint32_t version;
+	int32_t bitcount;
+	uint32_t blocks;		/* number of block records */
+	uint32_t blocksize;		/* words per block, 0 in diffs made before it was kept */
+	uint64_t base;			/* hash of the old values of the changed words */
+};
+
+
+static char *bitset_put64(char *p, uint64_t v)
+{
+	memcpy(p, &v, sizeof(v));
+	return p + sizeof(v);
+}
+
+static uint64_t bitset_get64(const char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* get word i of a page, where a NULL page is all 0 bits */
+#define PAGE_WORD(page, i)	((page) != NULL ? (page)->ints[i] : 0)
+
+/* write the record for block i, if it differs between from and to.
+ * returns the end of the record */
+static char *bitset_diff_block(struct bitset *from, struct bitset *to, int i,
+	char *p, uint64_t *base, uint32_t *blocks)
+{
+	struct bitset_block *ob = bitset_block_at(from, i), *nb = bitset_block_at(to, i);
+	struct bitset_page *op, *np;
+	uint32_t page_mask = 0;
+	uint64_t word_mask, x;
+	char *start = p, *mask_at;
+	int pg, w;
+
+	/* the block index and page mask are filled in at the end */
+	p += 2 * sizeof(uint32_t);
+
+	for (pg = 0; pg < BITSET_BLOCK_PAGES(to); pg++)
+	{
+		op = ob != NULL ? ob->pages[pg] : NULL;
+		np = nb != NULL ? nb->pages[pg] : NULL;
+		if (op == np)
+			continue;
+
+		mask_at = p;
+		p += sizeof(uint64_t);
+		word_mask = 0;
+
+		for (w = 0; w < PAGESIZE; w++)
+		{
+			x = PAGE_WORD(op, w) ^ PAGE_WORD(np, w);
+			if (x == 0)
+				continue;
+
+			word_mask |= 1ull << w;
+			p = bitset_put64(p, x);
+
+			x = PAGE_WORD(op, w);
+			*base = bitset_hash_words(*base, &x, 1);
+		}
+
+		if (word_mask == 0)
+		{
+			/* different pages with the same bits */
+			p = mask_at;
+			continue;
+		}
+
+		bitset_put64(mask_at, word_mask);
+		page_mask |= 1u << pg;
+	}
+
+	if (page_mask == 0)
+		return start;
+
+	bitset_put32(start, i);
+	bitset_put32(start + sizeof(uint32_t), page_mask);
+	(*blocks)++;
+
+	return p;
+}
+
+/* Encode the changes from one bitset to another */
+int bitset_diff_encode(struct bitset *from, struct bitset *to, char **buf_out, size_t *size_out)
+{
+	struct bitset_diff_header hdr;
+	char *buf = NULL, *p, *grown;
+	size_t cap, used;
+	int i, j, ret;
+
+	if (from == NULL || to == NULL || buf_out == NULL || size_out == NULL)
+		return ERRINPUT;
+
+	if (from->bitcount != to->bitcount)
+		return ERRINPUT;
+
+	if (from->small || to->small)
+	{
+		struct bitset *f = NULL, *t = NULL;
+
+		ret = from->small ? bitset_small_expand(from, &f) : OK;
+		if (ret == OK)
+			ret = to->small ? bitset_small_expand(to, &t) : OK;
+		if (ret == OK)
+			ret = bitset_diff_encode(f ? f : from, t ? t : to, buf_out, size_out);
+		bitset_free(f);
+		bitset_free(t);
+		return ret;
+	}
+
+	/* the records are in the blocks of the new bitset.  regrouping the old
+	 * one shares its pages, so unchanged pages are still skipped */
+	if (from->block_shift != to->block_shift)
+	{
+		struct bitset *f = NULL;
+
+		if ((ret = bitset_reblock(from, to->block_shift, &f)) == OK)
+			ret = bitset_diff_encode(f, to, buf_out, size_out);
+		bitset_free(f);
+		return ret;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BITSET_DIFF_MAGIC, sizeof(hdr.magic));
+	hdr.version = BITSET_DIFF_VERSION;
+	hdr.bitcount = to->bitcount;
+	hdr.blocksize = BITSET_BLOCK_IDS(to) / BITSPERINT;
+
+	cap = sizeof(hdr) + BITSET_DIFF_MAXBLOCK;
+	if ((buf = (char *)malloc(cap)) == NULL)
+		return ERRMEM;
+	p = buf + sizeof(hdr);
+
+	/* only blocks occupied in either bitset can differ */
+	for (i = 0; ; i++)
+	{
+		j = bitset_next_block(to, i);
+		if ((i = bitset_next_block(from, i)) > j)
+			i = j;
+		if (i >= to->block_count)
+			break;
+
+		/* blocks shared between the bitsets are the same */
+		if (bitset_block_at(from, i) == bitset_block_at(to, i))
+			continue;
+
+		/* make sure there is room for the largest record */
+		used = p - buf;
+		if (used + BITSET_DIFF_MAXBLOCK > cap)
+		{
+			if ((grown = (char *)realloc(buf, cap * 2)) == NULL)
+			{
+				free(buf);
+				return ERRMEM;
+			}
+			p = grown + used;
+			buf = grown;
+			cap *= 2;
+		}
+
+		p = bitset_diff_block(from, to, i, p, &hdr.base, &hdr.blocks);
+	}
+
+	memcpy(buf, &hdr, sizeof(hdr));
+
+	*buf_out = buf;
+	*size_out = p - buf;
+
+	return OK;
+}
+
+/* check the records of a diff fit in size bytes, and hash the words of
+ * bset they change */
+static int bitset_diff_check(struct bitset *bset, const char *buf, size_t size,
+	uint32_t blocks, uint64_t *base)
+{
+	struct bitset_block *blk;
+	struct bitset_page *page;
+	const char *p = buf, *end = buf + size;
+	uint32_t block, page_mask, n;
+	uint64_t word_mask, w;
+	int pg, last = -1;
+
+	for (n = 0; n < blocks; n++)
+	{
+		if (end - p < 2 * (int)sizeof(uint32_t))
+			return ERRFORMAT;
+
+		block = bitset_get32(p);
+		page_mask = bitset_get32(p + sizeof(uint32_t));
+		p += 2 * sizeof(uint32_t);
+
+		/* blocks are in increasing order, and each record changes something */
+		if ((int)block <= last || block >= (uint32_t)bset->block_count ||
+			page_mask == 0 || ((uint64_t)page_mask >> BITSET_BLOCK_PAGES(bset)) != 0)
+			return ERRFORMAT;
+		last = block;
+
+		blk = bitset_block_at(bset, block);
+
+		for (pg = 0; pg < BITSET_BLOCK_PAGES(bset); pg++)
+		{
+			if ((page_mask & (1u << pg)) == 0)
+				continue;
+
+			if (end - p < (int)sizeof(uint64_t))
+				return ERRFORMAT;
+			word_mask = bitset_get64(p);
+			p += sizeof(uint64_t);
+
+			if (word_mask == 0 || (size_t)(end - p) <
+					sizeof(uint64_t) * __builtin_popcountll(word_mask))
+				return ERRFORMAT;
+			p += sizeof(uint64_t) * __builtin_popcountll(word_mask);
+
+			page = blk != NULL ? blk->pages[pg] : NULL;
+			for (; word_mask != 0; word_mask &= word_mask - 1)
+			{
+				w = PAGE_WORD(page, __builtin_ctzll(word_mask));
+				*base = bitset_hash_words(*base, &w, 1);
+			}
+		}
+	}
+
+	if (p != end)
+		return ERRFORMAT;
+
+	return OK;
+}
+
+/* apply a block record which has been checked to the bitset */
+static int bitset_diff_apply_block(struct bitset *bset, const char **pp)
+{
+	struct bitset_block *blk;
+	struct bitset_page *page;
+	const char *p = *pp;
+	uint32_t block, page_mask;
+	uint64_t word_mask;
+	int pg, w, c, ret;
+
+	block = bitset_get32(p);
+	page_mask = bitset_get32(p + sizeof(uint32_t));
+	p += 2 * sizeof(uint32_t);
+
+	if ((blk = bitset_block_at(bset, block)) == NULL)
+	{
+		if ((ret = bitset_block_alloc(bset, block, &blk)) != OK)
+			return ret;
+	}
+	else if (bitset_block_shared(blk))
+	{
+		if ((ret = bitset_block_realloc(bset, block, &blk)) != OK)
+			return ret;
+	}
+
+	for (pg = 0; pg < blk->page_count; pg++)
+	{
+		if ((page_mask & (1u << pg)) == 0)
+			continue;
+
+		word_mask = bitset_get64(p);
+		p += sizeof(uint64_t);
+
+		if ((ret = bitset_page_writable(blk, pg, &page)) != OK)
+			return ret;
+
+		c = page->set_count;
+		for (; word_mask != 0; word_mask &= word_mask - 1)
+		{
+			w = __builtin_ctzll(word_mask);
+			page->set_count -= __builtin_popcountll(page->ints[w]);
+			page->ints[w] ^= bitset_get64(p);
+			page->set_count += __builtin_popcountll(page->ints[w]);
+			p += sizeof(uint64_t);
+		}
+		blk->set_count += page->set_count - c;
+
+		if (page->set_count == 0)
+			bitset_block_drop_page(blk, pg);
+	}
+
+	if (blk->set_count == 0)
+	{
+		bitset_block_decref(blk);
+		bitset_block_store(bset, block, NULL);
+	}
+
+	*pp = p;
+
+	return OK;
+}
+
+/* Apply a diff made by bitset_diff_encode */
+int bitset_diff_apply(struct bitset *bset, const char *buf, size_t size)
+{
+	struct bitset_diff_header hdr;
+	const char *p;
+	uint64_t base = 0;
+	uint32_t n;
+	int ret;
+
+	if (bset == NULL || buf == NULL)
+		return ERRINPUT;
+
+	/* the words changed are not journaled */
+	if (bset->journal != NULL)
+		return ERRINPUT;
+
+	if (size < sizeof(hdr))
+		return ERRFORMAT;
+	memcpy(&hdr, buf, sizeof(hdr));
+
+	if (memcmp(hdr.magic, BITSET_DIFF_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.version != BITSET_DIFF_VERSION)
+		return ERRFORMAT;
+
+	if (hdr.bitcount != bset->bitcount)
+		return ERRINPUT;
+
+	/* the block records only fit a bitset with the same block size */
+	if ((hdr.blocksize != 0 ? (int)hdr.blocksize : BLOCKSIZE) != BITSET_BLOCK_IDS(bset) / BITSPERINT)
+		return ERRINPUT;
+
+	/* the diff is made of block records */
+	if (bset->small && (ret = bitset_small_promote(bset)) != OK)
+		return ret;
+
+	/* nothing is changed unless the whole diff is good and was made from a
+	 * bitset with the same bits as this one */
+	p = buf + sizeof(hdr);
+	if ((ret = bitset_diff_check(bset, p, size - sizeof(hdr), hdr.blocks, &base)) != OK)
+		return ret;
+
+	if (base != hdr.base)
+		return ERRFORMAT;
+
+	for (n = 0; n < hdr.blocks; n++)
+	{
+		if ((ret = bitset_diff_apply_block(bset, &p)) != OK)
+			return ret;
+	}
+
+	return OK;
+}
+
+
+
+/******************************************************************************
+ * JOURNAL
+ *
+ * a journal is a log file of the changes made to a bitset since it was last
+ * saved.  the log starts with a header, followed by frames of records.  each
+ * frame is written with a single write and made durable with a single
+ * fdatasync, so a group of changes costs one disk flush.  a frame has its
+ * length and a checksum of its records, so a frame torn by a crash is found
+ * and ignored by replay.
+ *
+ * a record is an op byte followed by unsigned varint arguments: a bit for
+ * set, clear and toggle, an operand id for or, and and subtract, nothing for
+ * invert, and a count and the bits for a bulk set.  the bits of a bulk set
+ * are stored as zigzag varint deltas from the previous bit.
+ */
+
+#define BITSET_JOURNAL_MAGIC	"SPBITLOG"
+#define BITSET_JOURNAL_VERSION	1
+
+#define BITSET_JOURNAL_BUFSIZE	(64*1024)
+
+/* the most bits in one bulk record, so a record always fits in a frame */
+#define BITSET_JOURNAL_BULK		1024
+
+/* the most bytes a record can take */
+#define BITSET_JOURNAL_MAXREC	(1 + 5 + 5 * BITSET_JOURNAL_BULK)
+
+struct bitset_journal_header {
+	char magic[8];
+	uint32_t version;
+	int32_t bitcount;
+};
+
+struct bitset_journal_frame {
+	uint32_t length;	/* bytes of records after the frame header */
+	uint32_t checksum;
+};
+
+struct bitset_journal {
+	int fd;
+
+	/* the number of records to gather in a frame before writing it */
+	int group;
+	int records;
+
+	/* the frame being gathered, starting with space for its header */
+	char *buf;
+	size_t len;
+};
+
+
+static uint32_t bitset_hash_bytes(const char *p, size_t n)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		h ^= (unsigned char)p[i];
+		h *= 0x100000001b3ull;
+	}
+
+	return (uint32_t)(h ^ (h >> 32));
+}
+
+static char *bitset_put_varint(char *p, uint32_t v)
+{
+	while (v >= 0x80)
+	{
+		*p++ = (char)(v | 0x80);
+		v >>= 7;
+	}
+	*p++ = (char)v;
+
+	return p;
+}
+
+/* read a varint at *p, not reading past end.  returns 0 if it is cut short
+ * or too long */
+static int bitset_get_varint(const char **p, const char *end, uint32_t *v)
+{
+	uint32_t x = 0;
+	int shift;
+
+	for (shift = 0; *p < end && shift < 35; shift += 7)
+	{
+		x |= (uint32_t)(**p & 0x7f) << shift;
+		if ((*(*p)++ & 0x80) == 0)
+		{
+			*v = x;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* write the gathered frame to the log and flush it to disk */
+static int bitset_journal_commit(struct bitset_journal *j)
+{
+	struct bitset_journal_frame frame;
+	struct bitset_stream s;
+	off_t start;
+	int ret;
+
+	if (j->records == 0)
+		return OK;
+
+	frame.length = j->len - sizeof(frame);
+	frame.checksum = bitset_hash_bytes(j->buf + sizeof(frame), frame.length);
+	memcpy(j->buf, &frame, sizeof(frame));
+
+	memset(&s, 0, sizeof(s));
+	s.fd = j->fd;
+	s.buf = j->buf;
+	s.pos = j->len;
+
+	/* a frame which is only partly written is cut off the log, so that a
+	 * retry does not leave a torn frame in front of the later ones */
+	start = lseek(j->fd, 0, SEEK_CUR);
+
+	if ((ret = bitset_stream_flush(&s)) != OK)
+	{
+		if (start >= 0 && ftruncate(j->fd, start) == 0)
+			lseek(j->fd, start, SEEK_SET);
+		return ret;
+	}
+
+	if (fdatasync(j->fd) != 0)
+		return ERRIO;
+
+	j->len = sizeof(frame);
+	j->records = 0;
+
+	return OK;
+}
+
+/* make room in the frame for a record, and count it */
+static int bitset_journal_reserve(struct bitset_journal *j)
+{
+	int ret;
+
+	if (j->len + BITSET_JOURNAL_MAXREC > BITSET_JOURNAL_BUFSIZE)
+	{
+		if ((ret = bitset_journal_commit(j)) != OK)
+			return ret;
+	}
+
+	j->records++;
+
+	return OK;
+}
+
+/* the frame is committed once it holds a full group of records */
+static int bitset_journal_end(struct bitset_journal *j)
+{
+	if (j->records >= j->group)
+		return bitset_journal_commit(j);
+
+	return OK;
+}
+
+/* record an op with one argument in the journal of bset, if it has one */
+static int bitset_journal_log(struct bitset *bset, int op, uint32_t arg)
+{
+	struct bitset_journal *j = bset->journal;
+	char *p;
+	int ret;
+
+	if (j == NULL)
+		return OK;
+
+	if ((ret = bitset_journal_reserve(j)) != OK)
+		return ret;
+
+	p = j->buf + j->len;
+	*p++ = op;
+	if (op != JOURNAL_INVERT)
+		p = bitset_put_varint(p, arg);
+	j->len = p - j->buf;
+
+	return bitset_journal_end(j);
+}
+
+/* record a bulk set in the journal of bset, if it has one */
+static int bitset_journal_log_bulk(struct bitset *bset, const int *bits, int count)
+{
+	struct bitset_journal *j = bset->journal;
+	int32_t prev, d;
+	char *p;
+	int i, n, ret;
+
+	if (j == NULL)
+		return OK;
+
+	while (count > 0)
+	{
+		if ((ret = bitset_journal_reserve(j)) != OK)
+			return ret;
+
+		n = count < BITSET_JOURNAL_BULK ? count : BITSET_JOURNAL_BULK;
+
+		p = j->buf + j->len;
+		*p++ = JOURNAL_BULK;
+		p = bitset_put_varint(p, n);
+		for (i = 0, prev = 0; i < n; i++)
+		{
+			d = bits[i] - prev;
+			p = bitset_put_varint(p, ((uint32_t)d << 1) ^ (uint32_t)(d >> 31));
+			prev = bits[i];
+		}
+		j->len = p - j->buf;
+
+		bits += n;
+		count -= n;
+	}
+
+	return bitset_journal_end(j);
+}
+
+/* start reading the log on fd from its beginning, and check its header */
+static int bitset_journal_read_header(struct bitset_stream *s, int bitcount)
+{
+	struct bitset_journal_header hdr;
+	int ret;
+
+	if (lseek(s->fd, 0, SEEK_SET) != 0)
+		return ERRIO;
+
+	if ((ret = bitset_stream_read(s, &hdr, sizeof(hdr))) != OK)
+		return ret;
+
+	if (memcmp(hdr.magic, BITSET_JOURNAL_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.version != BITSET_JOURNAL_VERSION)
+		return ERRFORMAT;
+
+	/* the log must be for a bitset of the same size */
+	if (hdr.bitcount != bitcount)
+		return ERRINPUT;
+
+	return OK;
+}
+
+/* read the next frame of the log into buf, returning the length of its
+ * records.  the log ends at the first frame which is missing, cut short or
+ * fails its checksum, since that is the one being written when the writer
+ * died.  returns -1 at the end of the log */
+static int bitset_journal_read_frame(struct bitset_stream *s, char *buf)
+{
+	struct bitset_journal_frame frame;
+
+	if (bitset_stream_read(s, &frame, sizeof(frame)) != OK ||
+		frame.length > BITSET_JOURNAL_BUFSIZE ||
+		bitset_stream_read(s, buf, frame.length) != OK ||
+		bitset_hash_bytes(buf, frame.length) != frame.checksum)
+		return -1;
+
+	return frame.length;
+}
+
+/* find the end of the last whole frame in the log on fd */
+static int bitset_journal_scan(int fd, int bitcount, off_t *end_out)
+{
+	struct bitset_stream s;
+	char *frame_buf = NULL;
+	int ret;
+
+	memset(&s, 0, sizeof(s));
+	s.fd = fd;
+
+	s.buf = (char *)malloc(BITSET_IO_BUFSIZE);
+	frame_buf = (char *)malloc(BITSET_JOURNAL_BUFSIZE);
+	if (s.buf == NULL || frame_buf == NULL)
+	{
+		ret = ERRMEM;
+		goto exit;
+	}
+
+	if ((ret = bitset_journal_read_header(&s, bitcount)) != OK)
+		goto exit;
+
+	*end_out = s.offset;
+	while (bitset_journal_read_frame(&s, frame_buf) >= 0)
+		*end_out = s.offset;
+
+exit:
+	free(s.buf);
+	free(frame_buf);
+
+	return ret;
+}
+
+/* Attach a journal to the bitset, logging to fd */
+int bitset_journal_open(struct bitset *bset, int fd, int group)
+{
+	struct bitset_journal_header hdr;
+	struct bitset_journal *j = NULL;
+	struct stat st;
+	off_t end;
+	int ret;
+
+	if (bset == NULL || fd < 0 || group < 1 || bset->journal != NULL)
+		return ERRINPUT;
+
+	if (fstat(fd, &st) != 0)
+		return ERRIO;
+
+	if (st.st_size == 0)
+	{
+		/* a new log starts with a header */
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, BITSET_JOURNAL_MAGIC, sizeof(hdr.magic));
+		hdr.version = BITSET_JOURNAL_VERSION;
+		hdr.bitcount = bset->bitcount;
+
+		if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fdatasync(fd) != 0)
+			return ERRIO;
+	}
+	else
+	{
+		/* a torn frame at the end of an existing log is cut off, so that
+		 * new frames follow on from the last whole one */
+		if ((ret = bitset_journal_scan(fd, bset->bitcount, &end)) != OK)
+			return ret;
+
+		if (end < st.st_size && ftruncate(fd, end) != 0)
+			return ERRIO;
+	}
+
+	/* frames are appended at the end of the log */
+	if (lseek(fd, 0, SEEK_END) < 0)
+		return ERRIO;
+
+	j = (struct bitset_journal *)malloc(sizeof(struct bitset_journal));
+	if (j == NULL)
+		return ERRMEM;
+	memset(j, 0, sizeof(struct bitset_journal));
+
+	j->buf = (char *)malloc(BITSET_JOURNAL_BUFSIZE);
+	if (j->buf == NULL)
+	{
+		ret = ERRMEM;
+		goto exit;
+	}
+
+	j->fd = fd;
+	j->group = group;
+	j->len = sizeof(struct bitset_journal_frame);
+
+	bset->journal = j;
+	j = NULL;
+
+	ret = OK;
+
+exit:
+	if (j != NULL)
+	{
+		free(j->buf);
+		free(j);
+	}
+
+	return ret;
+}
+
+/* Write out the changes waiting to be logged */
+int bitset_journal_sync(struct bitset *bset)
+{
+	if (bset == NULL || bset->journal == NULL)
+		return ERRINPUT;
+
+	return bitset_journal_commit(bset->journal);
+}
+
+/* Empty the log, once the bitset has been saved */
+int bitset_journal_reset(struct bitset *bset)
+{
+	struct bitset_journal *j;
+	off_t start = sizeof(struct bitset_journal_header);
+
+	if (bset == NULL || (j = bset->journal) == NULL)
+		return ERRINPUT;
+
+	/* changes not yet logged are already in the saved bitset */
+	j->len = sizeof(struct bitset_journal_frame);
+	j->records = 0;
+
+	if (ftruncate(j->fd, start) != 0 || lseek(j->fd, start, SEEK_SET) != start ||
+		fdatasync(j->fd) != 0)
+		return ERRIO;
+
+	return OK;
+}
+
+/* Detach the journal from the bitset */
+int bitset_journal_close(struct bitset *bset)
+{
+	int ret;
+
+	if (bset == NULL || bset->journal == NULL)
+		return ERRINPUT;
+
+	ret = bitset_journal_commit(bset->journal);
+
+	free(bset->journal->buf);
+	free(bset->journal);
+	bset->journal = NULL;
+
+	return ret;
+}
+
+static int bitset_cmp_int(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* set the gathered bits, in order */
+static int bitset_replay_flush(struct bitset *bset, int *bits, int *count)
+{
+	int ret;
+
+	qsort(bits, *count, sizeof(int), bitset_cmp_int);
+	ret = bitset_set_bulk(bset, bits, *count);
+	*count = 0;
+
+	return ret;
+}
+
+/* apply the records of a frame to bset.  sets are gathered in bits and
+ * applied in bulk when a different op comes along or bits is full */
+static int bitset_replay_frame(struct bitset *bset, const char *p, const char *end,
+	struct bitset **operands, int noperands, int *bits, int *count)
+{
+	uint32_t arg, n, d;
+	int32_t prev;
+	int op, ret;
+
+	while (p < end)
+	{
+		op = *p++;
+
+		if (op != JOURNAL_INVERT && !bitset_get_varint(&p, end, &arg))
+			return ERRFORMAT;
+
+		if (op == JOURNAL_SET || op == JOURNAL_BULK)
+		{
+			n = op == JOURNAL_SET ? 1 : arg;
+			if (n > BITSET_JOURNAL_BULK)
+				return ERRFORMAT;
+
+			if (*count + n > BITSET_JOURNAL_BUFSIZE)
+			{
+				if ((ret = bitset_replay_flush(bset, bits, count)) != OK)
+					return ret;
+			}
+
+			if (op == JOURNAL_SET)
+			{
+				bits[(*count)++] = arg;
+				continue;
+			}
+
+			for (prev = 0; n > 0; n--)
+			{
+				if (!bitset_get_varint(&p, end, &d))
+					return ERRFORMAT;
+				prev += (int32_t)((d >> 1) ^ -(d & 1));
+				bits[(*count)++] = prev;
+			}
+			continue;
+		}
+
+		/* everything else must happen after the sets before it */
+		if ((ret = bitset_replay_flush(bset, bits, count)) != OK)
+			return ret;
+
+		switch (op)
+		{
+		case JOURNAL_CLR:
+			ret = bitset_clr(bset, arg);
+			break;
+		case JOURNAL_TOGGLE:
+			ret = bitset_toggle_bit(bset, arg);
+			break;
+		case JOURNAL_INVERT:
+			ret = bitset_invert(bset);
+			break;
+		case JOURNAL_OR:
+		case JOURNAL_AND:
+		case JOURNAL_SUBTRACT:
+			if (arg >= (uint32_t)noperands || operands[arg] == NULL)
+				return ERRINPUT;
+			if (op == JOURNAL_OR)
+				ret = bitset_or(bset, operands[arg]);
+			else if (op == JOURNAL_AND)
+				ret = bitset_and(bset, operands[arg]);
+			else
+				ret = bitset_subtract(bset, operands[arg]);
+			break;
+		default:
+			return ERRFORMAT;
+		}
+
+		if (ret != OK)
+			return ret;
+	}
+
+	return OK;
+}
+
+/* Apply the changes in a log to the bitset */
+int bitset_journal_replay(struct bitset *bset, int fd, struct bitset **operands, int noperands)
+{
+	struct bitset_journal *journal;
+	struct bitset_stream s;
+	char *frame_buf = NULL;
+	int *bits = NULL;
+	int n, count = 0, ret;
+	off_t pos;
+
+	if (bset == NULL || fd < 0 || noperands < 0 || (operands == NULL && noperands > 0))
+		return ERRINPUT;
+
+	/* the log may be the one attached to the bitset, so it is put back
+	 * where it was when we are done */
+	if ((pos = lseek(fd, 0, SEEK_CUR)) < 0)
+		return ERRIO;
+
+	/* the changes being replayed are already in the log */
+	journal = bset->journal;
+	bset->journal = NULL;
+
+	memset(&s, 0, sizeof(s));
+	s.fd = fd;
+
+	s.buf = (char *)malloc(BITSET_IO_BUFSIZE);
+	frame_buf = (char *)malloc(BITSET_JOURNAL_BUFSIZE);
+	bits = (int *)malloc(sizeof(int) * BITSET_JOURNAL_BUFSIZE);
+	if (s.buf == NULL || frame_buf == NULL || bits == NULL)
+	{
+		ret = ERRMEM;
+		goto exit;
+	}
+
+	if ((ret = bitset_journal_read_header(&s, bset->bitcount)) != OK)
+		goto exit;
+
+	while ((n = bitset_journal_read_frame(&s, frame_buf)) >= 0)
+	{
+		ret = bitset_replay_frame(bset, frame_buf, frame_buf + n,
+			operands, noperands, bits, &count);
+		if (ret != OK)
+			goto exit;
+	}
+
+	ret = bitset_replay_flush(bset, bits, &count);
+
+exit:
+	bset->journal = journal;
+
+	if (lseek(fd, pos, SEEK_SET) != pos && ret == OK)
+		ret = ERRIO;
+
+	free(s.buf);
+	free(frame_buf);
+	free(bits);
+
+	return ret;
+}
+
+
+
+/******************************************************************************
+ * DEDUPLICATION
+ *
+ * an intern table holds one canonical copy of each distinct page and block
+ * it has seen.  deduplicating a bitset swaps each of its pages, and then
+ * each of its blocks, for the canonical copy with the same contents, so
+ * bitsets built separately end up sharing their equal pages and blocks just
+ * as if they had come from one bitset_dup.  pages are found by a hash of
+ * their words and blocks by a hash of their (canonical) page pointers.  the
+ * table holds a reference on each canonical copy, so they are shared and
+ * any later write to one copies it first.
+ */
+
+struct bitset_intern_entry {
+	uint64_t hash;
+	void *ptr;
+};
+
+/* an open addressing hash table of pages or blocks */
+struct bitset_intern_table {
+	struct bitset_intern_entry *entries;
+	size_t size;		/* a power of 2 */
+	size_t count;
+};
+
+struct bitset_intern {
+	struct bitset_intern_table pages;
+	struct bitset_intern_table blocks;
+};
+
+#define BITSET_INTERN_MINSIZE	1024
+
+
+/* Allocate an empty intern table */
+int bitset_intern_alloc(struct bitset_intern **tbl_out)
+{
+	struct bitset_intern *tbl;
+
+	if (tbl_out == NULL || *tbl_out != NULL)
 		return ERRINPUT;
 
-	DIVMOD(bit, IDSPERBLOCK, block, block_bit);
-	assert(block < bset->block_count);
+	if ((tbl = (struct bitset_intern *)malloc(sizeof(struct bitset_intern))) == NULL)
+		return ERRMEM;
+	memset(tbl, 0, sizeof(struct bitset_intern));
+
+	*tbl_out = tbl;
+
+	return OK;
+}
+
+/* Free an intern table, dropping its references on the canonical copies */
+void bitset_intern_free(struct bitset_intern *tbl)
+{
+	size_t i;
+
+	if (tbl == NULL)
+		return;
+
+	for (i = 0; i < tbl->pages.size; i++)
+	{
+		if (tbl->pages.entries[i].ptr != NULL)
+			bitset_page_decref((struct bitset_page *)tbl->pages.entries[i].ptr);
+	}
+
+	for (i = 0; i < tbl->blocks.size; i++)
+	{
+		if (tbl->blocks.entries[i].ptr != NULL)
+			bitset_block_decref((struct bitset_block *)tbl->blocks.entries[i].ptr);
+	}
+
+	free(tbl->pages.entries);
+	free(tbl->blocks.entries);
+	free(tbl);
+}
+
+/* make room in the table for one more entry, keeping it at most half full */
+static int bitset_intern_grow(struct bitset_intern_table *t)
+{
+	struct bitset_intern_entry *entries, *e;
+	size_t i, j, size;
+
+	if (2 * (t->count + 1) <= t->size)
+		return OK;
+
+	size = t->size != 0 ? 2 * t->size : BITSET_INTERN_MINSIZE;
+	entries = (struct bitset_intern_entry *)malloc(sizeof(struct bitset_intern_entry) * size);
+	if (entries == NULL)
+		return ERRMEM;
+	memset(entries, 0, sizeof(struct bitset_intern_entry) * size);
 
-	if ((blk = bset->blocks[block]) == NULL) 
+	for (i = 0; i < t->size; i++)
 	{
-		/* need to allocate the block */
-		if ((ret = bitset_block_alloc(bset, block, &blk)) != OK)
-			return ret;
+		e = &t->entries[i];
+		if (e->ptr == NULL)
+			continue;
+
+		for (j = e->hash & (size - 1); entries[j].ptr != NULL; j = (j + 1) & (size - 1))
+			;
+		entries[j] = *e;
 	}
-	else
+
+	free(t->entries);
+	t->entries = entries;
+	t->size = size;
+
+	return OK;
+}
+
+/* find the canonical copy of a page, making the page canonical if the table
+ * has no page with the same bits */
+static int bitset_intern_page(struct bitset_intern *tbl, struct bitset_page *page,
+	struct bitset_page **canon_out)
+{
+	struct bitset_intern_table *t = &tbl->pages;
+	struct bitset_page *other;
+	uint64_t h;
+	size_t j;
+	int ret;
+
+	if ((ret = bitset_intern_grow(t)) != OK)
+		return ret;
+
+	h = bitset_hash_words(page->set_count, page->ints, PAGESIZE);
+
+	for (j = h & (t->size - 1); (other = (struct bitset_page *)t->entries[j].ptr) != NULL; j = (j + 1) & (t->size - 1))
 	{
-		/* if the block is a shared block, need to allocate a new one */
-		if (blk->ref_count > 1) 
+		if (other == page || (t->entries[j].hash == h && other->set_count == page->set_count &&
+				memcmp(other->ints, page->ints, sizeof(page->ints)) == 0))
 		{
-			if ((ret = bitset_block_realloc(bset, block, &blk)) != OK)
-				return ret;
+			*canon_out = other;
+			return OK;
 		}
 	}
 
-	assert(blk != NULL);
+	bitset_page_incref(page);
+	t->entries[j].hash = h;
+	t->entries[j].ptr = page;
+	t->count++;
 
-	bitset_block_toggle_bit(blk, block_bit);
+	*canon_out = page;
 
 	return OK;
 }
 
-
-/* test if a bit in the bitset is on */
-int bitset_test_bit(struct bitset *a, int bit, int *out)
+/* find the canonical copy of a block, by the same rule */
+static int bitset_intern_block(struct bitset_intern *tbl, struct bitset_block *blk,
+	struct bitset_block **canon_out)
 {
-	int block, block_bit;
-	struct bitset_block *blk;
-
-	if (bit < 0 || bit >= a->bitcount)
-		return ERRINPUT;
-	if (out == NULL)
-		return ERRINPUT;
+	struct bitset_intern_table *t = &tbl->blocks;
+	struct bitset_block *other;
+	uint64_t h, w;
+	size_t j;
+	int p, ret;
 
-	DIVMOD(bit, IDSPERBLOCK, block, block_bit);
-	assert(block < a->block_count);
+	if ((ret = bitset_intern_grow(t)) != OK)
+		return ret;
 
-	if ((blk = a->blocks[block]) == NULL) 
+	for (p = 0, h = blk->set_count; p < blk->page_count; p++)
 	{
-		*out = 0;
+		w = (uintptr_t)blk->pages[p];
+		h = bitset_hash_words(h, &w, 1);
 	}
-	else
+
+	for (j = h & (t->size - 1); (other = (struct bitset_block *)t->entries[j].ptr) != NULL; j = (j + 1) & (t->size - 1))
 	{
-		*out = bitset_block_test_bit(blk, block_bit);
+		if (other == blk || (t->entries[j].hash == h && other->page_count == blk->page_count &&
+				memcmp(other->pages, blk->pages, sizeof(blk->pages[0]) * blk->page_count) == 0))
+		{
+			*canon_out = other;
+			return OK;
+		}
 	}
 
+	bitset_block_incref(blk);
+	t->entries[j].hash = h;
+	t->entries[j].ptr = blk;
+	t->count++;
+
+	*canon_out = blk;
+
 	return OK;
 }
 
+/* Share the pages and blocks of the bitset with equal ones in the table */
+int bitset_dedupe(struct bitset_intern *tbl, struct bitset *bset)
+{
+	struct bitset_block *blk, *canon_blk;
+	struct bitset_page *page, *canon;
+	int i, p, n = 0, ret;
+
+	if (tbl == NULL || bset == NULL)
+		return ERRINPUT;
+
+	/* a small set has no pages to share */
+	if (bset->small)
+		return 0;
+
+	for (i = 0; (i = bitset_next_block(bset, i)) < bset->block_count; i++)
+	{
+		if ((blk = bitset_block_at(bset, i)) == NULL)
+			continue;
+
+		/* the pages of a shared block may be in use by another bitset, so
+		 * only the block pointer itself can be replaced */
+		if (!bitset_block_shared(blk))
+		{
+			for (p = 0; p < blk->page_count; p++)
+			{
+				if ((page = blk->pages[p]) == NULL)
+					continue;
+
+				if ((ret = bitset_intern_page(tbl, page, &canon)) != OK)
+					return ret;
+
+				if (canon != page)
+				{
+					bitset_page_incref(canon);
+					blk->pages[p] = canon;
+					bitset_page_decref(page);
+					n++;
+				}
+			}
+		}
+
+		if ((ret = bitset_intern_block(tbl, blk, &canon_blk)) != OK)
+			return ret;
+
+		if (canon_blk != blk)
+		{
+			/* replacing a block which is already stored cannot fail */
+			bitset_block_incref(canon_blk);
+			bitset_block_store(bset, i, canon_blk);
+			bitset_block_decref(blk);
+			n++;
+		}
+	}
+
+	return n;
+}
+
 
 
 /******************************************************************************
- * SET OPERATIONS
+ * BLOCK OPERATIONS
  */
 
-/* Invert all of the bits in the bitset */
-int bitset_invert(struct bitset *a)
+/* create and return an empty bitset_block object with room for pages
+ * pages */
+static int bitset_block_new(int pages, struct bitset_block **blk_out)
+{
+	struct bitset_block *blk;
+	size_t sz = sizeof(struct bitset_block) + sizeof(struct bitset_page *) * pages;
+
+	blk = (struct bitset_block *) calloc(1, sz);
+	if (blk == NULL)
+		return ERRMEM;
+
+	/* update the memory stats */
+	bitset_count_alloc(sz);
+
+	blk->page_count = pages;
+	*blk_out = blk;
+
+	return OK;
+}
+
+/* allocate a block to be stored as block block of bset.  return it in
+ * blk_out if it is not NULL */
+static int bitset_block_alloc(struct bitset *bset, int block, struct bitset_block **blk_out)
 {
 	struct bitset_block *blk = NULL;
+	int ret;
+
+	ret = bitset_block_new(BITSET_BLOCK_PAGES(bset), &blk);
+	if (ret != OK)
+		return ret;
+
+	/* all of the pages start out NULL (all 0 bits) */
+	blk->ref_count = 1;
+
+	assert(bitset_block_at(bset, block) == NULL);
+	if ((ret = bitset_block_store(bset, block, blk)) != OK)
+	{
+		/* the block was never used */
+		bitset_uncount_alloc(sizeof(struct bitset_block) + sizeof(struct bitset_page *) * blk->page_count);
+		free(blk);
+		return ret;
+	}
+	STAT(bset, blocks_allocated, 1);
+
+	if (blk_out != NULL)
+		*blk_out = blk;
+
+	return OK;
+}
+
+
+/* re-allocate the shared block block of bset.  return it in
+ * blk_out if it is not NULL.  only the page pointers are copied; the
+ * pages themselves stay shared until they are written to */
+static int bitset_block_realloc(struct bitset *bset, int block, struct bitset_block **blk_out)
+{
+	struct bitset_block *orig, *blk;
 	int i, ret;
 
-	if (a == NULL)
-		return ERRINPUT;
+	/* save the original block (needed later to copy stuff) */
+	orig = bitset_block_at(bset, block);
+
+	assert(orig != NULL);
+	assert(bitset_block_shared(orig));
+
+	if ((ret = bitset_block_new(orig->page_count, &blk)) != OK)
+		return ret;
+
+	blk->ref_count = 1;
 
-	for (i = 0; i < a->block_count; i++)
+	/* copy the set_count and share the pages with the original block */
+	blk->set_count = orig->set_count;
+	for (i = 0; i < blk->page_count; i++)
 	{
-		if (a->blocks[i] == NULL)
-		{
-			/* block is a NULL pointer, so the invert is a block of all 1 bits */
-			ret = bitset_block_new(&blk);
-			if (ret != OK)
-				return ret;
+		blk->pages[i] = orig->pages[i];
+		if (blk->pages[i] != NULL)
+			bitset_page_incref(blk->pages[i]);
+	}
+	STAT(bset, blocks_copied, 1);
+	STAT(bset, bytes_copied, sizeof(struct bitset_page *) * blk->page_count);
+
+	/* the new block replaces our reference on the original.  it is
+	 * stored where orig was, so this cannot fail */
+	bitset_block_decref(orig);
+	bitset_block_store(bset, block, blk);
 
-			/* initialize the block */
-			blk->ref_count = 1;
-			blk->set_count = IDSPERBLOCK;
-			memset(blk->ints, -1, sizeof(int64_t) * BLOCKSIZE);
+	if (blk_out != NULL)
+		*blk_out = blk;
 
-			/* transfer ownership of the block to bitset a */
-			a->blocks[i] = blk;
-			blk = NULL;
-		} 
-		else
+	return OK;
+}
+
+
+/* allocate an empty block and atomically store it at bset->blocks[block]
+ * if that is still NULL.  the directory must be dense.  if another thread stored a block there first, the
+ * new block is thrown away and the other thread's block is returned in
+ * blk_out instead */
+static int bitset_block_install(struct bitset *bset, int block, struct bitset_block **blk_out)
+{
+	struct bitset_block *blk = NULL, *expected = NULL;
+	int ret;
+
+	ret = bitset_block_new(BITSET_BLOCK_PAGES(bset), &blk);
+	if (ret != OK)
+		return ret;
+
+	blk->ref_count = 1;
+
+	assert(bset->keys == NULL);
+	if (!__atomic_compare_exchange_n(&bset->blocks[block], &expected, blk, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		/* another thread installed a block first */
+		bitset_uncount_alloc(sizeof(struct bitset_block) + sizeof(struct bitset_page *) * blk->page_count);
+		free(blk);
+		blk = expected;
+	}
+	else
+	{
+		bitset_mark_block(bset, block);
+		STAT(bset, blocks_allocated, 1);
+	}
+
+	*blk_out = blk;
+
+	return OK;
+}
+
+
+static void bitset_block_incref(struct bitset_block *blk)
+{
+	if (threadsafe)
+		__atomic_add_fetch(&blk->ref_count, 1, __ATOMIC_RELAXED);
+	else
+		blk->ref_count++;
+}
+
+
+static void bitset_block_decref(struct bitset_block *blk)
+{
+	int i, n;
+
+	/* the release makes our accesses to the block happen before whichever
+	 * thread frees it or finds it unshared and writes to it */
+	if (threadsafe)
+		n = __atomic_sub_fetch(&blk->ref_count, 1, __ATOMIC_ACQ_REL);
+	else
+		n = --blk->ref_count;
+
+	if (n == 0)
+	{
+		for (i = 0; i < blk->page_count; i++)
 		{
-			if (a->blocks[i]->set_count == 64*BLOCKSIZE)
-			{
-				/* the block is all 1's so the inverse will be all empty
-				 * this can be represented by a NULL block pointer, so
-				 * decref the block and set the pointer NULL */
-				bitset_block_decref(a->blocks[i]);
-				a->blocks[i] = NULL;
-			}
-			else
-			{
-				/* do real inversion of the bits in the block */
-				bitset_block_invert(a->blocks[i]);
-			}
+			if (blk->pages[i] != NULL)
+				bitset_page_decref(blk->pages[i]);
 		}
+		STAT(NULL, blocks_freed, 1);
+		free(blk);
 	}
+}
+
+
+/* test if a block is referenced by anything other than the caller.  a block
+ * which is not shared can only be reached through the caller's bitset, so
+ * it is safe to modify in place */
+static int bitset_block_shared(struct bitset_block *blk)
+{
+	if (threadsafe)
+		return __atomic_load_n(&blk->ref_count, __ATOMIC_ACQUIRE) > 1;
+
+	return blk->ref_count > 1;
+}
+
+
+static int bitset_block_set_bit(struct bitset_block *blk, int bit)
+{
+	struct bitset_page *page;
+	int p, b, ret;
+
+	DIVMOD(bit, IDSPERPAGE, p, b);
+
+	if ((ret = bitset_page_writable(blk, p, &page)) != OK)
+		return ret;
+
+	bitset_page_set_bit(page, b);
+	blk->set_count++;
 
 	return OK;
 }
 
 
-/* Compute the inverse of the bitset and return it as a new bitset */
-int bitset_inverse(struct bitset *a, struct bitset **result_out)
+static int bitset_block_clr_bit(struct bitset_block *blk, int bit)
 {
-	struct bitset *r = NULL;
-	int ret;
+	struct bitset_page *page;
+	int p, b, ret;
 
-	if (result_out == NULL || *result_out != NULL)
-		return ERRINPUT;
+	DIVMOD(bit, IDSPERPAGE, p, b);
 
-	ret = bitset_dup(a, &r);
-	if (ret != OK)
-		goto exit;
-	
-	ret = bitset_invert(r);
-	if (ret != OK)
-		goto exit;
+	if ((ret = bitset_page_writable(blk, p, &page)) != OK)
+		return ret;
 
-	*result_out = r;
-	r = NULL;
+	bitset_page_clr_bit(page, b);
+	blk->set_count--;
 
-	ret = OK;
+	return OK;
+}
 
-exit:
-	if (r != NULL) 
-		bitset_free(r);
 
-	return ret;
+static int bitset_block_toggle_bit(struct bitset_block *blk, int bit)
+{
+	struct bitset_page *page;
+	int p, b, ret;
+
+	DIVMOD(bit, IDSPERPAGE, p, b);
+
+	if ((ret = bitset_page_writable(blk, p, &page)) != OK)
+		return ret;
+
+	if (bitset_page_toggle_bit(page, b))
+	{
+		/* bit was set */
+		blk->set_count++;
+	}
+	else
+	{
+		/* bit was cleared */
+		blk->set_count--;
+	}
+
+	return OK;
+}
+
+
+static int bitset_block_test_bit(struct bitset_block *blk, int bit)
+{
+	struct bitset_page *page;
+	int p, b;
+
+	DIVMOD(bit, IDSPERPAGE, p, b);
+
+	if ((page = blk->pages[p]) == NULL)
+		return 0;
+
+	return bitset_page_test_bit(page, b);
+}
+
+/* replace page p of block a with a shared reference to page b */
+static void bitset_block_share_page(struct bitset_block *a, int p, struct bitset_page *b)
+{
+	if (b != NULL)
+		bitset_page_incref(b);
+	bitset_block_drop_page(a, p);
+	a->pages[p] = b;
+	if (b != NULL)
+		a->set_count += b->set_count;
+}
+
+/* release page p of block a, leaving a NULL (all 0) page in its place */
+static void bitset_block_drop_page(struct bitset_block *a, int p)
+{
+	if (a->pages[p] != NULL)
+	{
+		a->set_count -= a->pages[p]->set_count;
+		bitset_page_decref(a->pages[p]);
+		a->pages[p] = NULL;
+	}
+}
+
+static int bitset_block_or(struct bitset_block *a, struct bitset_block *b)
+{
+	struct bitset_page *ap, *bp;
+	int p, c, ret;
+
+	assert(a->ref_count == 1);
+	assert(a->page_count == b->page_count);
+
+	for (p = 0; p < a->page_count; p++)
+	{
+		ap = a->pages[p];
+		bp = b->pages[p];
+
+		/* OR-ing in a NULL page, or into a full page, or a page into itself
+		 * leaves the page unchanged */
+		if (bp == NULL || ap == bp || (ap != NULL && ap->set_count == IDSPERPAGE))
+			continue;
+
+		if (ap == NULL || bp->set_count == IDSPERPAGE)
+		{
+			/* the result is simply the other page, so share it */
+			bitset_block_share_page(a, p, bp);
+			continue;
+		}
+
+		if ((ret = bitset_page_writable(a, p, &ap)) != OK)
+			return ret;
+
+		c = ap->set_count;
+		STAT(NULL, page_kernels, 1);
+		bitset_page_or(ap, bp);
+		a->set_count += ap->set_count - c;
+	}
+
+	return OK;
 }
 
-
-/* combine bitset A and B into bitset A by making A be the result of A | B (union) */
-int bitset_or(struct bitset *a, struct bitset *b)
+static int bitset_block_and(struct bitset_block *a, struct bitset_block *b)
 {
-	int i, ret;
+	struct bitset_page *ap, *bp;
+	int p, c, ret;
 
-	if (a == NULL || b == NULL) 
-		return ERRINPUT;
+	assert(a->ref_count == 1);
+	assert(a->page_count == b->page_count);
 
-	/* the bitsets must be the same size for this operation to make sense */
-	if (a->bitcount != b->bitcount)
-		return ERRINPUT;
+	for (p = 0; p < a->page_count; p++)
+	{
+		ap = a->pages[p];
+		bp = b->pages[p];
 
-	/* if the bit counts are the same, then the block counts must be
-	 * since the latter is computed from the former */
-	assert(a->block_count == b->block_count);
+		/* AND-ing a NULL page, into a full page or with itself leaves the page
+		 * unchanged */
+		if (ap == NULL || ap == bp || (bp != NULL && bp->set_count == IDSPERPAGE))
+			continue;
 
-	/* OR all the blocks together */
-	for (i = 0; i < a->block_count; i++)
-	{
-		if (a->blocks[i] == NULL && b->blocks[i] != NULL)
+		if (bp == NULL || ap->set_count == IDSPERPAGE)
 		{
-			/* OR-ing a NON null block into a NULL block is simply copying the other block over */
-			a->blocks[i] = b->blocks[i];
-			bitset_block_incref(a->blocks[i]);
+			/* the result is the other page */
+			bitset_block_share_page(a, p, bp);
+			continue;
 		}
-		else if (a->blocks[i] != NULL && b->blocks[i] != NULL)
-		{
-			/* if both blocks are non NULL, we need to OR the contents together */
 
-			/* first, since we are going to modify the block at a->blocks[i],
-			 * we need to re-allocate it if it is a shared block */
-			if (a->blocks[i]->ref_count > 1) 
-			{
-				if ((ret = bitset_block_realloc(a, i, NULL)) != OK)
-					return ret;
-			}
+		if ((ret = bitset_page_writable(a, p, &ap)) != OK)
+			return ret;
 
-			bitset_block_or(a->blocks[i], b->blocks[i]);
-		}
+		c = ap->set_count;
+		STAT(NULL, page_kernels, 1);
+		bitset_page_and(ap, bp);
+		a->set_count += ap->set_count - c;
+
+		if (ap->set_count == 0)
+			bitset_block_drop_page(a, p);
 	}
 
 	return OK;
 }
 
-
-/* combine bitset A and B into bitset A by making A be the result of A & B (intersection) */
-int bitset_and(struct bitset *a, struct bitset *b)
+static int bitset_block_subtract(struct bitset_block *a, struct bitset_block *b)
 {
-	int i, ret;
+	struct bitset_page *ap, *bp;
+	int p, c, ret;
 
-	if (a == NULL || b == NULL) 
-		return ERRINPUT;
+	assert(a->ref_count == 1);
+	assert(a->page_count == b->page_count);
 
-	/* the bitsets must be the same size for this operation to make sense */
-	if (a->bitcount != b->bitcount)
-		return ERRINPUT;
+	for (p = 0; p < a->page_count; p++)
+	{
+		ap = a->pages[p];
+		bp = b->pages[p];
 
-	/* if the bit counts are the same, then the block counts must be
-	 * since the latter is computed from the former */
-	assert(a->block_count == b->block_count);
+		if (ap == NULL || bp == NULL)
+			continue;
 
-	/* AND all the blocks together */
-	for (i = 0; i < a->block_count; i++)
-	{
-		if (a->blocks[i] != NULL && b->blocks[i] == NULL)
+		if (ap == bp || bp->set_count == IDSPERPAGE)
 		{
-			/* AND-ing a NULL block into a not-NULL block sets all the bits to
-			 * 0 so we, drop the block of bitset A. */
-			bitset_block_decref(a->blocks[i]);
-			a->blocks[i] = NULL;
+			/* everything in the page is subtracted away */
+			bitset_block_drop_page(a, p);
+			continue;
 		}
-		else if (a->blocks[i] != NULL && b->blocks[i] != NULL)
-		{
-			/* if both blocks are non NULL, we need to AND the contents together */
 
-			/* first, since we are going to modify the block at a->blocks[i],
-			 * we need to re-allocate it if it is a shared block */
-			if (a->blocks[i]->ref_count > 1) 
-			{
-				if ((ret = bitset_block_realloc(a, i, NULL)) != OK)
-					return ret;
-			}
+		if ((ret = bitset_page_writable(a, p, &ap)) != OK)
+			return ret;
 
-			bitset_block_and(a->blocks[i], b->blocks[i]);
-		}
+		c = ap->set_count;
+		STAT(NULL, page_kernels, 1);
+		bitset_page_subtract(ap, bp);
+		a->set_count += ap->set_count - c;
+
+		if (ap->set_count == 0)
+			bitset_block_drop_page(a, p);
 	}
 
 	return OK;
 }
 
-
-/* set bitset A to be A - B */
-int bitset_subtract(struct bitset *a, struct bitset *b)
+static int bitset_block_invert(struct bitset_block *b)
 {
-	int i, ret;
-
-	if (a == NULL || b == NULL) 
-		return ERRINPUT;
+	struct bitset_page *page, *full = NULL;
+	int p, ret;
 
-	/* the bitsets must be the same size for this operation to make sense */
-	if (a->bitcount != b->bitcount)
-		return ERRINPUT;
-
-	/* if the bit counts are the same, then the block counts must be
-	 * since the latter is computed from the former */
-	assert(a->block_count == b->block_count);
+	assert(b->ref_count == 1);
 
-	/* subtract all the blocks */
-	for (i = 0; i < a->block_count; i++)
+	for (p = 0; p < b->page_count; p++)
 	{
-		if (a->blocks[i] != NULL && b->blocks[i] != NULL)
-		{
-			/* if both blocks are non NULL, we subtract the bits in b from a */
+		page = b->pages[p];
 
-			/* first, since we are going to modify the block at a->blocks[i],
-			 * we need to re-allocate it if it is a shared block */
-			if (a->blocks[i]->ref_count > 1) 
+		if (page == NULL)
+		{
+			/* the inverse of a NULL page is a page of all 1 bits.  all of
+			 * the NULL pages in the block share a single full page */
+			if (full == NULL)
 			{
-				if ((ret = bitset_block_realloc(a, i, NULL)) != OK)
+				if ((ret = bitset_page_new(&full)) != OK)
 					return ret;
+
+				full->ref_count = 1;
+				full->set_count = IDSPERPAGE;
+				memset(full->ints, -1, sizeof(uint64_t) * PAGESIZE);
+
+				b->pages[p] = full;
+				b->set_count += IDSPERPAGE;
+			}
+			else
+			{
+				bitset_block_share_page(b, p, full);
 			}
+		}
+		else if (page->set_count == IDSPERPAGE)
+		{
+			/* a full page inverts to a NULL page */
+			bitset_block_drop_page(b, p);
+		}
+		else
+		{
+			if ((ret = bitset_page_writable(b, p, &page)) != OK)
+				return ret;
 
-			bitset_block_subtract(a->blocks[i], b->blocks[i]);
+			b->set_count -= page->set_count;
+			STAT(NULL, page_kernels, 1);
+			bitset_page_invert(page);
+			b->set_count += page->set_count;
 		}
 	}
 
 	return OK;
 }
 
-
-/* Compute the union of A and B and return it as a new bitset */
-int bitset_union(struct bitset *a, struct bitset *b, struct bitset **result_out)
+/* locate a 1 bit at the given pos or greater.
+ *
+ * pos must satisfy 0 <= pos < the number of bits in the block
+ *
+ * the bit number of the first 1 bit at pos or greater is returned.
+ * if no such bit is found, -1 is returned
+ */
+static int bitset_block_find_next_on_bit(struct bitset_block *block, int pos)
 {
-	struct bitset *r = NULL;
-	int ret;
-
-	if (result_out == NULL || *result_out != NULL)
-		return ERRINPUT;
-
-	ret = bitset_dup(a, &r);
-	if (ret != OK)
-		goto exit;
-	
-	ret = bitset_or(r, b);
-	if (ret != OK)
-		goto exit;
+	int p, b;
 
-	*result_out = r;
-	r = NULL;
+	assert(block != NULL);
+	assert(pos >= 0);
+	assert(pos < block->page_count * IDSPERPAGE);
 
-	ret = OK;
+	DIVMOD(pos, IDSPERPAGE, p, b);
 
-exit:
-	if (r != NULL) 
-		bitset_free(r);
+	/* iterate through the pages to find a page with an on bit */
+	for (; p < block->page_count; p++, b = 0)
+	{
+		if (block->pages[p] != NULL)
+		{
+			b = bitset_page_find_next_on_bit(block->pages[p], b);
+			if (b != -1)
+				return p*IDSPERPAGE + b;
+		}
+	}
 
-	return ret;
+	return -1;
 }
 
 
-/* Compute the intersection of A and B (A & B) and return it as a new bitset */
-int bitset_intersect(struct bitset *a, struct bitset *b, struct bitset **result_out)
-{
-	struct bitset *r = NULL;
-	int ret;
 
-	if (result_out == NULL || *result_out != NULL)
-		return ERRINPUT;
+/******************************************************************************
+ * PAGE OPERATIONS
+ */
 
-	ret = bitset_dup(a, &r);
-	if (ret != OK)
-		goto exit;
-	
-	ret = bitset_and(r, b);
-	if (ret != OK)
-		goto exit;
+/* create and return an uninitialized bitset_page object */
+static int bitset_page_new(struct bitset_page **page_out)
+{
+	struct bitset_page *page;
 
-	*result_out = r;
-	r = NULL;
+	page = (struct bitset_page *) malloc(sizeof(struct bitset_page));
+	if (page == NULL)
+		return ERRMEM;
 
-	ret = OK;
+	/* update the memory stats */
+	bitset_count_alloc(sizeof(struct bitset_page));
+	STAT(NULL, pages_allocated, 1);
 
-exit:
-	if (r != NULL) 
-		bitset_free(r);
+	*page_out = page;
 
-	return ret;
+	return OK;
 }
 
-
-/* Compute A - B and return it as a new bitset */
-int bitset_difference(struct bitset *a, struct bitset *b, struct bitset **result_out)
+/* allocate an empty page to be stored at blk->pages[p] */
+static int bitset_page_alloc(struct bitset_block *blk, int p, struct bitset_page **page_out)
 {
-	struct bitset *r = NULL;
+	struct bitset_page *page = NULL;
 	int ret;
 
-	if (result_out == NULL || *result_out != NULL)
-		return ERRINPUT;
-
-	ret = bitset_dup(a, &r);
-	if (ret != OK)
-		goto exit;
-	
-	ret = bitset_subtract(r, b);
+	ret = bitset_page_new(&page);
 	if (ret != OK)
-		goto exit;
+		return ret;
 
-	*result_out = r;
-	r = NULL;
+	memset(page, 0, sizeof(struct bitset_page));
+	page->ref_count = 1;
 
-	ret = OK;
+	assert(blk->pages[p] == NULL);
+	blk->pages[p] = page;
 
-exit:
-	if (r != NULL) 
-		bitset_free(r);
+	if (page_out != NULL)
+		*page_out = page;
 
-	return ret;
+	return OK;
 }
 
+/* re-allocate a shared page at blk->pages[p], copying its bits */
+static int bitset_page_realloc(struct bitset_block *blk, int p, struct bitset_page **page_out)
+{
+	struct bitset_page *orig, *page;
+	int ret;
 
+	assert(blk->pages[p] != NULL);
+	assert(bitset_page_shared(blk->pages[p]));
 
-/******************************************************************************
- * BLOCK OPERATIONS
- */
+	orig = blk->pages[p];
+
+	if ((ret = bitset_page_new(&page)) != OK)
+		return ret;
 
-/* create and return an uninitialized bitset_block object */
-static int bitset_block_new(struct bitset_block **blk_out)
+	page->ref_count = 1;
+	page->set_count = orig->set_count;
+	memcpy(page->ints, orig->ints, sizeof(uint64_t) * PAGESIZE);
+	STAT(NULL, pages_copied, 1);
+	STAT(NULL, bytes_copied, sizeof(uint64_t) * PAGESIZE);
+
+	bitset_page_decref(orig);
+	blk->pages[p] = page;
+
+	if (page_out != NULL)
+		*page_out = page;
+
+	return OK;
+}
+
+/* get page p of the (unshared) block blk ready to be modified, allocating
+ * it if it is NULL and copying it if it is shared */
+static int bitset_page_writable(struct bitset_block *blk, int p, struct bitset_page **page_out)
 {
-	struct bitset_block *blk;
+	struct bitset_page *page;
+	int ret;
 
-	blk = (struct bitset_block *) malloc(sizeof(struct bitset_block));
-	if (blk == NULL)
-		return ERRMEM;
+	assert(blk->ref_count == 1);
 
-	/* update the memory stats */
-	block_allocs++;
-	block_mem += sizeof(struct bitset_block);
+	if ((page = blk->pages[p]) == NULL)
+	{
+		if ((ret = bitset_page_alloc(blk, p, &page)) != OK)
+			return ret;
+	}
+	else if (bitset_page_shared(page))
+	{
+		if ((ret = bitset_page_realloc(blk, p, &page)) != OK)
+			return ret;
+	}
 
-	*blk_out = blk;
+	*page_out = page;
 
 	return OK;
 }
 
-/* allocate a block to be stored at bset->blocks[block].  return it in
- * blk_out if it is not NULL */
-static int bitset_block_alloc(struct bitset *bset, int block, struct bitset_block **blk_out)
+
+/* allocate an empty page and atomically store it at blk->pages[p] if that
+ * is still NULL, returning whichever page ended up there */
+static int bitset_page_install(struct bitset_block *blk, int p, struct bitset_page **page_out)
 {
-	struct bitset_block *blk = NULL;
+	struct bitset_page *page = NULL, *expected = NULL;
 	int ret;
 
-	ret = bitset_block_new(&blk);
+	ret = bitset_page_new(&page);
 	if (ret != OK)
 		return ret;
 
-	/* initialize the block */
-	memset(blk, 0, sizeof(struct bitset_block));
-	blk->ref_count = 1;
+	memset(page, 0, sizeof(struct bitset_page));
+	page->ref_count = 1;
 
-	assert(bset->blocks[block] == NULL);
-	bset->blocks[block] = blk;
+	if (!__atomic_compare_exchange_n(&blk->pages[p], &expected, page, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		/* another thread installed a page first */
+		bitset_uncount_alloc(sizeof(struct bitset_page));
+		STAT(NULL, pages_freed, 1);
+		free(page);
+		page = expected;
+	}
 
-	if (blk_out != NULL)
-		*blk_out = blk;
+	*page_out = page;
 
 	return OK;
 }
 
 
-/* re-allocate a shared block at bset->blocks[block].  return it in
- * blk_out if it is not NULL */
-static int bitset_block_realloc(struct bitset *bset, int block, struct bitset_block **blk_out)
+static void bitset_page_incref(struct bitset_page *page)
 {
-	struct bitset_block *orig, *blk;
-	int ret;
+	if (bitset_page_immortal(page))
+	{
+		bitset_mapping_ref(page, 1);
+		return;
+	}
 
-	assert(bset->blocks[block] != NULL);
-	assert(bset->blocks[block]->ref_count > 1);
+	if (threadsafe)
+		__atomic_add_fetch(&page->ref_count, 1, __ATOMIC_RELAXED);
+	else
+		page->ref_count++;
+}
 
-	/* save the original block (needed later to copy stuff) */
-	orig = bset->blocks[block];
 
-	/* decrement the reference count on it */
-	bitset_block_decref(orig);
+static void bitset_page_decref(struct bitset_page *page)
+{
+	int n;
+
+	if (bitset_page_immortal(page))
+	{
+		bitset_mapping_ref(page, -1);
+		return;
+	}
 
-	/* for now, clear the block pointer there */
-	bset->blocks[block] = NULL;
+	if (threadsafe)
+		n = __atomic_sub_fetch(&page->ref_count, 1, __ATOMIC_ACQ_REL);
+	else
+		n = --page->ref_count;
 
-	if ((ret = bitset_block_new(&blk)) != OK)
-		return ret;
+	if (n == 0)
+	{
+		STAT(NULL, pages_freed, 1);
+		free(page);
+	}
+}
 
-	blk->ref_count = 1;
-	bset->blocks[block] = blk;
 
-	/* copy the set_count and the bits to the new block */
-	blk->set_count = orig->set_count;
-	memcpy(blk->ints, orig->ints, sizeof(int64_t) * BLOCKSIZE);
+/* test if a page is referenced by more than one block, or is immortal */
+static int bitset_page_shared(struct bitset_page *page)
+{
+	int n;
 
-	if (blk_out != NULL)
-		*blk_out = blk;
+	if (threadsafe)
+		n = __atomic_load_n(&page->ref_count, __ATOMIC_ACQUIRE);
+	else
+		n = page->ref_count;
 
-	return OK;
+	return n > 1 || n == BITSET_IMMORTAL;
 }
 
-
-static void bitset_block_incref(struct bitset_block *blk)
+/* test if a page lives in a read-only mapping.  an immortal page's ref_count
+ * never changes, so a relaxed load is enough */
+static int bitset_page_immortal(struct bitset_page *page)
 {
-	blk->ref_count++;
+	if (threadsafe)
+		return __atomic_load_n(&page->ref_count, __ATOMIC_RELAXED) == BITSET_IMMORTAL;
+
+	return page->ref_count == BITSET_IMMORTAL;
 }
 
 
-static void bitset_block_decref(struct bitset_block *blk)
+static void bitset_page_set_bit(struct bitset_page *page, int bit)
 {
-	if (--blk->ref_count == 0)
-	{
-		free(blk);
-	}
+	int n, b;
+
+	DIVMOD(bit, 64, n, b);
+
+	page->ints[n] |= (1ull << b);
+	page->set_count++;
 }
 
 
-static void bitset_block_set_bit(struct bitset_block *blk, int bit)
+/* set a bit in a page that other threads may be writing to.  returns 1 if
+ * this call changed the bit from 0 to 1, and 0 if it was already set */
+static int bitset_page_set_bit_atomic(struct bitset_page *page, int bit)
 {
 	int n, b;
+	uint64_t mask, old;
 
 	DIVMOD(bit, 64, n, b);
 
-	blk->ints[n] |= (1ull << b);
-	blk->set_count++;
+	mask = 1ull << b;
+	old = __atomic_fetch_or(&page->ints[n], mask, __ATOMIC_RELAXED);
+	if (old & mask)
+		return 0;
+
+	__atomic_add_fetch(&page->set_count, 1, __ATOMIC_RELAXED);
+
+	return 1;
 }
 
 
-static void bitset_block_clr_bit(struct bitset_block *blk, int bit)
+static void bitset_page_clr_bit(struct bitset_page *page, int bit)
 {
 	int n, b;
 
 	DIVMOD(bit, 64, n, b);
 
-	blk->ints[n] &= ~(1ull << b);
-	blk->set_count--;
+	page->ints[n] &= ~(1ull << b);
+	page->set_count--;
 }
 
 
-static void bitset_block_toggle_bit(struct bitset_block *blk, int bit)
+/* toggle a bit in the page, returning the new value of the bit */
+static int bitset_page_toggle_bit(struct bitset_page *page, int bit)
 {
 	int n, b;
-	int64_t mask;
+	uint64_t mask;
 
 	DIVMOD(bit, 64, n, b);
 
 	mask = 1ull << b;
-	blk->ints[n] ^= mask;
+	page->ints[n] ^= mask;
 
-	if ((blk->ints[n] & mask) == 0ull)
+	if ((page->ints[n] & mask) == 0ull)
 	{
 		/* bit was cleared */
-		blk->set_count--;
-	} 
+		page->set_count--;
+		return 0;
+	}
 	else
 	{
 		/* bit was set */
-		blk->set_count++;
+		page->set_count++;
+		return 1;
 	}
 }
 
 
-static int bitset_block_test_bit(struct bitset_block *blk, int bit)
+static int bitset_page_test_bit(struct bitset_page *page, int bit)
 {
 	int n, b;
 
 	DIVMOD(bit, 64, n, b);
 
-	return (blk->ints[n] & (1ull << b)) != 0;
+	return (page->ints[n] & (1ull << b)) != 0;
 }
 
-static void bitset_block_or(struct bitset_block *a, struct bitset_block *b)
+static void bitset_page_or(struct bitset_page *a, struct bitset_page *b)
 {
 	int i, c;
-	
+
 	assert(a->ref_count == 1);
 
-	for (i = 0, c = 0; i < BLOCKSIZE; i++) 
+	for (i = 0, c = 0; i < PAGESIZE; i++)
 	{
 		a->ints[i] |= b->ints[i];
 		c += __builtin_popcountll(a->ints[i]);
 	}
 
-	/* update popcount on the block */
+	/* update popcount on the page */
 	a->set_count = c;
 }
 
-static void bitset_block_and(struct bitset_block *a, struct bitset_block *b)
+static void bitset_page_and(struct bitset_page *a, struct bitset_page *b)
 {
 	int i, c;
-	
+
 	assert(a->ref_count == 1);
 
-	for (i = 0, c = 0; i < BLOCKSIZE; i++) 
+	for (i = 0, c = 0; i < PAGESIZE; i++)
 	{
 		a->ints[i] &= b->ints[i];
 		c += __builtin_popcountll(a->ints[i]);
 	}
 
-	/* update popcount on the block */
+	/* update popcount on the page */
 	a->set_count = c;
 }
 
-static void bitset_block_subtract(struct bitset_block *a, struct bitset_block *b)
+static void bitset_page_subtract(struct bitset_page *a, struct bitset_page *b)
 {
 	int i, c;
-	
+
 	assert(a->ref_count == 1);
 
-	for (i = 0, c = 0; i < BLOCKSIZE; i++) 
+	for (i = 0, c = 0; i < PAGESIZE; i++)
 	{
 		a->ints[i] &= ~b->ints[i];
 		c += __builtin_popcountll(a->ints[i]);
 	}
 
-	/* update popcount on the block */
+	/* update popcount on the page */
 	a->set_count = c;
 }
 
-static void bitset_block_invert(struct bitset_block *b)
+static void bitset_page_invert(struct bitset_page *b)
 {
 	int i;
-	
+
 	assert(b->ref_count == 1);
 
-	for (i = 0; i < BLOCKSIZE; i++) 
+	for (i = 0; i < PAGESIZE; i++)
 	{
 		b->ints[i] = ~b->ints[i];
 	}
 
-	/* update popcount on the block */
-	b->set_count = IDSPERBLOCK - b->set_count;
+	/* update popcount on the page */
+	b->set_count = IDSPERPAGE - b->set_count;
 }
 
-/* locate a 1 bit at the given pos or greater.
- *
- * pos must satisfy 0 <= pos < IDSPERBLOCK
- *
- * the bit number of the first 1 bit at pos or greater is returned.
- * if no such bit is found, -1 is returned
- */
-static int bitset_block_find_next_on_bit(struct bitset_block *block, int pos)
+/* locate a 1 bit in the page at the given pos or greater.  returns -1
+ * if there is no such bit */
+static int bitset_page_find_next_on_bit(struct bitset_page *page, int pos)
 {
 	int n, b;
 	uint64_t v, m;
 
-	assert(block != NULL);
-	assert(block->ref_count == 1);
 	assert(pos >= 0);
-	assert(pos < IDSPERBLOCK);
+	assert(pos < IDSPERPAGE);
 
 	DIVMOD(pos, BITSPERINT, n, b);
 
-	assert(n < BLOCKSIZE);
-	assert(b < BITSPERINT);
-
 	/* iterate through the ints to find a non-zero int */
-	for (; n < BLOCKSIZE; n++, b=0) 
+	for (; n < PAGESIZE; n++, b=0)
 	{
-		if (block->ints[n] != 0)
+		if (page->ints[n] != 0)
 		{
-			v = block->ints[n];
+			v = page->ints[n];
 			for (; b < BITSPERINT; b++)
 			{
 				m = 1ull << b;
@@ -956,7 +6084,7 @@ static int bitset_block_find_next_on_bit(struct bitset_block *block, int pos)
 		}
 	}
 
-	if (n < BLOCKSIZE)
+	if (n < PAGESIZE)
 		return n*BITSPERINT + b;
 	else
 		return -1;
@@ -1012,19 +6140,37 @@ static void bitset_iter_first(struct bitset_iterator *iter)
 static void bitset_iter_next_on_bit(struct bitset_iterator *iter)
 {
 	struct bitset *bset;
+	struct bitset_block *blk;
+	int n;
 
 	assert(iter != NULL);
 	assert(iter->bset != NULL);
 	assert(iter->block_pos >= 0);
-	assert(iter->bit_pos >= -1 && iter->bit_pos < IDSPERBLOCK);
+	assert(iter->bit_pos >= -1 && iter->bit_pos < BITSET_BLOCK_IDS(iter->bset));
 	
 	bset = iter->bset;
 
 	/* advance to the next bit */
 	iter->bit_pos++;
 
+	if (bset->small)
+	{
+		/* go to the next inline bit, or the end */
+		n = bitset_small_find(bset, iter->block_pos * BITSET_BLOCK_IDS(iter->bset) + iter->bit_pos);
+		if (n < bset->small_count)
+		{
+			BLOCK_DIVMOD(bset, bset->small_ids[n], iter->block_pos, iter->bit_pos);
+		}
+		else
+		{
+			iter->block_pos = bset->block_count;
+			iter->bit_pos = 0;
+		}
+		return;
+	}
+
 	/* see if that advanced the iterator past the last bit in the block */
-	if (iter->bit_pos == IDSPERBLOCK)
+	if (iter->bit_pos == BITSET_BLOCK_IDS(bset))
 	{
 		iter->block_pos++;
 		iter->bit_pos = 0;
@@ -1034,16 +6180,16 @@ static void bitset_iter_next_on_bit(struct bitset_iterator *iter)
 	while (iter->block_pos < bset->block_count)
 	{
 		/* check if looking at an allocated block */
-		if (bset->blocks[iter->block_pos] == NULL)
+		if ((blk = bitset_block_lookup(bset, iter->block_pos)) == NULL)
 		{
-			/* move on to the next block */
-			iter->block_pos++;
+			/* move on to the next block which may be allocated */
+			iter->block_pos = bitset_next_block(bset, iter->block_pos + 1);
 			iter->bit_pos = 0;
 		}
 		else
 		{
 			/* find the next on bit in the current block */
-			iter->bit_pos = bitset_block_find_next_on_bit(bset->blocks[iter->block_pos], iter->bit_pos);
+			iter->bit_pos = bitset_block_find_next_on_bit(blk, iter->bit_pos);
 			if (iter->bit_pos == -1)
 			{
 				/* the current block didn't have another on bit after the current
@@ -1055,7 +6201,7 @@ static void bitset_iter_next_on_bit(struct bitset_iterator *iter)
 			{
 				/* found an on bit */
 				assert(iter->block_pos >= 0 && iter->block_pos < bset->block_count);
-				assert(iter->bit_pos >= 0 && iter->bit_pos < IDSPERBLOCK);
+				assert(iter->bit_pos >= 0 && iter->bit_pos < BITSET_BLOCK_IDS(bset));
 				break;
 			}
 		}
@@ -1077,7 +6223,7 @@ void bitset_iter_next(struct bitset_iterator *iter)
 	{
 	case BITSET_ITER_ALL:
 		iter->bit_pos++;
-		if (iter->bit_pos == IDSPERBLOCK)
+		if (iter->bit_pos == BITSET_BLOCK_IDS(iter->bset))
 		{
 			iter->block_pos++;
 			iter->bit_pos = 0;
@@ -1115,9 +6261,12 @@ int bitset_iter_get(struct bitset_iterator *iter)
 	struct bitset_block *block;
 
 	assert(iter->block_pos < iter->bset->block_count);
-	assert(iter->bit_pos < IDSPERBLOCK);
+	assert(iter->bit_pos < BITSET_BLOCK_IDS(iter->bset));
+
+	if (iter->bset->small)
+		return bitset_small_test(iter->bset, bitset_iter_index(iter));
 
-	block = iter->bset->blocks[iter->block_pos];
+	block = bitset_block_at(iter->bset, iter->block_pos);
 	if (block == NULL)
 		return 0;
 
@@ -1126,6 +6275,6 @@ int bitset_iter_get(struct bitset_iterator *iter)
 
 int bitset_iter_index(struct bitset_iterator *iter)
 {
-	return iter->block_pos * IDSPERBLOCK + iter->bit_pos;
+	return iter->block_pos * BITSET_BLOCK_IDS(iter->bset) + iter->bit_pos;
 }
 
@@ -6,13 +6,44 @@
 #define ERRMEM      -1
 #define ERRINPUT    -2
 #define ERRNOTIMPL  -3
+#define ERRIO       -4
+#define ERRFORMAT   -5
 
 #define BLOCKSIZE			1024
 #define BITSPERINT			64
 #define IDSPERBLOCK			(BLOCKSIZE*BITSPERINT)
 #define BLOCKCOUNT(idcount)	(((idcount)+IDSPERBLOCK-1)/IDSPERBLOCK)
 
-/* bitset_block contains a block of 64*BLOCKSIZE bits */
+/* the most bits a small set keeps inline before it moves to blocks */
+#define BITSET_SMALL_IDS	16
+
+#define PAGESIZE			64
+#define PAGECOUNT			(BLOCKSIZE/PAGESIZE)
+#define IDSPERPAGE			(PAGESIZE*BITSPERINT)
+#define PAGESHIFT			12	/* log2(IDSPERPAGE) */
+
+/* BLOCKSIZE is the default size of a block.  a bitset may be given any
+ * power of two block size, in words, from one page up to 32 pages */
+#define BITSET_MIN_BLOCKSIZE	PAGESIZE
+#define BITSET_MAX_BLOCKSIZE	(32*PAGESIZE)
+
+/* bitset_page contains a page of 64*PAGESIZE bits.  pages are the unit of
+ * copy-on-write: a block shared between bitsets shares its pages, and
+ * changing a bit in a shared block only copies the page holding the bit */
+struct bitset_page {
+	/* the reference count on the page. */
+	int ref_count;
+
+	/* the number of bits in the page that are set to 1 */
+	int set_count;
+
+	/* the bits themselves */
+	uint64_t ints[PAGESIZE];
+};
+
+/* bitset_block contains a block of bits, held in page_count pages.  the
+ * block size is chosen per bitset, and is BLOCKSIZE words (PAGECOUNT pages)
+ * by default */
 struct bitset_block {
 	/* the reference count on the block. */
 	int ref_count;
@@ -20,8 +51,11 @@ struct bitset_block {
 	/* the number of bits in the block that are set to 1 */
 	int set_count;
 
-	/* the bits themselves */
-	uint64_t ints[BLOCKSIZE];
+	/* the number of pages in the block */
+	int page_count;
+
+	/* the pages of bits.  a NULL page pointer is a page of all 0 bits */
+	struct bitset_page *pages[];
 };
 
 /* a bitset contains a set of bits which are 0 or 1. */
@@ -34,10 +68,95 @@ struct bitset {
 	 * allocated blocks */
 	int block_count;
 
-	/* an array of pointers to blocks of bits */
+	/* log2 of the number of bits in each block */
+	int block_shift;
+
+	/* set for a small set, which keeps its bits as small_count sorted ids
+	 * in small_ids and has no blocks or occupied bits */
+	int small;
+	int small_count;
+	int small_ids[BITSET_SMALL_IDS];
+
+	/* an array of pointers to blocks of bits.  a dense directory has one
+	 * for every block.  a sparse one, used while few blocks are occupied,
+	 * has one for each of its keys */
 	struct bitset_block **blocks;
+
+	/* the sorted indexes of the blocks in a sparse directory, or NULL if
+	 * the directory is dense.  a block keeps its key once it has been
+	 * non-NULL, so blocks[k] may be NULL */
+	int *keys;
+	int key_count;
+	int key_alloc;
+
+	/* for a dense directory, a bit for each block, set if the block may be
+	 * non-NULL.  whole-set operations only visit the blocks with their bit
+	 * set.  NULL for a sparse directory */
+	uint64_t *occupied;
+
+	/* published versions for snapshot readers, NULL until bitset_publish */
+	struct bitset_mvcc *mvcc;
+
+	/* the log of changes to the bitset, NULL unless bitset_journal_open */
+	struct bitset_journal *journal;
+
+	/* an id set by the caller, which a journal records for a bitset used
+	 * as the operand of bitset_or, bitset_and or bitset_subtract.  0 if
+	 * the bitset has no id */
+	int id;
+
+	/* event counters, NULL unless the library is built with BITSET_STATS */
+	struct bitset_stats *stats;
+};
+
+/* counts of the events inside the library, kept when it is built with
+ * BITSET_STATS (make STATS=1).  the global counters count every event.  the
+ * counters of a bitset count the block events of the operations which change
+ * it; the page and free counts are only kept globally, since blocks and
+ * pages may be shared by many bitsets */
+struct bitset_stats {
+	uint64_t blocks_allocated;
+	uint64_t blocks_freed;
+	uint64_t blocks_copied;		/* copy-on-write copies of a shared block */
+	uint64_t pages_allocated;
+	uint64_t pages_freed;
+	uint64_t pages_copied;		/* copy-on-write copies of a shared page */
+	uint64_t bytes_copied;		/* by the block and page copies */
+
+	/* calls of the block kernels of each whole-set operation */
+	uint64_t or_blocks;
+	uint64_t and_blocks;
+	uint64_t subtract_blocks;
+	uint64_t invert_blocks;
+	uint64_t count_blocks;
+
+	/* calls of the page kernels, which each popcount a page */
+	uint64_t page_kernels;
+
+	/* blocks a whole-set operation did no work on because they were NULL,
+	 * or because both bitsets share the block */
+	uint64_t null_skips;
+	uint64_t shared_skips;
+};
+
+/* the geometry of the blocks of bitset b */
+#define BITSET_BLOCK_IDS(b)		(1 << (b)->block_shift)
+#define BITSET_BLOCK_PAGES(b)	(1 << ((b)->block_shift - PAGESHIFT))
+#define BITSET_BLOCKCOUNT(b, idcount)	((int)(((long long)(idcount) + BITSET_BLOCK_IDS(b) - 1) >> (b)->block_shift))
+
+/* a reader's handle on a published version of a bitset */
+struct bitset_snapshot {
+	/* the version being read.  it must not be modified */
+	struct bitset *bset;
+
+	/* the snapshot state and the reader slot pinned by this snapshot */
+	struct bitset_mvcc *mvcc;
+	int slot;
 };
 
+/* a table of canonical pages and blocks used by bitset_dedupe */
+struct bitset_intern;
+
 /* an object to iterate the bits in the bitset */
 struct bitset_iterator {
 	/* the bitset being iterated */
@@ -57,27 +176,91 @@ struct bitset_iterator {
 #define BITSET_ITER_OFF   2    /* iterate only off (0) bits */
 
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* GLOBAL OPERATIONS */
 
 /* Read the memory allocation counters. */
 void bitset_get_alloc_stats(int *allocs, int *bytes);
 
+/* Copy the event counters of bset, or the global counters if bset is NULL,
+ * into stats.  Returns ERRNOTIMPL unless the library is built with
+ * BITSET_STATS. */
+int bitset_get_stats(struct bitset *bset, struct bitset_stats *stats);
+
+/* Zero the event counters of bset, or the global counters if bset is NULL */
+int bitset_reset_stats(struct bitset *bset);
+
+/* Turn thread-safe mode on or off.  In thread-safe mode block and page
+ * reference counts are updated atomically, so a bitset made with bitset_dup
+ * may be handed to another thread and read or freed there while the original
+ * keeps being written by its own thread.  Copy-on-write guarantees that a
+ * write never modifies a block or page that another bitset can see.
+ *
+ * Each bitset must still be used by one thread at a time; in particular
+ * bitset_dup must be called by the thread writing the source bitset.
+ * Set the mode before any bitset is shared between threads.  The inline
+ * bitset_set_fast and bitset_clr_fast may not be used in this mode. */
+void bitset_set_threadsafe(int enable);
+
+/* Set the number of threads used by the whole-set operations (invert, or,
+ * and, subtract, set_count and the functions built on them).  Bitsets with
+ * at least min_blocks blocks are split across nthreads threads; smaller ones
+ * are processed serially on the calling thread.  nthreads of 1 (the default)
+ * turns parallel execution off.  Using more than 1 thread turns on
+ * thread-safe mode.  Call this before running any set operations. */
+int bitset_set_threads(int nthreads, int min_blocks);
+
 
 /* OBJECT ALLOCATION AND DESTRUCTION */
 
 /* allocate a bitset with count bits in it, numbered 0 - (count-1)
- * all bits are initially set to 0 */
+ * all bits are initially set to 0.  A large bitset starts with a sparse
+ * block directory, sized by its occupied blocks, which is made dense once
+ * more than 1 in 16 of its blocks are occupied. */
 int bitset_alloc(int bitcount, struct bitset **bset_out) ;
 
+/* allocate a bitset whose blocks hold blocksize words, a power of two from
+ * BITSET_MIN_BLOCKSIZE to BITSET_MAX_BLOCKSIZE.  Small blocks keep the block
+ * overhead of a very sparse set low, and large ones shrink the directory of
+ * a dense one.  Operations between bitsets with different block sizes are
+ * allowed, and take the block size of the bitset being changed. */
+int bitset_alloc_blocksize(int bitcount, int blocksize, struct bitset **bset_out);
+
+/* allocate a small bitset with count bits in it.  Up to BITSET_SMALL_IDS
+ * set bits are kept inside the struct bitset, with no block directory or
+ * blocks, so a tiny set costs tens of bytes.  Setting one more bit moves it
+ * to blocks for good.  Set operations between a small set and a large one
+ * test the small set's bits in the large one directly, and A & B is small
+ * whenever either is.  bitset_set_concurrent is not supported on a small
+ * set. */
+int bitset_alloc_small(int bitcount, struct bitset **bset_out);
+
 /* initialize a bitset structure */
 int bitset_init(struct bitset *bset, int bitcount) ;
 
+/* initialize a bitset structure with blocks of blocksize words */
+int bitset_init_blocksize(struct bitset *bset, int bitcount, int blocksize);
+
 /* free a bitset structure */
 void bitset_free(struct bitset *bset);
 
 /* Duplicate a bitset and return it */
 int bitset_dup(struct bitset *s, struct bitset **r);
 
+/* Change the number of bits in a bitset.  Only the block directory is
+ * reallocated; the blocks stay shared with any copies.  Bits added by growing
+ * are 0, and bits past a smaller size are dropped.  A dense directory grown
+ * large with few blocks occupied is made sparse.  Returns ERRINPUT if a
+ * journal is attached. */
+int bitset_resize(struct bitset *bset, int bitcount);
+
+/* Give a bitset a dense block directory, with a pointer for every block,
+ * if it has a sparse one.  The sparse directory is kept on ERRMEM. */
+int bitset_set_dense(struct bitset *bset);
+
 
 /* OBJECT INFORMATION */
 
@@ -94,6 +277,12 @@ int bitset_set_count(struct bitset *b);
 /* set a bit to 1 in the bitset */
 int bitset_set(struct bitset *a, int bit);
 
+/* set count bits to 1 in the bitset.  The bits may come in any order, but
+ * sorted bits are much faster since each word is written once and each block
+ * looked up once.  Returns ERRINPUT at the first bit out of range, with the
+ * bits before it already set. */
+int bitset_set_bulk(struct bitset *a, const int *bits, int count);
+
 /* set a bit to 0 in the bitset */
 int bitset_clr(struct bitset *a, int bit);
 
@@ -103,6 +292,137 @@ int bitset_toggle_bit(struct bitset *a, int bit);
 /* Test if a bit in the bitset is on */
 int bitset_test_bit(struct bitset *a, int bit, int *out);
 
+/* replace the bits of page number page (bits page*IDSPERPAGE and up) with
+ * the PAGESIZE words at words.  Bits past the end of the bitset are ignored,
+ * and a page of all 0 bits is freed.  Returns ERRINPUT if a journal is
+ * attached, since whole pages are not logged. */
+int bitset_store_page(struct bitset *bset, int page, const uint64_t *words);
+
+/* set a bit to 1 in the bitset.  Unlike bitset_set, any number of threads
+ * may call this on the same bitset at once, and set_count stays exact.
+ * Blocks and pages are installed with compare-and-swap and words updated
+ * with an atomic OR, so no locks are taken.  Requires thread-safe mode.
+ * No other operation may run on the bitset while the concurrent inserts do,
+ * and it must not share blocks with another bitset (ERRINPUT is returned
+ * for a bit in a shared block or page).  Blocks can only be installed in a
+ * dense directory, so ERRINPUT is returned for a sparse one; call
+ * bitset_set_dense first. */
+int bitset_set_concurrent(struct bitset *a, int bit);
+
+
+/* FAST BIT OPERATIONS
+ *
+ * Inline versions of the bit operations for tight loops.  The caller must
+ * pass a valid bitset and a bit in the range [0, bitcount); neither is
+ * checked.  Writes change the bits in place when the page holding the bit
+ * already exists and is not shared, and otherwise call bitset_set or
+ * bitset_clr, as they do for small sets and bitsets with a journal.
+ *
+ * The reference counts are checked and the page written without atomics, so
+ * the writes must not be used while bitset_set_threadsafe is enabled: they
+ * would race with another thread copying or sharing the same blocks.  Use
+ * bitset_set and bitset_clr in that mode. */
+
+/* get block i of a, where 0 <= i < block_count, or NULL if it is empty.
+ * a sparse directory is searched for the block's key */
+static inline struct bitset_block *bitset_block_lookup(const struct bitset *a, int i)
+{
+	int lo = 0, hi = a->key_count, mid;
+
+	if (a->keys == NULL)
+		return a->blocks[i];
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (a->keys[mid] < i)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < a->key_count && a->keys[lo] == i ? a->blocks[lo] : NULL;
+}
+
+/* return the bit, 0 or 1 */
+static inline int bitset_test_fast(const struct bitset *a, int bit)
+{
+	const struct bitset_block *blk;
+	const struct bitset_page *page;
+	int i;
+
+	if (a->small)
+	{
+		for (i = 0; i < a->small_count; i++)
+		{
+			if (a->small_ids[i] >= bit)
+				return a->small_ids[i] == bit;
+		}
+		return 0;
+	}
+
+	if ((blk = bitset_block_lookup(a, bit >> a->block_shift)) == NULL)
+		return 0;
+	if ((page = blk->pages[(bit & (BITSET_BLOCK_IDS(a) - 1)) >> PAGESHIFT]) == NULL)
+		return 0;
+	return (page->ints[(bit % IDSPERPAGE) / BITSPERINT] >> (bit % BITSPERINT)) & 1;
+}
+
+/* get the page holding bit if it can be written in place, or NULL */
+static inline struct bitset_page *bitset_page_fast(struct bitset *a, int bit, struct bitset_block **blk_out)
+{
+	struct bitset_block *blk;
+	struct bitset_page *page;
+
+	if (a->small || a->journal != NULL)
+		return NULL;
+	if ((blk = bitset_block_lookup(a, bit >> a->block_shift)) == NULL || blk->ref_count != 1)
+		return NULL;
+	if ((page = blk->pages[(bit & (BITSET_BLOCK_IDS(a) - 1)) >> PAGESHIFT]) == NULL || page->ref_count != 1)
+		return NULL;
+
+	*blk_out = blk;
+	return page;
+}
+
+/* set a bit to 1.  returns OK or the error from bitset_set */
+static inline int bitset_set_fast(struct bitset *a, int bit)
+{
+	struct bitset_block *blk;
+	struct bitset_page *page;
+	uint64_t *w, m = 1ull << (bit % BITSPERINT);
+
+	if ((page = bitset_page_fast(a, bit, &blk)) == NULL)
+		return bitset_set(a, bit);
+
+	w = &page->ints[(bit % IDSPERPAGE) / BITSPERINT];
+	if ((*w & m) == 0)
+	{
+		*w |= m;
+		page->set_count++;
+		blk->set_count++;
+	}
+	return OK;
+}
+
+/* set a bit to 0.  returns OK or the error from bitset_clr */
+static inline int bitset_clr_fast(struct bitset *a, int bit)
+{
+	struct bitset_block *blk;
+	struct bitset_page *page;
+	uint64_t *w, m = 1ull << (bit % BITSPERINT);
+
+	if ((page = bitset_page_fast(a, bit, &blk)) == NULL)
+		return bitset_clr(a, bit);
+
+	w = &page->ints[(bit % IDSPERPAGE) / BITSPERINT];
+	if ((*w & m) != 0)
+	{
+		*w &= ~m;
+		page->set_count--;
+		blk->set_count--;
+	}
+	return OK;
+}
 
 /* SET OPERATIONS */
 
@@ -112,6 +432,10 @@ int bitset_invert(struct bitset *a);
 /* Compute the inverse of the bitset and return it as a new bitset */
 int bitset_inverse(struct bitset *a, struct bitset **r);
 
+/* The binary set operations accept bitsets of different sizes.  Bits past
+ * the end of the smaller bitset are treated as 0, and the result always has
+ * the size of A. */
+
 /* Combine bitset A and B into bitset A by making A be the result of A | B (union) */
 int bitset_or(struct bitset *a, struct bitset *b);
 
@@ -131,6 +455,144 @@ int bitset_intersect(struct bitset *a, struct bitset *b, struct bitset **r);
 int bitset_difference(struct bitset *a, struct bitset *b, struct bitset **r);
 
 
+/* SNAPSHOTS */
+
+/* Publish the current contents of the bitset to snapshot readers.  Only
+ * the thread writing the bitset may call this, and it must be called once
+ * before any reader calls bitset_snapshot.  Versions replaced by a publish
+ * are freed by a later publish once no reader can still see them. */
+int bitset_publish(struct bitset *bset);
+
+/* Get a read-only view of the last published version of the bitset in
+ * snap->bset.  This may be called from any thread while the writer keeps
+ * changing the bitset; it takes no locks and never waits for the writer.
+ * Returns ERRMEM if too many snapshots are held at once. */
+int bitset_snapshot(struct bitset *bset, struct bitset_snapshot *snap);
+
+/* Release a snapshot taken with bitset_snapshot */
+void bitset_release(struct bitset_snapshot *snap);
+
+
+/* SERIALIZATION */
+
+/* Write the bitset to a file descriptor in a compact binary format.  The
+ * descriptor may be a file or a pipe; it is written sequentially from its
+ * current position.  Returns ERRIO if a write fails. */
+int bitset_save(struct bitset *bset, int fd);
+
+/* Read a bitset written by bitset_save from a file descriptor into a new
+ * bitset.  Returns ERRFORMAT if the data is not a saved bitset, was saved
+ * with a different block or page size, or fails its checksum, and ERRIO if
+ * a read fails. */
+int bitset_load(int fd, struct bitset **bset_out);
+
+/* Map a file written by bitset_save as a new bitset without copying it.
+ * Pages stored as bitmaps are used in place in the mapping and are copied
+ * the first time they are written; the file should not be changed while it
+ * is mapped.  Its pages may be shared by other bitsets, and the file is
+ * unmapped when the last bitset using them is freed.  The checksum is not
+ * verified. */
+int bitset_mmap(const char *path, struct bitset **bset_out);
+
+/* SHARED MEMORY */
+
+/* Publish the bitset in the POSIX shared memory object name (such as
+ * "/ids"), replacing any bitset published there before.  Processes attached
+ * to the old one keep it until they free it. */
+int bitset_shm_create(const char *name, struct bitset *bset);
+
+/* Attach to the bitset published in the shared memory object name.  The
+ * bits are not copied: every attached process maps the same memory, and
+ * only the block headers are private.  The bitset may be changed, in which
+ * case the pages changed are copied as with bitset_mmap.  The object is
+ * unmapped when the last bitset using its pages is freed.  Returns ERRIO if
+ * nothing is published under name. */
+int bitset_shm_attach(const char *name, struct bitset **bset_out);
+
+/* Remove the shared memory object name.  Attached processes are not
+ * affected. */
+int bitset_shm_remove(const char *name);
+
+
+/* ROARING FORMAT */
+
+/* Write the bitset in the Roaring bitmap portable serialization format to a
+ * new buffer, which the caller must free */
+int bitset_to_roaring(struct bitset *bset, char **buf_out, size_t *size_out);
+
+/* Read a bitset of bitcount bits from a buffer in the Roaring bitmap portable
+ * serialization format.  Returns ERRFORMAT if the buffer is not valid, and
+ * ERRINPUT if it holds a value of bitcount or more. */
+int bitset_from_roaring(const char *buf, size_t size, int bitcount, struct bitset **bset_out);
+
+
+/* DIFFS */
+
+/* Encode the changes that turn bitset FROM into bitset TO, which must have
+ * the same bitcount, into a new buffer which the caller must free.  Only the
+ * words which differ are stored.  Blocks and pages shared between the two
+ * bitsets, as after TO was made with bitset_dup(FROM), are skipped without
+ * being read. */
+int bitset_diff_encode(struct bitset *from, struct bitset *to, char **buf_out, size_t *size_out);
+
+/* Apply a diff made by bitset_diff_encode to a bitset with the same bits
+ * as its FROM bitset, turning it into a copy of TO.  Shared blocks and
+ * pages are copied before being changed.  Returns ERRFORMAT, without
+ * changing the bitset, if the diff is damaged or the bitset does not have
+ * the bits the diff was made from, and ERRINPUT if a journal is attached. */
+int bitset_diff_apply(struct bitset *bset, const char *buf, size_t size);
+
+
+/* JOURNAL */
+
+/* Attach a journal to the bitset, so that every change made to it is
+ * logged to fd: set, clear, toggle, bulk set, invert, and or, and and
+ * subtract with operands that have an id.  Changes are gathered and written
+ * group at a time, with one write and one fdatasync; a change is only
+ * durable once its group is written or bitset_journal_sync is called.  A
+ * new log starts with a header; an existing log must be for a bitset of the
+ * same bitcount and is appended to, after cutting off any frame torn by a
+ * crash.  A change that fails to be logged returns ERRIO, but is still
+ * made.  bitset_set_concurrent may not be used on a journaled bitset. */
+int bitset_journal_open(struct bitset *bset, int fd, int group);
+
+/* Write out the changes gathered so far and flush them to disk */
+int bitset_journal_sync(struct bitset *bset);
+
+/* Empty the log.  Call this after saving the bitset, so that recovery is
+ * loading the saved bitset and replaying the log written since. */
+int bitset_journal_reset(struct bitset *bset);
+
+/* Write out the gathered changes and detach the journal.  bitset_free does
+ * this too.  The descriptor is not closed. */
+int bitset_journal_close(struct bitset *bset);
+
+/* Apply the changes logged to fd to the bitset, which must have the
+ * bitcount of the log.  Sets are sorted and applied with bitset_set_bulk.
+ * The operand with id k is operands[k].  Replay stops at the end of the log
+ * or at a frame torn by a crash.  The position of fd is not changed. */
+int bitset_journal_replay(struct bitset *bset, int fd, struct bitset **operands, int noperands);
+
+
+/* DEDUPLICATION */
+
+/* Allocate an empty intern table, which holds one canonical copy of each
+ * distinct page and block passed to bitset_dedupe with it */
+int bitset_intern_alloc(struct bitset_intern **tbl_out);
+
+/* Free an intern table.  The canonical copies stay in use by the bitsets
+ * sharing them. */
+void bitset_intern_free(struct bitset_intern *tbl);
+
+/* Replace each page and block of the bitset which is equal to a canonical
+ * copy in the table with a shared reference to that copy, and make the
+ * rest canonical.  Run over many bitsets with one table, this makes all of
+ * their equal pages and blocks shared.  Returns the number of pages and
+ * blocks replaced.  The table keeps a reference on every canonical copy,
+ * so they stay in memory until it is freed, and are copied on write. */
+int bitset_dedupe(struct bitset_intern *tbl, struct bitset *bset);
+
+
 /* ITERATION */
 
 void bitset_iter_init(struct bitset_iterator *iter, struct bitset *bset, int flags);
@@ -139,5 +601,8 @@ int bitset_iter_at_end(struct bitset_iterator *iter);
 int bitset_iter_get(struct bitset_iterator *iter);
 int bitset_iter_index(struct bitset_iterator *iter);
 
+#ifdef __cplusplus
+}
 #endif
 
+#endif
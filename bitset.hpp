@@ -0,0 +1,720 @@
+#ifndef _bitset_hpp_
+#define _bitset_hpp_
+
+/* a C++ interface to the sparse bitset.
+ *
+ * sparse::bitset owns a struct bitset and frees it when it goes out of
+ * scope.  it can be moved but not copied; copy() makes a copy which shares
+ * all of its blocks until one of them is written.
+ *
+ * the set operators build an expression instead of a bitset, so
+ *
+ *     sparse::bitset r = (a & b) | (c - d);
+ *
+ * is evaluated a page at a time in a single pass over the occupied blocks
+ * of the operands, with no intermediate bitsets.  the result has the size and
+ * block size of the leftmost operand, as with bitset_or and friends.
+ */
+
+#include <stdint.h>
+#include <assert.h>
+#include <cstddef>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "bitset.h"
+
+namespace sparse {
+
+/* an error returned by the C library */
+class error : public std::runtime_error
+{
+public:
+	explicit error(int code) : std::runtime_error(message(code)), code_(code) {}
+
+	int code() const { return code_; }
+
+private:
+	static const char *message(int code)
+	{
+		switch (code)
+		{
+		case ERRINPUT:		return "sparse::bitset: invalid input";
+		case ERRNOTIMPL:	return "sparse::bitset: not implemented";
+		case ERRIO:			return "sparse::bitset: i/o error";
+		case ERRFORMAT:		return "sparse::bitset: bad format";
+		default:			return "sparse::bitset: error";
+		}
+	}
+
+	int code_;
+};
+
+namespace detail {
+
+/* turn a C return code into an exception */
+inline int check(int ret)
+{
+	if (ret == ERRMEM)
+		throw std::bad_alloc();
+	if (ret < 0)
+		throw error(ret);
+	return ret;
+}
+
+/* the word kernels shared by the expression operators and fixed_bitset.
+ * the word count is a constant, so the loops can be unrolled and vectorized */
+template <int Words>
+inline void and_words(uint64_t *out, const uint64_t *l, const uint64_t *r)
+{
+	for (int i = 0; i < Words; i++)
+		out[i] = l[i] & r[i];
+}
+
+template <int Words>
+inline void or_words(uint64_t *out, const uint64_t *l, const uint64_t *r)
+{
+	for (int i = 0; i < Words; i++)
+		out[i] = l[i] | r[i];
+}
+
+template <int Words>
+inline void sub_words(uint64_t *out, const uint64_t *l, const uint64_t *r)
+{
+	for (int i = 0; i < Words; i++)
+		out[i] = l[i] & ~r[i];
+}
+
+template <int Words>
+inline int count_words(const uint64_t *w)
+{
+	int n = 0;
+
+	for (int i = 0; i < Words; i++)
+		n += __builtin_popcountll(w[i]);
+	return n;
+}
+
+/* an operand which is a bitset.  pages come straight from its blocks, or
+ * for a small set are built from its inline ids */
+class leaf
+{
+public:
+	explicit leaf(const struct ::bitset *b) : b_(b) {}
+
+	int size() const { return b_->bitcount; }
+	int blocksize() const { return BITSET_BLOCK_IDS(b_) / BITSPERINT; }
+
+	/* the blocks [64*w, 64*w + 64) which may hold bits, for blocks of
+	 * 1 << shift bits */
+	uint64_t blocks(int w, int shift) const
+	{
+		uint64_t m = 0;
+		long long t, lo, hi;
+		int i, blk;
+
+		if (b_->small)
+		{
+			for (i = 0; i < b_->small_count; i++)
+			{
+				blk = b_->small_ids[i] >> shift;
+				if (blk / 64 == w)
+					m |= 1ull << (blk % 64);
+			}
+			return m;
+		}
+
+		if (shift == b_->block_shift)
+			return w < (b_->block_count + 63) / 64 ? b_->occupied[w] : 0;
+
+		/* a block in the other size may be part of one of ours or span
+		 * several of them */
+		for (i = 0; i < 64; i++)
+		{
+			t = (long long)w * 64 + i;
+			lo = (t << shift) >> b_->block_shift;
+			hi = (((t + 1) << shift) - 1) >> b_->block_shift;
+			for (; lo <= hi && lo < b_->block_count; lo++)
+			{
+				if ((b_->occupied[lo / 64] >> (lo % 64)) & 1)
+				{
+					m |= 1ull << i;
+					break;
+				}
+			}
+		}
+		return m;
+	}
+
+	/* the words of page pg, or NULL if they are all 0 */
+	const uint64_t *page(int pg) const
+	{
+		const struct bitset_block *blk;
+		const struct bitset_page *p;
+		int i, bit, any = 0;
+
+		if (b_->small)
+		{
+			for (i = 0; i < PAGESIZE; i++)
+				buf_[i] = 0;
+			for (i = 0; i < b_->small_count; i++)
+			{
+				bit = b_->small_ids[i] - pg * IDSPERPAGE;
+				if (bit >= 0 && bit < IDSPERPAGE)
+				{
+					buf_[bit / BITSPERINT] |= 1ull << (bit % BITSPERINT);
+					any = 1;
+				}
+			}
+			return any ? buf_ : NULL;
+		}
+
+		if ((pg >> (b_->block_shift - PAGESHIFT)) >= b_->block_count)
+			return NULL;
+		if ((blk = bitset_block_lookup(b_, pg >> (b_->block_shift - PAGESHIFT))) == NULL)
+			return NULL;
+		if ((p = blk->pages[pg & (BITSET_BLOCK_PAGES(b_) - 1)]) == NULL)
+			return NULL;
+		return p->ints;
+	}
+
+private:
+	const struct ::bitset *b_;
+	mutable uint64_t buf_[PAGESIZE];
+};
+
+struct and_op
+{
+	static const bool empty_left = true;
+
+	static uint64_t blocks(uint64_t l, uint64_t r) { return l & r; }
+
+	static const uint64_t *page(const uint64_t *l, const uint64_t *r, uint64_t *out)
+	{
+		if (l == NULL || r == NULL)
+			return NULL;
+		and_words<PAGESIZE>(out, l, r);
+		return out;
+	}
+};
+
+struct or_op
+{
+	static const bool empty_left = false;
+
+	static uint64_t blocks(uint64_t l, uint64_t r) { return l | r; }
+
+	static const uint64_t *page(const uint64_t *l, const uint64_t *r, uint64_t *out)
+	{
+		if (l == NULL)
+			return r;
+		if (r == NULL)
+			return l;
+		or_words<PAGESIZE>(out, l, r);
+		return out;
+	}
+};
+
+struct sub_op
+{
+	static const bool empty_left = true;
+
+	static uint64_t blocks(uint64_t l, uint64_t) { return l; }
+
+	static const uint64_t *page(const uint64_t *l, const uint64_t *r, uint64_t *out)
+	{
+		if (l == NULL || r == NULL)
+			return l;
+		sub_words<PAGESIZE>(out, l, r);
+		return out;
+	}
+};
+
+} /* namespace detail */
+
+/* a set operation on two operands, evaluated a page at a time */
+template <class Op, class L, class R>
+class expr
+{
+public:
+	expr(const L &l, const R &r) : l_(l), r_(r) {}
+
+	int size() const { return l_.size(); }
+	int blocksize() const { return l_.blocksize(); }
+
+	uint64_t blocks(int w, int shift) const { return Op::blocks(l_.blocks(w, shift), r_.blocks(w, shift)); }
+
+	/* the right operand is not read where an empty left one decides the
+	 * result */
+	const uint64_t *page(int pg) const
+	{
+		const uint64_t *l = l_.page(pg);
+
+		if (l == NULL && Op::empty_left)
+			return NULL;
+		return Op::page(l, r_.page(pg), buf_);
+	}
+
+private:
+	L l_;
+	R r_;
+	mutable uint64_t buf_[PAGESIZE];
+};
+
+class bitset;
+template <int N, int BlockWords> class fixed_bitset;
+
+namespace detail {
+template <int N, int B> class fixed_leaf;
+}
+
+/* the expression node for each kind of operand */
+template <class T> struct operand {};
+template <> struct operand<bitset> { typedef detail::leaf type; };
+template <class Op, class L, class R> struct operand<expr<Op, L, R> > { typedef expr<Op, L, R> type; };
+
+template <class T, class U = void> struct is_operand : std::false_type {};
+template <class T> struct is_operand<T, typename std::enable_if<sizeof(typename operand<T>::type) != 0>::type> : std::true_type {};
+
+/* an owned bitset */
+class bitset
+{
+public:
+	/* iterates the indexes of the bits which are set */
+	class const_iterator
+	{
+	public:
+		typedef std::forward_iterator_tag iterator_category;
+		typedef int value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const int *pointer;
+		typedef int reference;
+
+		const_iterator() : end_(true) {}
+
+		explicit const_iterator(struct ::bitset *b) : end_(false)
+		{
+			bitset_iter_init(&iter_, b, BITSET_ITER_ON);
+			end_ = bitset_iter_at_end(&iter_) != 0;
+		}
+
+		int operator*() const { return bitset_iter_index(const_cast<struct bitset_iterator *>(&iter_)); }
+
+		const_iterator &operator++()
+		{
+			bitset_iter_next(&iter_);
+			end_ = bitset_iter_at_end(&iter_) != 0;
+			return *this;
+		}
+
+		const_iterator operator++(int)
+		{
+			const_iterator r = *this;
+			++*this;
+			return r;
+		}
+
+		bool operator==(const const_iterator &o) const
+		{
+			if (end_ || o.end_)
+				return end_ == o.end_;
+			return **this == *o;
+		}
+
+		bool operator!=(const const_iterator &o) const { return !(*this == o); }
+
+	private:
+		struct bitset_iterator iter_;
+		bool end_;
+	};
+
+	typedef const_iterator iterator;
+
+	/* an empty handle, as left behind by a move */
+	bitset() noexcept : b_(NULL) {}
+
+	/* a bitset of bitcount bits, all 0 */
+	explicit bitset(int bitcount) : b_(NULL)
+	{
+		detail::check(bitset_alloc(bitcount, &b_));
+	}
+
+	/* a bitset of bitcount bits with blocks of blocksize words (see
+	 * bitset_alloc_blocksize) */
+	bitset(int bitcount, int blocksize) : b_(NULL)
+	{
+		detail::check(bitset_alloc_blocksize(bitcount, blocksize, &b_));
+	}
+
+	/* take ownership of a C bitset */
+	explicit bitset(struct ::bitset *b) noexcept : b_(b) {}
+
+	/* a small bitset of bitcount bits (see bitset_alloc_small) */
+	static bitset small(int bitcount)
+	{
+		struct ::bitset *b = NULL;
+
+		detail::check(bitset_alloc_small(bitcount, &b));
+		return bitset(b);
+	}
+
+	bitset(const bitset &) = delete;
+	bitset &operator=(const bitset &) = delete;
+
+	bitset(bitset &&o) noexcept : b_(o.b_) { o.b_ = NULL; }
+
+	bitset &operator=(bitset &&o) noexcept
+	{
+		std::swap(b_, o.b_);
+		return *this;
+	}
+
+	~bitset() { bitset_free(b_); }
+
+	/* evaluate an expression into a new bitset */
+	template <class Op, class L, class R>
+	bitset(const expr<Op, L, R> &e) : b_(NULL)
+	{
+		bitset r(e.size(), e.blocksize());
+		uint64_t m;
+		int w, i, p, words, pages;
+		const uint64_t *words_of;
+
+		words = (r.b_->block_count + 63) / 64;
+		pages = BITSET_BLOCK_PAGES(r.b_);
+		for (w = 0; w < words; w++)
+		{
+			m = e.blocks(w, r.b_->block_shift);
+			if (w == words - 1 && r.b_->block_count % 64 != 0)
+				m &= ~(~0ull << (r.b_->block_count % 64));
+
+			for (; m != 0; m &= m - 1)
+			{
+				i = w * 64 + __builtin_ctzll(m);
+				for (p = i * pages; p < (i + 1) * pages; p++)
+				{
+					if ((words_of = e.page(p)) != NULL)
+						detail::check(bitset_store_page(r.b_, p, words_of));
+				}
+			}
+		}
+
+		std::swap(b_, r.b_);
+	}
+
+	template <class Op, class L, class R>
+	bitset &operator=(const expr<Op, L, R> &e)
+	{
+		bitset r(e);
+
+		/* the journal, id and versions belong to the C bitset, so one which
+		 * has them is changed in place.  the library refuses the changes a
+		 * journal cannot record */
+		if (has_state())
+		{
+			if (r.size() != size())
+				resize(r.size());
+			detail::check(bitset_and(b_, r.b_));
+			detail::check(bitset_or(b_, r.b_));
+			return *this;
+		}
+
+		/* the counters stay with this bitset */
+		if (b_ != NULL)
+			std::swap(b_->stats, r.b_->stats);
+		std::swap(b_, r.b_);
+		return *this;
+	}
+
+	/* a copy which shares blocks with this one until either is written */
+	bitset copy() const
+	{
+		struct ::bitset *b = NULL;
+
+		detail::check(bitset_dup(b_, &b));
+		return bitset(b);
+	}
+
+	struct ::bitset *get() const noexcept { return b_; }
+
+	/* give up ownership of the C bitset */
+	struct ::bitset *release() noexcept
+	{
+		struct ::bitset *b = b_;
+
+		b_ = NULL;
+		return b;
+	}
+
+	explicit operator bool() const noexcept { return b_ != NULL; }
+
+	int size() const { return bitset_bitcount(b_); }
+	int count() const { return detail::check(bitset_set_count(b_)); }
+
+	bool test(int bit) const
+	{
+		int x;
+
+		detail::check(bitset_test_bit(b_, bit, &x));
+		return x != 0;
+	}
+
+	bitset &set(int bit) { detail::check(bitset_set(b_, bit)); return *this; }
+	bitset &clr(int bit) { detail::check(bitset_clr(b_, bit)); return *this; }
+	bitset &toggle(int bit) { detail::check(bitset_toggle_bit(b_, bit)); return *this; }
+	bitset &invert() { detail::check(bitset_invert(b_)); return *this; }
+	bitset &resize(int bitcount) { detail::check(bitset_resize(b_, bitcount)); return *this; }
+
+	bitset &operator|=(const bitset &o) { detail::check(bitset_or(b_, o.b_)); return *this; }
+	bitset &operator&=(const bitset &o) { detail::check(bitset_and(b_, o.b_)); return *this; }
+	bitset &operator-=(const bitset &o) { detail::check(bitset_subtract(b_, o.b_)); return *this; }
+
+	template <class Op, class L, class R>
+	bitset &operator|=(const expr<Op, L, R> &e)
+	{
+		if (has_state())
+			return *this |= bitset(e);
+		return *this = expr<detail::or_op, detail::leaf, expr<Op, L, R> >(detail::leaf(b_), e);
+	}
+	template <class Op, class L, class R>
+	bitset &operator&=(const expr<Op, L, R> &e)
+	{
+		if (has_state())
+			return *this &= bitset(e);
+		return *this = expr<detail::and_op, detail::leaf, expr<Op, L, R> >(detail::leaf(b_), e);
+	}
+	template <class Op, class L, class R>
+	bitset &operator-=(const expr<Op, L, R> &e)
+	{
+		if (has_state())
+			return *this -= bitset(e);
+		return *this = expr<detail::sub_op, detail::leaf, expr<Op, L, R> >(detail::leaf(b_), e);
+	}
+
+	const_iterator begin() const { return const_iterator(b_); }
+	const_iterator end() const { return const_iterator(); }
+
+	/* the expression node for this bitset as an operand */
+	detail::leaf node() const { return detail::leaf(b_); }
+
+private:
+	/* true if the C bitset has state which replacing it would lose */
+	bool has_state() const
+	{
+		return b_ != NULL && (b_->journal != NULL || b_->id != 0 ||
+			b_->mvcc != NULL);
+	}
+
+	struct ::bitset *b_;
+};
+
+/* a bitset of a size fixed at compile time, held in BlockWords-word blocks
+ * inside the object itself.  there is no directory to chase and the loops
+ * have constant bounds.  bits are only range checked by assert.
+ *
+ * a fixed_bitset can be used as an operand of the set operators together
+ * with sparse::bitset, and is read in place when it is.  it can also be
+ * built from a sparse::bitset or an expression. */
+template <int N, int BlockWords = 8>
+class fixed_bitset
+{
+public:
+	static constexpr int block_words = BlockWords;
+	static constexpr int blocks = (N + BITSPERINT * BlockWords - 1) / (BITSPERINT * BlockWords);
+	static constexpr int words = blocks * BlockWords;
+
+	fixed_bitset() : w_() {}
+
+	/* copy the bits of a bitset or an expression, up to N */
+	explicit fixed_bitset(const bitset &b) : w_() { assign(b.node()); }
+
+	template <class Op, class L, class R>
+	explicit fixed_bitset(const expr<Op, L, R> &e) : w_() { assign(e); }
+
+	static constexpr int size() { return N; }
+
+	int count() const { return detail::count_words<words>(w_); }
+
+	bool test(int bit) const
+	{
+		assert(bit >= 0 && bit < N);
+		return (w_[bit / BITSPERINT] >> (bit % BITSPERINT)) & 1;
+	}
+
+	fixed_bitset &set(int bit)
+	{
+		assert(bit >= 0 && bit < N);
+		w_[bit / BITSPERINT] |= 1ull << (bit % BITSPERINT);
+		return *this;
+	}
+
+	fixed_bitset &clr(int bit)
+	{
+		assert(bit >= 0 && bit < N);
+		w_[bit / BITSPERINT] &= ~(1ull << (bit % BITSPERINT));
+		return *this;
+	}
+
+	fixed_bitset &toggle(int bit)
+	{
+		assert(bit >= 0 && bit < N);
+		w_[bit / BITSPERINT] ^= 1ull << (bit % BITSPERINT);
+		return *this;
+	}
+
+	fixed_bitset &invert()
+	{
+		for (int i = 0; i < words; i++)
+			w_[i] = ~w_[i];
+		trim();
+		return *this;
+	}
+
+	fixed_bitset &operator&=(const fixed_bitset &o) { detail::and_words<words>(w_, w_, o.w_); return *this; }
+	fixed_bitset &operator|=(const fixed_bitset &o) { detail::or_words<words>(w_, w_, o.w_); return *this; }
+	fixed_bitset &operator-=(const fixed_bitset &o) { detail::sub_words<words>(w_, w_, o.w_); return *this; }
+
+	friend fixed_bitset operator&(const fixed_bitset &a, const fixed_bitset &b) { fixed_bitset r; detail::and_words<words>(r.w_, a.w_, b.w_); return r; }
+	friend fixed_bitset operator|(const fixed_bitset &a, const fixed_bitset &b) { fixed_bitset r; detail::or_words<words>(r.w_, a.w_, b.w_); return r; }
+	friend fixed_bitset operator-(const fixed_bitset &a, const fixed_bitset &b) { fixed_bitset r; detail::sub_words<words>(r.w_, a.w_, b.w_); return r; }
+
+	bool operator==(const fixed_bitset &o) const
+	{
+		for (int i = 0; i < words; i++)
+		{
+			if (w_[i] != o.w_[i])
+				return false;
+		}
+		return true;
+	}
+
+	bool operator!=(const fixed_bitset &o) const { return !(*this == o); }
+
+	/* the words of block i */
+	const uint64_t *block(int i) const { return w_ + i * BlockWords; }
+	const uint64_t *data() const { return w_; }
+
+	/* the operand protocol, in terms of the library's blocks and pages */
+	int operand_size() const { return N; }
+	int operand_blocksize() const { return BLOCKSIZE; }
+
+	uint64_t operand_blocks(int w, int shift) const
+	{
+		int n = (int)(((long long)N + (1 << shift) - 1) >> shift) - w * 64;
+
+		if (n <= 0)
+			return 0;
+		return n >= 64 ? ~0ull : ~(~0ull << n);
+	}
+
+	/* pages which lie wholly inside the words are returned in place */
+	const uint64_t *operand_page(int pg, uint64_t *buf) const
+	{
+		int start = pg * PAGESIZE, i;
+
+		if (start >= words)
+			return NULL;
+		if (start + PAGESIZE <= words)
+			return w_ + start;
+
+		for (i = 0; i < PAGESIZE; i++)
+			buf[i] = start + i < words ? w_[start + i] : 0;
+		return buf;
+	}
+
+private:
+	template <class E>
+	void assign(const E &e)
+	{
+		const uint64_t *p;
+		int pg, i;
+
+		for (pg = 0; pg * PAGESIZE < words; pg++)
+		{
+			if ((p = e.page(pg)) == NULL)
+				continue;
+			for (i = 0; i < PAGESIZE && pg * PAGESIZE + i < words; i++)
+				w_[pg * PAGESIZE + i] = p[i];
+		}
+		trim();
+	}
+
+	/* clear the bits past N in the last word */
+	void trim()
+	{
+		if (N % BITSPERINT != 0)
+			w_[N / BITSPERINT] &= ~(~0ull << (N % BITSPERINT));
+		for (int i = (N + BITSPERINT - 1) / BITSPERINT; i < words; i++)
+			w_[i] = 0;
+	}
+
+	uint64_t w_[words];
+};
+
+template <int N, int B> struct operand<fixed_bitset<N, B> > { typedef detail::fixed_leaf<N, B> type; };
+
+namespace detail {
+
+/* an operand which is a fixed_bitset */
+template <int N, int B>
+class fixed_leaf
+{
+public:
+	explicit fixed_leaf(const fixed_bitset<N, B> &f) : f_(&f) {}
+
+	int size() const { return f_->operand_size(); }
+	int blocksize() const { return f_->operand_blocksize(); }
+	uint64_t blocks(int w, int shift) const { return f_->operand_blocks(w, shift); }
+	const uint64_t *page(int pg) const { return f_->operand_page(pg, buf_); }
+
+private:
+	const fixed_bitset<N, B> *f_;
+	mutable uint64_t buf_[PAGESIZE];
+};
+
+template <int N, int B>
+inline fixed_leaf<N, B> node(const fixed_bitset<N, B> &f) { return fixed_leaf<N, B>(f); }
+
+inline leaf node(const bitset &b) { return b.node(); }
+
+template <class Op, class L, class R>
+inline const expr<Op, L, R> &node(const expr<Op, L, R> &e) { return e; }
+
+template <class Op, class L, class R>
+struct result
+{
+	typedef expr<Op, typename operand<L>::type, typename operand<R>::type> type;
+};
+
+} /* namespace detail */
+
+template <class L, class R>
+inline typename std::enable_if<is_operand<L>::value && is_operand<R>::value,
+	typename detail::result<detail::and_op, L, R>::type>::type
+operator&(const L &l, const R &r)
+{
+	return typename detail::result<detail::and_op, L, R>::type(detail::node(l), detail::node(r));
+}
+
+template <class L, class R>
+inline typename std::enable_if<is_operand<L>::value && is_operand<R>::value,
+	typename detail::result<detail::or_op, L, R>::type>::type
+operator|(const L &l, const R &r)
+{
+	return typename detail::result<detail::or_op, L, R>::type(detail::node(l), detail::node(r));
+}
+
+template <class L, class R>
+inline typename std::enable_if<is_operand<L>::value && is_operand<R>::value,
+	typename detail::result<detail::sub_op, L, R>::type>::type
+operator-(const L &l, const R &r)
+{
+	return typename detail::result<detail::sub_op, L, R>::type(detail::node(l), detail::node(r));
+}
+
+} /* namespace sparse */
+
+#endif
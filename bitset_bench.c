@@ -0,0 +1,667 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitset.h"
+
+/* bitset_bench times the bitset operations on bitsets of several sizes,
+ * densities and distributions of bits.
+ *
+ * the results are printed one to a line as tab separated fields, after a
+ * header line starting with '#':
+ *
+ *   op  size  density  dist  iters  ns_op  gb_s  allocs_op  bytes_op
+ *
+ * ns_op is the time of one operation: one call for the single bit
+ * operations, one page for cow, one step for the iterators and one call
+ * over the whole set for the rest.  gb_s is the bitmap bytes of the
+ * operands (size/8 each) covered per second, and 0 where that means
+ * nothing.  allocs_op and bytes_op come from bitset_get_alloc_stats. */
+
+#define MAXLIST		16
+
+/* the single bit operations make this many calls per round */
+#define BITOPS		(1 << 20)
+
+/* the most rounds of one benchmark */
+#define MAXITERS	100000
+
+/* the mean length of the runs of the less common bit in a clustered set */
+#define CLUSTER		1024
+
+#define DIST_UNIFORM	0
+#define DIST_CLUSTERED	1
+
+static const char *dist_names[] = { "uniform", "clustered" };
+
+/* the state of a benchmark.  a and b are the operands, and w is a copy of
+ * a which is not shared with it, for the single bit writes */
+struct bench {
+	struct bitset *a;
+	struct bitset *b;
+	struct bitset *w;
+	int size;
+
+	/* bit positions for the single bit operations */
+	int *seq;
+	int *rnd;
+
+	/* totals over the timed parts of the rounds so far */
+	double elapsed;
+	long ops;
+	unsigned allocs;
+	unsigned bytes;
+
+	/* the clock and allocation counters when the timed part started */
+	double t0;
+	int allocs0;
+	int bytes0;
+};
+
+/* adds up test results, so the tests are not optimized away */
+static volatile long sink;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(int ret, const char *what)
+{
+	if (ret < 0)
+	{
+		fprintf(stderr, "Error %d in %s\n", ret, what);
+		exit(1);
+	}
+}
+
+/* xorshift64* */
+static uint64_t rng_state = 88172645463325252ull;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ull;
+}
+
+/* a uniform double in (0, 1] */
+static double rng_unit(void)
+{
+	return ((rng() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+/* the number of failures before a success with probability p */
+static long rng_geometric(double p)
+{
+	if (p >= 1)
+		return 0;
+	return (long)(log(rng_unit()) / log1p(-p));
+}
+
+/* a length with an exponential distribution of mean m, at least 1 */
+static long rng_run(double m)
+{
+	return (long)(-log(rng_unit()) * m) + 1;
+}
+
+
+/******************************************************************************
+ * BITSET GENERATION
+ */
+
+/* fills a bitset a page at a time, through bitset_store_page */
+struct filler {
+	struct bitset *bset;
+	int page;
+	int any;
+	uint64_t words[PAGESIZE];
+};
+
+static void filler_flush(struct filler *f)
+{
+	if (f->any)
+		check(bitset_store_page(f->bset, f->page, f->words), "bitset_store_page");
+	memset(f->words, 0, sizeof(f->words));
+	f->any = 0;
+}
+
+/* set the bits [start, end).  runs must be given in increasing order */
+static void filler_run(struct filler *f, long start, long end)
+{
+	long pg, b, e;
+
+	if (end > f->bset->bitcount)
+		end = f->bset->bitcount;
+
+	while (start < end)
+	{
+		pg = start / IDSPERPAGE;
+		if (pg != f->page)
+		{
+			filler_flush(f);
+			f->page = pg;
+		}
+
+		/* the part of the run in this page */
+		b = start % IDSPERPAGE;
+		e = end - pg * IDSPERPAGE < IDSPERPAGE ? end - pg * IDSPERPAGE : IDSPERPAGE;
+		for (; b < e && b % BITSPERINT != 0; b++)
+			f->words[b / BITSPERINT] |= 1ull << (b % BITSPERINT);
+		for (; b + BITSPERINT <= e; b += BITSPERINT)
+			f->words[b / BITSPERINT] = ~0ull;
+		for (; b < e; b++)
+			f->words[b / BITSPERINT] |= 1ull << (b % BITSPERINT);
+
+		f->any = 1;
+		start = pg * IDSPERPAGE + e;
+	}
+}
+
+/* make a bitset of size bits where each bit is set with probability
+ * density.  a uniform set has its bits independent of each other, and a
+ * clustered one has them in runs */
+static struct bitset *make_set(int size, double density, int dist, uint64_t seed)
+{
+	struct filler f;
+	long pos, len, on, off;
+	int pg, i;
+
+	memset(&f, 0, sizeof(f));
+	check(bitset_alloc(size, &f.bset), "bitset_alloc");
+	rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+	if (dist == DIST_UNIFORM && density == 0.5)
+	{
+		/* a random word has each bit set with probability 1/2 */
+		for (pg = 0; (long)pg * IDSPERPAGE < size; pg++)
+		{
+			for (i = 0; i < PAGESIZE; i++)
+				f.words[i] = rng();
+			check(bitset_store_page(f.bset, pg, f.words), "bitset_store_page");
+		}
+		return f.bset;
+	}
+
+	/* skip over runs of the less common bit, which keeps the work in
+	 * proportion to the number of runs */
+	for (pos = 0; pos < size; )
+	{
+		if (dist == DIST_UNIFORM && density <= 0.5)
+		{
+			pos += rng_geometric(density);
+			filler_run(&f, pos, pos + 1);
+			pos++;
+		}
+		else if (dist == DIST_UNIFORM)
+		{
+			len = rng_geometric(1 - density);
+			filler_run(&f, pos, pos + len);
+			pos += len + 1;
+		}
+		else
+		{
+			on = density <= 0.5 ? CLUSTER : (long)(CLUSTER * density / (1 - density));
+			off = density <= 0.5 ? (long)(CLUSTER * (1 - density) / density) : CLUSTER;
+
+			pos += rng_run(off);
+			len = rng_run(on);
+			filler_run(&f, pos, pos + len);
+			pos += len;
+		}
+	}
+	filler_flush(&f);
+
+	return f.bset;
+}
+
+
+/******************************************************************************
+ * BENCHMARKS
+ */
+
+static void start(struct bench *b)
+{
+	bitset_get_alloc_stats(&b->allocs0, &b->bytes0);
+	b->t0 = now();
+}
+
+static void stop(struct bench *b, long ops)
+{
+	int allocs, bytes;
+
+	b->elapsed += now() - b->t0;
+	b->ops += ops;
+
+	/* the byte counter is an int and may wrap around on large sets */
+	bitset_get_alloc_stats(&allocs, &bytes);
+	b->allocs += (unsigned)allocs - (unsigned)b->allocs0;
+	b->bytes += (unsigned)bytes - (unsigned)b->bytes0;
+}
+
+static void bench_set_seq(struct bench *b)
+{
+	int i;
+
+	start(b);
+	for (i = 0; i < BITOPS; i++)
+		check(bitset_set(b->w, b->seq[i]), "bitset_set");
+	stop(b, BITOPS);
+}
+
+static void bench_set_rand(struct bench *b)
+{
+	int i;
+
+	start(b);
+	for (i = 0; i < BITOPS; i++)
+		check(bitset_set(b->w, b->rnd[i]), "bitset_set");
+	stop(b, BITOPS);
+}
+
+static void bench_clr_seq(struct bench *b)
+{
+	int i;
+
+	start(b);
+	for (i = 0; i < BITOPS; i++)
+		check(bitset_clr(b->w, b->seq[i]), "bitset_clr");
+	stop(b, BITOPS);
+}
+
+static void bench_clr_rand(struct bench *b)
+{
+	int i;
+
+	start(b);
+	for (i = 0; i < BITOPS; i++)
+		check(bitset_clr(b->w, b->rnd[i]), "bitset_clr");
+	stop(b, BITOPS);
+}
+
+static void bench_test_seq(struct bench *b)
+{
+	long n = 0;
+	int i, x;
+
+	start(b);
+	for (i = 0; i < BITOPS; i++)
+	{
+		check(bitset_test_bit(b->a, b->seq[i], &x), "bitset_test_bit");
+		n += x;
+	}
+	stop(b, BITOPS);
+	sink += n;
+}
+
+static void bench_test_rand(struct bench *b)
+{
+	long n = 0;
+	int i, x;
+
+	start(b);
+	for (i = 0; i < BITOPS; i++)
+	{
+		check(bitset_test_bit(b->a, b->rnd[i], &x), "bitset_test_bit");
+		n += x;
+	}
+	stop(b, BITOPS);
+	sink += n;
+}
+
+/* the in place operations change a copy of a, made outside the timing */
+static void bench_inplace(struct bench *b, int (*op)(struct bitset *, struct bitset *), const char *what)
+{
+	struct bitset *r = NULL;
+
+	check(bitset_dup(b->a, &r), "bitset_dup");
+	start(b);
+	check(op(r, b->b), what);
+	stop(b, 1);
+	bitset_free(r);
+}
+
+static void bench_or(struct bench *b) { bench_inplace(b, bitset_or, "bitset_or"); }
+static void bench_and(struct bench *b) { bench_inplace(b, bitset_and, "bitset_and"); }
+static void bench_subtract(struct bench *b) { bench_inplace(b, bitset_subtract, "bitset_subtract"); }
+
+static void bench_alloc_op(struct bench *b, int (*op)(struct bitset *, struct bitset *, struct bitset **), const char *what)
+{
+	struct bitset *r = NULL;
+
+	start(b);
+	check(op(b->a, b->b, &r), what);
+	stop(b, 1);
+	bitset_free(r);
+}
+
+static void bench_union(struct bench *b) { bench_alloc_op(b, bitset_union, "bitset_union"); }
+static void bench_intersect(struct bench *b) { bench_alloc_op(b, bitset_intersect, "bitset_intersect"); }
+static void bench_difference(struct bench *b) { bench_alloc_op(b, bitset_difference, "bitset_difference"); }
+
+static void bench_set_count(struct bench *b)
+{
+	int n;
+
+	start(b);
+	n = bitset_set_count(b->a);
+	stop(b, 1);
+	check(n, "bitset_set_count");
+	sink += n;
+}
+
+static void bench_dup(struct bench *b)
+{
+	struct bitset *r = NULL;
+
+	start(b);
+	check(bitset_dup(b->a, &r), "bitset_dup");
+	stop(b, 1);
+	bitset_free(r);
+}
+
+/* write one bit in every page of a copy of a, so each page is copied */
+static void bench_cow(struct bench *b)
+{
+	struct bitset *r = NULL;
+	struct bitset_block *blk;
+	long n = 0;
+	int i, p;
+
+	check(bitset_dup(b->a, &r), "bitset_dup");
+	start(b);
+	for (i = 0; i < r->block_count; i++)
+	{
+		if ((blk = bitset_block_lookup(r, i)) == NULL)
+			continue;
+		for (p = 0; p < blk->page_count; p++)
+		{
+			if (blk->pages[p] == NULL)
+				continue;
+			check(bitset_toggle_bit(r, i * BITSET_BLOCK_IDS(r) + p * IDSPERPAGE), "bitset_toggle_bit");
+			n++;
+
+			/* the toggle may have replaced the block */
+			blk = bitset_block_lookup(r, i);
+			if (blk == NULL)
+				break;
+		}
+	}
+	stop(b, n);
+	bitset_free(r);
+}
+
+static void bench_iter(struct bench *b, int flags)
+{
+	struct bitset_iterator iter;
+	long n = 0, x = 0;
+
+	start(b);
+	for (bitset_iter_init(&iter, b->a, flags); !bitset_iter_at_end(&iter); bitset_iter_next(&iter))
+	{
+		x += bitset_iter_index(&iter);
+		n++;
+	}
+	stop(b, n);
+	sink += x;
+}
+
+static void bench_iter_on(struct bench *b) { bench_iter(b, BITSET_ITER_ON); }
+static void bench_iter_all(struct bench *b) { bench_iter(b, BITSET_ITER_ALL); }
+
+/* the benchmarks, and the number of operands each one covers for gb_s */
+static const struct {
+	const char *name;
+	void (*fn)(struct bench *);
+	int operands;
+} benches[] = {
+	{ "set_seq",	bench_set_seq,		0 },
+	{ "set_rand",	bench_set_rand,		0 },
+	{ "clr_seq",	bench_clr_seq,		0 },
+	{ "clr_rand",	bench_clr_rand,		0 },
+	{ "test_seq",	bench_test_seq,		0 },
+	{ "test_rand",	bench_test_rand,	0 },
+	{ "or",			bench_or,			2 },
+	{ "and",		bench_and,			2 },
+	{ "subtract",	bench_subtract,		2 },
+	{ "union",		bench_union,		2 },
+	{ "intersect",	bench_intersect,	2 },
+	{ "difference",	bench_difference,	2 },
+	{ "set_count",	bench_set_count,	1 },
+	{ "dup",		bench_dup,			0 },
+	{ "cow",		bench_cow,			0 },
+	{ "iter_on",	bench_iter_on,		1 },
+	{ "iter_all",	bench_iter_all,		1 },
+};
+
+#define NBENCHES	((int)(sizeof(benches) / sizeof(benches[0])))
+
+/* run a benchmark for at least min_time seconds and print its result */
+static void run(struct bench *b, int n, double density, int dist, double min_time)
+{
+	double gb;
+	long iters = 0;
+
+	b->elapsed = 0;
+	b->ops = 0;
+	b->allocs = 0;
+	b->bytes = 0;
+
+	do
+	{
+		benches[n].fn(b);
+		iters++;
+	} while (b->elapsed < min_time && iters < MAXITERS);
+
+	gb = b->elapsed > 0 ? benches[n].operands * (b->size / 8.0) * iters / b->elapsed / 1e9 : 0;
+
+	printf("%s\t%d\t%g\t%s\t%ld\t%.2f\t%.3f\t%.3f\t%.1f\n",
+		benches[n].name, b->size, density, dist_names[dist], iters,
+		b->ops > 0 ? b->elapsed * 1e9 / b->ops : 0, gb,
+		(double)b->allocs / iters, (double)b->bytes / iters);
+	fflush(stdout);
+}
+
+
+/******************************************************************************
+ * MAIN
+ */
+
+/* parse a comma separated list of numbers, each with an optional K, M or G
+ * suffix (powers of 1024) */
+static int parse_list(const char *s, double *out, int max)
+{
+	char *end;
+	int n = 0;
+
+	while (*s != '\0' && n < max)
+	{
+		out[n] = strtod(s, &end);
+		if (end == s)
+			return -1;
+		switch (*end)
+		{
+		case 'K': out[n] *= 1024; end++; break;
+		case 'M': out[n] *= 1024 * 1024; end++; break;
+		case 'G': out[n] *= 1024 * 1024 * 1024; end++; break;
+		}
+		n++;
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		s = end;
+	}
+
+	return n;
+}
+
+/* test if name is in the comma separated list, or the list is NULL */
+static int selected(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	if (list == NULL)
+		return 1;
+
+	for (p = list; (p = strstr(p, name)) != NULL; p += len)
+	{
+		if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+			return 1;
+	}
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	int i;
+
+	fprintf(stderr, "usage: %s [-s sizes] [-d densities] [-c dists] [-o ops] [-t seconds] [-j threads]\n", prog);
+	fprintf(stderr, "  -s sizes      bitset sizes in bits, such as 1M,32M,1G (the default)\n");
+	fprintf(stderr, "  -d densities  fractions of bits set (default 1e-6,1e-4,0.01,0.5,0.99)\n");
+	fprintf(stderr, "  -c dists      uniform and/or clustered (default both)\n");
+	fprintf(stderr, "  -o ops        the benchmarks to run (default all):\n               ");
+	for (i = 0; i < NBENCHES; i++)
+		fprintf(stderr, " %s", benches[i].name);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -t seconds    the least time to run each benchmark (default 0.2)\n");
+	fprintf(stderr, "  -j threads    threads for the whole-set operations (default 1)\n");
+}
+
+int main(int argc, char **argv)
+{
+	double sizes[MAXLIST] = { 1 << 20, 32 << 20, 1 << 30 };
+	double densities[MAXLIST] = { 1e-6, 1e-4, 0.01, 0.5, 0.99 };
+	int nsizes = 3, ndensities = 5;
+	const char *ops = NULL, *dists = NULL;
+	double min_time = 0.2;
+	struct bench b;
+	int s, d, dist, n, i, opt, nthreads = 1;
+
+	while ((opt = getopt(argc, argv, "s:d:c:o:t:j:")) != -1)
+	{
+		switch (opt)
+		{
+		case 's':
+			nsizes = parse_list(optarg, sizes, MAXLIST);
+			for (i = 0; i < nsizes; i++)
+			{
+				if (sizes[i] < 1 || sizes[i] > 2147483647.0)
+					nsizes = -1;
+			}
+			if (nsizes <= 0)
+			{
+				fprintf(stderr, "sizes must be 1 - 2G bits\n");
+				return 1;
+			}
+			break;
+
+		case 'd':
+			ndensities = parse_list(optarg, densities, MAXLIST);
+			for (i = 0; i < ndensities; i++)
+			{
+				if (densities[i] <= 0 || densities[i] >= 1)
+					ndensities = -1;
+			}
+			if (ndensities <= 0)
+			{
+				fprintf(stderr, "densities must be between 0 and 1\n");
+				return 1;
+			}
+			break;
+
+		case 'c':
+			dists = optarg;
+			break;
+
+		case 'o':
+			ops = optarg;
+			break;
+
+		case 't':
+			min_time = atof(optarg);
+			break;
+
+		case 'j':
+			nthreads = atoi(optarg);
+			if (bitset_set_threads(nthreads, 16) != OK)
+			{
+				fprintf(stderr, "bad thread count %s\n", optarg);
+				return 1;
+			}
+			break;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.seq = (int *)malloc(sizeof(int) * BITOPS);
+	b.rnd = (int *)malloc(sizeof(int) * BITOPS);
+	if (b.seq == NULL || b.rnd == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	printf("# op\tsize\tdensity\tdist\titers\tns_op\tgb_s\tallocs_op\tbytes_op\n");
+
+	for (s = 0; s < nsizes; s++)
+	{
+		b.size = (int)sizes[s];
+
+		rng_state = 1;
+		for (i = 0; i < BITOPS; i++)
+		{
+			b.seq[i] = i % b.size;
+			b.rnd[i] = (int)(rng() % b.size);
+		}
+
+		for (d = 0; d < ndensities; d++)
+		{
+			for (dist = DIST_UNIFORM; dist <= DIST_CLUSTERED; dist++)
+			{
+				if (!selected(dists, dist_names[dist]))
+					continue;
+
+				/* w is made from the same seed as a, and shares nothing with it */
+				b.a = make_set(b.size, densities[d], dist, 1);
+				b.b = make_set(b.size, densities[d], dist, 2);
+				b.w = make_set(b.size, densities[d], dist, 1);
+
+				for (n = 0; n < NBENCHES; n++)
+				{
+					if (selected(ops, benches[n].name))
+						run(&b, n, densities[d], dist, min_time);
+				}
+
+				bitset_free(b.a);
+				bitset_free(b.b);
+				bitset_free(b.w);
+			}
+		}
+	}
+
+	free(b.seq);
+	free(b.rnd);
+
+	return 0;
+}
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <assert.h>
+#include <algorithm>
+#include <vector>
+
+#include "bitset.hpp"
+
+#define RUN_TEST(t) { puts("Running " #t); t(); }
+
+/* a bitset with every n'th bit set in [0, end) */
+static sparse::bitset every(int size, int n, int end)
+{
+	sparse::bitset b(size);
+
+	for (int i = 0; i < end; i += n)
+		b.set(i);
+	return b;
+}
+
+void test_ownership()
+{
+	sparse::bitset a(IDSPERBLOCK * 4);
+	a.set(10).set(IDSPERBLOCK * 3);
+
+	/* copies share the blocks until written */
+	sparse::bitset b = a.copy();
+	assert(b.get()->blocks[0] == a.get()->blocks[0]);
+	b.clr(10);
+	assert(a.test(10) && !b.test(10));
+
+	sparse::bitset c = std::move(a);
+	assert(!a && c.count() == 2);
+
+	bool thrown = false;
+	try
+	{
+		c.set(IDSPERBLOCK * 4);
+	}
+	catch (const sparse::error &e)
+	{
+		thrown = e.code() == ERRINPUT;
+	}
+	assert(thrown);
+}
+
+void test_expressions()
+{
+	int size = IDSPERBLOCK * 6 + 100;
+	sparse::bitset a = every(size, 2, size);
+	sparse::bitset b = every(size, 3, IDSPERBLOCK * 4);
+	sparse::bitset c = every(size, 5, size);
+	sparse::bitset d = every(size, 7, size);
+	sparse::bitset s = sparse::bitset::small(size);
+	int i, n = 0;
+
+	s.set(35).set(IDSPERBLOCK * 5 + 1);
+
+	sparse::bitset r = (a & b) | (c - d) | s;
+	for (i = 0; i < size; i++)
+	{
+		bool want = (i % 2 == 0 && i % 3 == 0 && i < IDSPERBLOCK * 4) ||
+			(i % 5 == 0 && i % 7 != 0) || i == 35 || i == IDSPERBLOCK * 5 + 1;
+		assert(r.test(i) == want);
+		n += want;
+	}
+	assert(r.count() == n);
+
+	/* the same result from the C operations */
+	sparse::bitset t = a.copy();
+	t &= b;
+	sparse::bitset u = c.copy();
+	u -= d;
+	t |= u;
+	t |= s;
+	assert(t.count() == n);
+
+	r -= (a | c);
+	assert(r.count() == 1 && r.test(IDSPERBLOCK * 5 + 1));
+
+	/* the result takes the size of the left operand */
+	sparse::bitset big = every(size * 2, 1, size * 2);
+	sparse::bitset x = a & big;
+	assert(x.size() == size && x.count() == a.count());
+
+	/* and its block size */
+	sparse::bitset fine(size, BITSET_MIN_BLOCKSIZE);
+	fine.set(3).set(IDSPERBLOCK * 2 + 6).set(size - 1);
+	sparse::bitset y = fine & (a | s);
+	assert(y.get()->block_shift == fine.get()->block_shift);
+	assert(y.count() == 1 && y.test(IDSPERBLOCK * 2 + 6));
+	sparse::bitset z = (a | s) - fine;
+	assert(z.count() == a.count() + 2 - 1 && !z.test(IDSPERBLOCK * 2 + 6));
+}
+
+void test_iterators()
+{
+	sparse::bitset a(IDSPERBLOCK * 3);
+	std::vector<int> v;
+
+	a.set(1).set(64).set(IDSPERBLOCK * 2 + 5);
+	std::copy(a.begin(), a.end(), std::back_inserter(v));
+	assert(v.size() == 3 && v[0] == 1 && v[1] == 64 && v[2] == IDSPERBLOCK * 2 + 5);
+
+	assert(std::count_if(a.begin(), a.end(), [](int i) { return i >= 64; }) == 2);
+	assert(*std::find(a.begin(), a.end(), 64) == 64);
+	assert(std::distance(a.begin(), a.end()) == 3);
+
+	int n = 0;
+	for (int i : a)
+		n += i;
+	assert(n == 1 + 64 + IDSPERBLOCK * 2 + 5);
+
+	sparse::bitset e(100);
+	assert(e.begin() == e.end());
+}
+
+void test_fixed()
+{
+	typedef sparse::fixed_bitset<200> flags;
+	flags a, b;
+
+	static_assert(flags::size() == 200 && flags::words == 8, "fixed layout");
+
+	a.set(0).set(63).set(64).set(199);
+	b.set(63).set(150);
+	assert((a & b).count() == 1 && (a | b).count() == 5 && (a - b).count() == 3);
+
+	flags c = a;
+	c.invert();
+	assert(c.count() == 196 && !c.test(199));
+	c |= a;
+	assert(c.count() == 200);
+
+	/* fixed and sparse bitsets mix in expressions */
+	sparse::bitset s(IDSPERBLOCK * 2);
+	s.set(63).set(64).set(IDSPERBLOCK + 1);
+
+	sparse::bitset r = s & a;
+	assert(r.count() == 2 && r.test(64));
+
+	sparse::bitset u = s | a;
+	assert(u.size() == IDSPERBLOCK * 2 && u.count() == 5);
+
+	flags f(s - b);
+	assert(f.count() == 1 && f.test(64));
+
+	/* a size which is not a whole number of pages */
+	typedef sparse::fixed_bitset<IDSPERPAGE + 10, 4> wide;
+	wide big;
+	big.set(IDSPERPAGE + 9).set(3);
+	sparse::bitset v = s | big;
+	assert(v.count() == 5 && v.test(IDSPERPAGE + 9));
+	assert(wide(v) == (big | wide(s)));
+}
+
+void test_state()
+{
+	sparse::bitset a = every(IDSPERBLOCK * 2, 3, 3000);
+	sparse::bitset b = every(IDSPERBLOCK * 2, 5, 3000);
+	sparse::bitset c = every(IDSPERBLOCK * 2, 7, 3000);
+	struct ::bitset *p = a.get();
+
+	/* an id is kept by assignment from an expression */
+	p->id = 9;
+	a |= b & c;
+	assert(a.get() == p && p->id == 9 && a.test(35) && a.test(3));
+	a -= b | c;
+	assert(a.get() == p && !a.test(35) && a.test(3));
+	a = b & c;
+	assert(a.get() == p && p->id == 9 && a.count() == sparse::bitset(b & c).count());
+	a &= b - c;
+	assert(a.get() == p && a.count() == 0);
+
+	/* a bitset without that state is replaced, but keeps its counters */
+	sparse::bitset x(IDSPERBLOCK * 2);
+	struct bitset_stats *st = x.get()->stats;
+	x = b & c;
+	assert(x.get()->stats == st && x.count() == sparse::bitset(b & c).count());
+
+	/* a journal cannot record an unnamed operand */
+	FILE *f = tmpfile();
+	assert(f != NULL);
+	assert(bitset_journal_open(p, fileno(f), 4) == OK);
+	a.set(1);
+	bool thrown = false;
+	try
+	{
+		a |= b & c;
+	}
+	catch (const sparse::error &e)
+	{
+		thrown = e.code() == ERRINPUT;
+	}
+	assert(thrown && p->journal != NULL && a.count() == 1);
+	thrown = false;
+	try
+	{
+		a = b | c;
+	}
+	catch (const sparse::error &e)
+	{
+		thrown = e.code() == ERRINPUT;
+	}
+	assert(thrown && a.get() == p && a.count() == 1);
+	assert(bitset_journal_close(p) == OK);
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	RUN_TEST(test_ownership);
+	RUN_TEST(test_expressions);
+	RUN_TEST(test_iterators);
+	RUN_TEST(test_fixed);
+	RUN_TEST(test_state);
+
+	return 0;
+}
@@ -3,6 +3,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
 
 #include "bitset.h"
 
@@ -283,6 +288,77 @@ void test_toggle_bit()
 	bitset_free(d);
 }
 
+#define INGEST_THREADS 8
+
+struct ingest_arg {
+	struct bitset *bset;
+	int shard;
+};
+
+/* every thread sets every 3rd bit starting at its shard, so the shards
+ * overlap and race on the same blocks, pages and words */
+static void *ingest_worker(void *arg)
+{
+	struct ingest_arg *ia = (struct ingest_arg *)arg;
+	int i;
+
+	for (i = ia->shard; i < bitset_bitcount(ia->bset); i += 3)
+		VERIFY(bitset_set_concurrent(ia->bset, i));
+
+	return NULL;
+}
+
+void test_set_concurrent()
+{
+	struct bitset *bset = NULL, *d = NULL;
+	struct ingest_arg args[INGEST_THREADS];
+	pthread_t threads[INGEST_THREADS];
+	int i, ret, bit, allocs, bytes, allocs2, bytes2;
+
+	ret = bitset_alloc(IDSPERBLOCK * 6, &bset);
+	assert(ret == OK);
+
+	/* thread-safe mode is required */
+	assert(bitset_set_concurrent(bset, 0) == ERRINPUT);
+
+	bitset_set_threadsafe(1);
+	bitset_get_alloc_stats(&allocs, &bytes);
+
+	for (i = 0; i < INGEST_THREADS; i++)
+	{
+		args[i].bset = bset;
+		args[i].shard = i % 3;
+		ret = pthread_create(&threads[i], NULL, ingest_worker, &args[i]);
+		assert(ret == 0);
+	}
+
+	for (i = 0; i < INGEST_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	/* each bit was counted exactly once no matter how many threads set it */
+	assert(bitset_set_count(bset) == IDSPERBLOCK * 6);
+	for (i = 0; i < IDSPERBLOCK * 6; i++)
+	{
+		VERIFY(bitset_test_bit(bset, i, &bit));
+		assert(bit == 1);
+	}
+
+	/* the blocks and pages of threads which lost a race are not counted */
+	bitset_get_alloc_stats(&allocs2, &bytes2);
+	assert(allocs2 - allocs == 6 + 6 * (IDSPERBLOCK / IDSPERPAGE));
+	assert(bytes2 - bytes == 6 * (int)(sizeof(struct bitset_block) +
+		(IDSPERBLOCK / IDSPERPAGE) * (sizeof(struct bitset_page *) + sizeof(struct bitset_page))));
+
+	/* shared blocks cannot be written concurrently */
+	VERIFY(bitset_dup(bset, &d));
+	assert(bitset_set_concurrent(bset, 10) == ERRINPUT);
+
+	bitset_free(d);
+	bitset_free(bset);
+
+	bitset_set_threadsafe(0);
+}
+
 void test_dup()
 {
 	struct bitset *s = NULL, *d = NULL;
@@ -367,6 +443,219 @@ void test_dup()
 	bitset_free(d);
 }
 
+void test_page_cow()
+{
+	struct bitset *s = NULL, *d = NULL, *r = NULL;
+	int i, ret, bit;
+
+	ret = bitset_alloc(IDSPERBLOCK * 2, &s);
+	assert(ret == OK);
+
+	/* set a bit in every page of block 0 */
+	for (i = 0; i < IDSPERBLOCK; i += IDSPERPAGE)
+		VERIFY(bitset_set(s, i));
+
+	/* a single bit only needs a single page */
+	VERIFY(bitset_set(s, IDSPERBLOCK + 5));
+	assert(s->blocks[1]->pages[0] != NULL);
+	for (i = 1; i < PAGECOUNT; i++)
+		assert(s->blocks[1]->pages[i] == NULL);
+
+	ret = bitset_dup(s, &d);
+	assert(ret == OK);
+
+	/* writing to the shared block copies the block and just one page */
+	VERIFY(bitset_set(d, 3*IDSPERPAGE + 1));
+
+	assert(s->blocks[0] != d->blocks[0]);
+	assert(s->blocks[0]->ref_count == 1);
+	assert(d->blocks[0]->ref_count == 1);
+	assert(d->blocks[0]->set_count == PAGECOUNT + 1);
+	assert(s->blocks[0]->set_count == PAGECOUNT);
+
+	for (i = 0; i < PAGECOUNT; i++)
+	{
+		if (i == 3)
+		{
+			assert(s->blocks[0]->pages[i] != d->blocks[0]->pages[i]);
+			assert(s->blocks[0]->pages[i]->ref_count == 1);
+			assert(d->blocks[0]->pages[i]->set_count == 2);
+		}
+		else
+		{
+			assert(s->blocks[0]->pages[i] == d->blocks[0]->pages[i]);
+			assert(s->blocks[0]->pages[i]->ref_count == 2);
+		}
+	}
+
+	ret = bitset_test_bit(s, 3*IDSPERPAGE + 1, &bit);
+	assert(ret == OK);
+	assert(bit == 0);
+
+	/* inverting a dup must not change the original */
+	ret = bitset_inverse(s, &r);
+	assert(ret == OK);
+	assert(bitset_set_count(s) == PAGECOUNT + 1);
+	assert(bitset_set_count(r) == 2*IDSPERBLOCK - PAGECOUNT - 1);
+
+	ret = bitset_test_bit(r, IDSPERBLOCK + 6, &bit);
+	assert(ret == OK);
+	assert(bit == 1);
+
+	bitset_free(s);
+	bitset_free(d);
+	bitset_free(r);
+}
+
+#define DUP_THREADS 4
+
+/* read and modify a dup of the shared bitset from a worker thread */
+static void *dup_worker(void *arg)
+{
+	struct bitset *d = (struct bitset *)arg;
+	struct bitset_iterator iter;
+	int i, n = 0;
+
+	for (bitset_iter_init(&iter, d, BITSET_ITER_ON);
+		 !bitset_iter_at_end(&iter);
+		 bitset_iter_next(&iter))
+	{
+		assert(bitset_iter_index(&iter) % 3 == 0);
+		n++;
+	}
+	assert(n == bitset_set_count(d));
+
+	/* writes to the dup copy the blocks it shares with the writer */
+	for (i = 1; i < IDSPERBLOCK * 8; i += 3)
+		VERIFY(bitset_set(d, i));
+	assert(bitset_set_count(d) == 2*n);
+
+	bitset_free(d);
+	return NULL;
+}
+
+void test_threadsafe_dup()
+{
+	struct bitset *s = NULL, *d;
+	pthread_t threads[DUP_THREADS];
+	int i, j, ret;
+
+	bitset_set_threadsafe(1);
+
+	ret = bitset_alloc(IDSPERBLOCK * 8, &s);
+	assert(ret == OK);
+
+	for (i = 0; i < IDSPERBLOCK * 8; i += 3)
+		VERIFY(bitset_set(s, i));
+
+	/* hand a dup to each worker, then keep writing to the original */
+	for (j = 0; j < DUP_THREADS; j++)
+	{
+		d = NULL;
+		VERIFY(bitset_dup(s, &d));
+		ret = pthread_create(&threads[j], NULL, dup_worker, d);
+		assert(ret == 0);
+	}
+
+	for (i = 0; i < IDSPERBLOCK * 8; i += 3)
+		VERIFY(bitset_clr(s, i));
+
+	for (j = 0; j < DUP_THREADS; j++)
+		pthread_join(threads[j], NULL);
+
+	assert(bitset_set_count(s) == 0);
+	for (i = 0; i < s->block_count; i++)
+		assert(s->blocks[i]->ref_count == 1);
+
+	bitset_free(s);
+
+	bitset_set_threadsafe(0);
+}
+
+#define SNAPSHOT_READERS 3
+#define SNAPSHOT_ROUNDS  200
+
+static int snapshot_done = 0;
+
+/* every published version has bits 0 - n-1 set for some multiple n of 100 */
+static void *snapshot_reader(void *arg)
+{
+	struct bitset *bset = (struct bitset *)arg;
+	struct bitset_snapshot snap;
+	struct bitset_iterator iter;
+	int n;
+
+	while (!__atomic_load_n(&snapshot_done, __ATOMIC_ACQUIRE))
+	{
+		VERIFY(bitset_snapshot(bset, &snap));
+
+		n = 0;
+		for (bitset_iter_init(&iter, snap.bset, BITSET_ITER_ON);
+			 !bitset_iter_at_end(&iter);
+			 bitset_iter_next(&iter))
+		{
+			assert(bitset_iter_index(&iter) == n);
+			n++;
+		}
+		assert(n % 100 == 0);
+		assert(n == bitset_set_count(snap.bset));
+
+		bitset_release(&snap);
+	}
+
+	return NULL;
+}
+
+void test_snapshot()
+{
+	struct bitset *bset = NULL;
+	struct bitset_snapshot snap;
+	pthread_t threads[SNAPSHOT_READERS];
+	int i, j, ret;
+
+	ret = bitset_alloc(IDSPERBLOCK * 2, &bset);
+	assert(ret == OK);
+
+	/* nothing to read before the first publish */
+	assert(bitset_snapshot(bset, &snap) == ERRINPUT);
+
+	VERIFY(bitset_publish(bset));
+
+	/* a snapshot does not see later writes */
+	VERIFY(bitset_snapshot(bset, &snap));
+	for (i = 0; i < 100; i++)
+		VERIFY(bitset_set(bset, i));
+	VERIFY(bitset_publish(bset));
+	assert(bitset_set_count(snap.bset) == 0);
+	bitset_release(&snap);
+
+	VERIFY(bitset_snapshot(bset, &snap));
+	assert(bitset_set_count(snap.bset) == 100);
+	bitset_release(&snap);
+
+	for (j = 0; j < SNAPSHOT_READERS; j++)
+	{
+		ret = pthread_create(&threads[j], NULL, snapshot_reader, bset);
+		assert(ret == 0);
+	}
+
+	/* keep writing in place while the readers run */
+	for (i = 1; i < SNAPSHOT_ROUNDS; i++)
+	{
+		for (j = 0; j < 100; j++)
+			VERIFY(bitset_set(bset, i*100 + j));
+		VERIFY(bitset_publish(bset));
+	}
+
+	__atomic_store_n(&snapshot_done, 1, __ATOMIC_RELEASE);
+	for (j = 0; j < SNAPSHOT_READERS; j++)
+		pthread_join(threads[j], NULL);
+
+	assert(bitset_set_count(bset) == SNAPSHOT_ROUNDS * 100);
+
+	bitset_free(bset);
+}
+
 void test_or()
 {
 	struct bitset *a = NULL, *b = NULL;
@@ -577,6 +866,1109 @@ void test_invert()
 	bitset_free(b);
 }
 
+/* check that two bitsets have exactly the same bits set */
+static void assert_same_bits(struct bitset *a, struct bitset *b)
+{
+	int i, x, y;
+
+	assert(bitset_bitcount(a) == bitset_bitcount(b));
+	assert(bitset_set_count(a) == bitset_set_count(b));
+
+	for (i = 0; i < bitset_bitcount(a); i++)
+	{
+		VERIFY(bitset_test_bit(a, i, &x));
+		VERIFY(bitset_test_bit(b, i, &y));
+		assert(x == y);
+	}
+}
+
+void test_set_bulk()
+{
+	struct bitset *a = NULL, *b = NULL, *d = NULL;
+	int bits[1000], i, n, ret;
+
+	ret = bitset_alloc(IDSPERBLOCK * 4, &a);
+	assert(ret == OK);
+	ret = bitset_alloc(IDSPERBLOCK * 4, &b);
+	assert(ret == OK);
+
+	/* sorted, with duplicates and runs in the same word */
+	for (n = 0, i = 0; i < 1000; i++)
+		bits[n++] = i * 257 + (i % 3);
+	bits[500] = bits[499];
+
+	ret = bitset_dup(a, &d);
+	assert(ret == OK);
+
+	VERIFY(bitset_set_bulk(a, bits, n));
+	for (i = 0; i < n; i++)
+		VERIFY(bitset_set(b, bits[i]));
+	assert_same_bits(a, b);
+
+	/* unsorted input into a set sharing blocks with a dup */
+	bitset_free(d);
+	d = NULL;
+	VERIFY(bitset_dup(a, &d));
+	for (i = 0; i < n; i++)
+		bits[i] = (bits[i] * 7 + 11) % (IDSPERBLOCK * 4);
+
+	VERIFY(bitset_set_bulk(d, bits, n));
+	for (i = 0; i < n; i++)
+		VERIFY(bitset_set(b, bits[i]));
+	assert_same_bits(d, b);
+	assert(bitset_set_count(a) == 999);
+
+	bits[0] = IDSPERBLOCK * 4;
+	assert(bitset_set_bulk(a, bits, 1) == ERRINPUT);
+
+	/* a bit past the end in the same word as the last one is caught too */
+	bitset_free(d);
+	d = NULL;
+	VERIFY(bitset_alloc(100, &d));
+	bits[0] = 99;
+	bits[1] = 100;
+	assert(bitset_set_bulk(d, bits, 2) == ERRINPUT);
+	assert(bitset_set_count(d) == 1);
+
+	bitset_free(a);
+	bitset_free(b);
+	bitset_free(d);
+}
+
+void test_parallel_ops()
+{
+	struct bitset *a = NULL, *b = NULL;
+	struct bitset *serial[4] = { NULL }, *parallel[4] = { NULL };
+	int i, n, ret;
+
+	n = IDSPERBLOCK * 40;
+
+	ret = bitset_alloc(n, &a);
+	assert(ret == OK);
+	ret = bitset_alloc(n, &b);
+	assert(ret == OK);
+
+	/* a is dense in the first blocks and sparse after, so the work is skewed */
+	for (i = 0; i < n; i += (i < IDSPERBLOCK * 8 ? 2 : 997))
+		VERIFY(bitset_set(a, i));
+	for (i = 0; i < n; i += 5)
+		VERIFY(bitset_set(b, i));
+
+	VERIFY(bitset_union(a, b, &serial[0]));
+	VERIFY(bitset_intersect(a, b, &serial[1]));
+	VERIFY(bitset_difference(a, b, &serial[2]));
+	VERIFY(bitset_inverse(a, &serial[3]));
+
+	VERIFY(bitset_set_threads(4, 8));
+
+	VERIFY(bitset_union(a, b, &parallel[0]));
+	VERIFY(bitset_intersect(a, b, &parallel[1]));
+	VERIFY(bitset_difference(a, b, &parallel[2]));
+	VERIFY(bitset_inverse(a, &parallel[3]));
+
+	for (i = 0; i < 4; i++)
+		assert_same_bits(serial[i], parallel[i]);
+
+	/* sets below the threshold still work, serially */
+	VERIFY(bitset_set_threads(4, 1000));
+	assert(bitset_set_count(a) == bitset_set_count(serial[2]) + bitset_set_count(serial[1]));
+
+	VERIFY(bitset_set_threads(1, 0));
+	bitset_set_threadsafe(0);
+
+	assert(bitset_set_threads(0, 0) == ERRINPUT);
+
+	for (i = 0; i < 4; i++)
+	{
+		bitset_free(serial[i]);
+		bitset_free(parallel[i]);
+	}
+	bitset_free(a);
+	bitset_free(b);
+}
+
+void test_save_load()
+{
+	struct bitset *a = NULL, *b = NULL;
+	FILE *f;
+	int i, fd, ret;
+	char c;
+
+	ret = bitset_alloc(IDSPERBLOCK * 4 + 100, &a);
+	assert(ret == OK);
+
+	/* a sparse page, a page of runs and a dense page in block 0 */
+	for (i = 0; i < IDSPERPAGE; i += 101)
+		VERIFY(bitset_set(a, i));
+	for (i = IDSPERPAGE + 50; i < IDSPERPAGE + 3000; i++)
+		VERIFY(bitset_set(a, i));
+	for (i = 2 * IDSPERPAGE; i < 3 * IDSPERPAGE; i += 3)
+		VERIFY(bitset_set(a, i));
+
+	/* block 1 is allocated but empty, block 2 is full, and the last bit
+	 * of the set is in the partial block 4 */
+	VERIFY(bitset_set(a, IDSPERBLOCK + 7));
+	VERIFY(bitset_clr(a, IDSPERBLOCK + 7));
+	for (i = 2 * IDSPERBLOCK; i < 3 * IDSPERBLOCK; i++)
+		VERIFY(bitset_set(a, i));
+	VERIFY(bitset_set(a, IDSPERBLOCK * 4 + 99));
+
+	f = tmpfile();
+	assert(f != NULL);
+	fd = fileno(f);
+
+	VERIFY(bitset_save(a, fd));
+
+	/* the full block is stored as runs, not bitmaps */
+	assert(lseek(fd, 0, SEEK_CUR) < (off_t)(3 * PAGESIZE * sizeof(uint64_t) + 1024));
+
+	lseek(fd, 0, SEEK_SET);
+	VERIFY(bitset_load(fd, &b));
+	assert_same_bits(a, b);
+	bitset_free(b);
+	b = NULL;
+
+	/* change the bit stored in the last page record: the checksum catches it */
+	lseek(fd, -8, SEEK_END);
+	assert(read(fd, &c, 1) == 1);
+	c ^= 1;
+	lseek(fd, -8, SEEK_END);
+	assert(write(fd, &c, 1) == 1);
+	lseek(fd, 0, SEEK_SET);
+	assert(bitset_load(fd, &b) == ERRFORMAT);
+	assert(b == NULL);
+
+	/* and so does a truncated or foreign file */
+	VERIFY(ftruncate(fd, 40));
+	lseek(fd, 0, SEEK_SET);
+	assert(bitset_load(fd, &b) == ERRFORMAT);
+	lseek(fd, 0, SEEK_SET);
+	assert(write(fd, "NOTABITSET", 10) == 10);
+	lseek(fd, 0, SEEK_SET);
+	assert(bitset_load(fd, &b) == ERRFORMAT);
+
+	fclose(f);
+	bitset_free(a);
+}
+
+/* count the mappings of the process of a file whose name contains name */
+static int mapped(const char *name)
+{
+	FILE *f;
+	char line[512];
+	int n = 0;
+
+	f = fopen("/proc/self/maps", "r");
+	assert(f != NULL);
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		if (strstr(line, name) != NULL)
+			n++;
+	}
+	fclose(f);
+
+	return n;
+}
+
+void test_mmap()
+{
+	struct bitset *a = NULL, *m = NULL, *d = NULL, *l = NULL;
+	char path[] = "/tmp/bitset_test_XXXXXX";
+	int i, fd, ret;
+
+	ret = bitset_alloc(IDSPERBLOCK * 3, &a);
+	assert(ret == OK);
+
+	/* dense pages are mapped in place, sparse ones are decoded */
+	for (i = 0; i < IDSPERBLOCK; i += 3)
+		VERIFY(bitset_set(a, i));
+	VERIFY(bitset_set(a, 2 * IDSPERBLOCK + 5));
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	VERIFY(bitset_save(a, fd));
+	close(fd);
+
+	VERIFY(bitset_mmap(path, &m));
+	assert_same_bits(a, m);
+
+	/* writes to mapped pages copy them, and leave dups and the file alone */
+	VERIFY(bitset_dup(m, &d));
+	VERIFY(bitset_set(m, 1));
+	VERIFY(bitset_clr(m, 3));
+	VERIFY(bitset_set(m, 2 * IDSPERBLOCK + 6));
+	VERIFY(bitset_union(m, a, &l));
+	assert(bitset_set_count(l) == bitset_set_count(a) + 2);
+	bitset_free(l);
+	l = NULL;
+
+	assert_same_bits(a, d);
+	bitset_free(m);
+	assert_same_bits(a, d);
+	assert(mapped(path) == 1);
+	bitset_free(d);
+	assert(mapped(path) == 0);
+
+	/* mapping again after the last free maps the file afresh */
+	m = NULL;
+	VERIFY(bitset_mmap(path, &m));
+	assert(mapped(path) == 1);
+	assert_same_bits(a, m);
+	bitset_free(m);
+	assert(mapped(path) == 0);
+
+	fd = open(path, O_RDONLY);
+	assert(fd >= 0);
+	VERIFY(bitset_load(fd, &l));
+	assert_same_bits(a, l);
+	close(fd);
+
+	unlink(path);
+	m = NULL;
+	assert(bitset_mmap(path, &m) == ERRIO);
+
+	bitset_free(a);
+	bitset_free(l);
+}
+
+void test_shm()
+{
+	struct bitset *a = NULL, *w1 = NULL, *w2 = NULL, *w3 = NULL;
+	char name[64];
+	int i;
+
+	sprintf(name, "/bitset_test_%d", (int)getpid());
+
+	VERIFY(bitset_alloc(IDSPERBLOCK * 3, &a));
+	VERIFY(bitset_set(a, 5));
+	for (i = 2 * IDSPERBLOCK; i < 3 * IDSPERBLOCK; i += 2)
+		VERIFY(bitset_set(a, i));
+
+	VERIFY(bitset_shm_create(name, a));
+	VERIFY(bitset_shm_attach(name, &w1));
+	VERIFY(bitset_shm_attach(name, &w2));
+	assert_same_bits(a, w1);
+	assert_same_bits(a, w2);
+
+	/* a worker changing its copy does not change the others */
+	VERIFY(bitset_set(w1, 6));
+	VERIFY(bitset_clr(w1, 5));
+	assert_same_bits(a, w2);
+
+	/* publishing a new version leaves attached workers on the old one */
+	VERIFY(bitset_set(a, 7));
+	VERIFY(bitset_shm_create(name, a));
+	VERIFY(bitset_shm_attach(name, &w3));
+	assert_same_bits(a, w3);
+	assert(bitset_set_count(w2) == bitset_set_count(a) - 1);
+
+	VERIFY(bitset_shm_remove(name));
+	bitset_free(w3);
+	w3 = NULL;
+	assert(bitset_shm_attach(name, &w3) == ERRIO);
+
+	bitset_free(w1);
+	bitset_free(w2);
+	w1 = NULL;
+	w2 = NULL;
+	assert(mapped(name) == 0);
+
+	/* the mapping goes with the last bitset using its pages */
+	VERIFY(bitset_shm_create(name, a));
+	VERIFY(bitset_shm_attach(name, &w1));
+	assert(mapped(name) == 1);
+	bitset_free(w1);
+	w1 = NULL;
+	assert(mapped(name) == 0);
+
+	VERIFY(bitset_shm_attach(name, &w1));
+	VERIFY(bitset_alloc(IDSPERBLOCK * 3, &w2));
+	VERIFY(bitset_or(w2, w1));
+	bitset_free(w1);
+	assert(mapped(name) == 1);
+	assert_same_bits(a, w2);
+	bitset_free(w2);
+	assert(mapped(name) == 0);
+
+	VERIFY(bitset_shm_remove(name));
+	bitset_free(a);
+}
+
+void test_roaring()
+{
+	struct bitset *a = NULL, *b = NULL;
+	char *buf = NULL;
+	size_t size;
+	int i, x;
+
+	/* the spec's example of an array container holding 1, 2, 3 and 1000 */
+	const char small[] = {
+		0x3a, 0x30, 0, 0,  1, 0, 0, 0,  0, 0, 3, 0,  16, 0, 0, 0,
+		1, 0,  2, 0,  3, 0,  (char)0xe8, 3 };
+
+	/* a run cookie with one run container holding 65546 to 65645 */
+	const char runs[] = {
+		0x3b, 0x30, 0, 0,  1,  1, 0, 99, 0,  1, 0,  10, 0, 99, 0 };
+
+	VERIFY(bitset_alloc(IDSPERBLOCK * 4, &a));
+	VERIFY(bitset_set(a, 1));
+	VERIFY(bitset_set(a, 2));
+	VERIFY(bitset_set(a, 3));
+	VERIFY(bitset_set(a, 1000));
+
+	VERIFY(bitset_to_roaring(a, &buf, &size));
+	assert(size == sizeof(small));
+	assert(memcmp(buf, small, size) == 0);
+	free(buf);
+
+	VERIFY(bitset_from_roaring(runs, sizeof(runs), IDSPERBLOCK * 2, &b));
+	assert(bitset_set_count(b) == 100);
+	for (i = 0; i < IDSPERBLOCK * 2; i++)
+	{
+		VERIFY(bitset_test_bit(b, i, &x));
+		assert(x == (i >= 65546 && i <= 65645));
+	}
+	bitset_free(b);
+	b = NULL;
+
+	/* an array, a bitmap and run containers survive a round trip */
+	for (i = IDSPERBLOCK; i < 2 * IDSPERBLOCK; i += 3)
+		VERIFY(bitset_set(a, i));
+	for (i = 3 * IDSPERBLOCK + 10; i < 4 * IDSPERBLOCK; i++)
+		VERIFY(bitset_set(a, i));
+	VERIFY(bitset_clr(a, 3 * IDSPERBLOCK + 20000));
+
+	VERIFY(bitset_to_roaring(a, &buf, &size));
+	VERIFY(bitset_from_roaring(buf, size, IDSPERBLOCK * 4, &b));
+	assert_same_bits(a, b);
+	bitset_free(b);
+	b = NULL;
+
+	/* values past the end of the bitset, and short buffers, are refused */
+	assert(bitset_from_roaring(buf, size, IDSPERBLOCK * 4 - 1, &b) == ERRINPUT);
+	assert(bitset_from_roaring(buf, size - 1, IDSPERBLOCK * 4, &b) == ERRFORMAT);
+	assert(bitset_from_roaring(buf, 3, IDSPERBLOCK * 4, &b) == ERRFORMAT);
+	assert(b == NULL);
+
+	free(buf);
+	bitset_free(a);
+}
+
+void test_journal()
+{
+	struct bitset *a = NULL, *o = NULL, *r = NULL, *ops[2];
+	int bits[] = { 70000, 5, 200000, 6, 70001 };
+	struct rlimit lim, small;
+	FILE *f;
+	off_t end;
+	int i, fd;
+
+	VERIFY(bitset_alloc(IDSPERBLOCK * 4, &a));
+	VERIFY(bitset_alloc(IDSPERBLOCK * 4, &o));
+	for (i = 0; i < IDSPERBLOCK * 4; i += 1001)
+		VERIFY(bitset_set(o, i));
+	o->id = 1;
+	ops[0] = NULL;
+	ops[1] = o;
+
+	f = tmpfile();
+	assert(f != NULL);
+	fd = fileno(f);
+
+	VERIFY(bitset_journal_open(a, fd, 4));
+
+	for (i = 0; i < 3000; i += 7)
+		VERIFY(bitset_set(a, i));
+	VERIFY(bitset_clr(a, 14));
+	VERIFY(bitset_toggle_bit(a, 15));
+	VERIFY(bitset_set_bulk(a, bits, 5));
+	VERIFY(bitset_or(a, o));
+	VERIFY(bitset_toggle_bit(a, 1001));
+	VERIFY(bitset_invert(a));
+	VERIFY(bitset_subtract(a, o));
+
+	/* an operand the journal cannot name is refused */
+	o->id = 0;
+	assert(bitset_and(a, o) == ERRINPUT);
+	o->id = 1;
+
+	VERIFY(bitset_journal_sync(a));
+
+	VERIFY(bitset_alloc(IDSPERBLOCK * 4, &r));
+	VERIFY(bitset_journal_replay(r, fd, ops, 2));
+	assert_same_bits(a, r);
+	bitset_free(r);
+	r = NULL;
+
+	/* a frame torn by a crash is ignored, and cut off when the log is
+	 * opened again */
+	VERIFY(bitset_journal_close(a));
+	assert(write(fd, "\x10\0\0\0torn", 8) == 8);
+
+	VERIFY(bitset_alloc(IDSPERBLOCK * 4, &r));
+	VERIFY(bitset_journal_replay(r, fd, ops, 2));
+	assert_same_bits(a, r);
+	bitset_free(r);
+	r = NULL;
+
+	VERIFY(bitset_journal_open(a, fd, 100));
+	VERIFY(bitset_clr(a, 0));
+
+	/* a frame which is only partly written is cut off before a retry */
+	VERIFY(bitset_toggle_bit(a, 1));
+	end = lseek(fd, 0, SEEK_END);
+	signal(SIGXFSZ, SIG_IGN);
+	assert(getrlimit(RLIMIT_FSIZE, &lim) == 0);
+	small = lim;
+	small.rlim_cur = end + 4;
+	assert(setrlimit(RLIMIT_FSIZE, &small) == 0);
+	assert(bitset_journal_sync(a) == ERRIO);
+	assert(setrlimit(RLIMIT_FSIZE, &lim) == 0);
+	signal(SIGXFSZ, SIG_DFL);
+	assert(lseek(fd, 0, SEEK_END) == end);
+	VERIFY(bitset_journal_sync(a));
+
+	VERIFY(bitset_alloc(IDSPERBLOCK * 4, &r));
+	VERIFY(bitset_journal_replay(r, fd, ops, 2));
+	assert_same_bits(a, r);
+	bitset_free(r);
+	r = NULL;
+
+	/* replay needs the operands, and a log of the right size */
+	VERIFY(bitset_alloc(IDSPERBLOCK * 4, &r));
+	assert(bitset_journal_replay(r, fd, ops, 1) == ERRINPUT);
+	bitset_free(r);
+	r = NULL;
+	VERIFY(bitset_alloc(IDSPERBLOCK, &r));
+	assert(bitset_journal_replay(r, fd, ops, 2) == ERRINPUT);
+	bitset_free(r);
+	r = NULL;
+
+	/* after a reset the log is empty */
+	VERIFY(bitset_journal_reset(a));
+	VERIFY(bitset_set(a, 0));
+	bitset_free(a);
+
+	VERIFY(bitset_alloc(IDSPERBLOCK * 4, &r));
+	VERIFY(bitset_journal_replay(r, fd, ops, 2));
+	assert(bitset_set_count(r) == 1);
+	bitset_free(r);
+
+	fclose(f);
+	bitset_free(o);
+}
+
+void test_diff()
+{
+	struct bitset *a = NULL, *b = NULL, *c = NULL, *d = NULL;
+	char *buf = NULL;
+	FILE *f;
+	size_t size;
+	int i;
+
+	VERIFY(bitset_alloc(IDSPERBLOCK * 64, &a));
+	for (i = 0; i < IDSPERBLOCK * 64; i += 17)
+		VERIFY(bitset_set(a, i));
+
+	/* a few changes to a dup: a set, a clear, an emptied page and block */
+	VERIFY(bitset_dup(a, &b));
+	VERIFY(bitset_set(b, 1));
+	VERIFY(bitset_clr(b, 17 * 1000));
+	for (i = 0; i < IDSPERPAGE; i += 17)
+		VERIFY(bitset_clr(b, 5 * IDSPERBLOCK + IDSPERPAGE * 3 + i + 1));
+	for (i = 9 * IDSPERBLOCK; i < 10 * IDSPERBLOCK; i++)
+		VERIFY(bitset_clr(b, i));
+
+	VERIFY(bitset_diff_encode(a, b, &buf, &size));
+
+	/* the diff is much smaller than the set */
+	assert(size < PAGESIZE * sizeof(uint64_t) * 40);
+
+	VERIFY(bitset_dup(a, &c));
+	VERIFY(bitset_diff_apply(c, buf, size));
+	assert_same_bits(b, c);
+
+	/* untouched blocks are still shared with the set they came from */
+	assert(c->blocks[1] == a->blocks[1]);
+	assert(c->blocks[9] == NULL);
+
+	/* applied again, the base no longer matches and nothing changes */
+	assert(bitset_diff_apply(c, buf, size) == ERRFORMAT);
+	assert(bitset_diff_apply(c, buf, size - 1) == ERRFORMAT);
+	assert_same_bits(b, c);
+
+	/* a journal could not replay the changes, so a journaled set is refused */
+	VERIFY(bitset_dup(a, &d));
+	f = tmpfile();
+	assert(f != NULL);
+	VERIFY(bitset_journal_open(d, fileno(f), 4));
+	assert(bitset_diff_apply(d, buf, size) == ERRINPUT);
+	assert_same_bits(a, d);
+	VERIFY(bitset_journal_close(d));
+	fclose(f);
+	VERIFY(bitset_diff_apply(d, buf, size));
+	assert_same_bits(b, d);
+	bitset_free(d);
+	free(buf);
+
+	/* identical sets give an empty diff */
+	VERIFY(bitset_diff_encode(b, c, &buf, &size));
+	VERIFY(bitset_diff_apply(a, buf, size));
+	free(buf);
+
+	bitset_free(a);
+	bitset_free(b);
+	bitset_free(c);
+}
+
+void test_dedupe()
+{
+	struct bitset *a = NULL, *b = NULL;
+	struct bitset_intern *tbl = NULL;
+	int i, x;
+
+	/* two bitsets built separately, equal in blocks 0 and 2 and in the
+	 * first pages of block 1 */
+	VERIFY(bitset_alloc(IDSPERBLOCK * 3, &a));
+	VERIFY(bitset_alloc(IDSPERBLOCK * 3, &b));
+	for (i = 0; i < IDSPERBLOCK * 3; i += 3)
+	{
+		VERIFY(bitset_set(a, i));
+		VERIFY(bitset_set(b, i));
+	}
+	VERIFY(bitset_set(b, IDSPERBLOCK + IDSPERPAGE * 5 + 1));
+
+	/* within a, the full pages are all the same */
+	for (i = 2 * IDSPERBLOCK; i < 3 * IDSPERBLOCK; i++)
+		VERIFY(bitset_set(a, i));
+
+	VERIFY(bitset_intern_alloc(&tbl));
+	assert(bitset_dedupe(tbl, a) >= PAGECOUNT - 1);
+	assert(bitset_dedupe(tbl, b) >= 2);
+	assert(a->blocks[2]->pages[0] == a->blocks[2]->pages[PAGECOUNT-1]);
+
+	assert(a->blocks[0] == b->blocks[0]);
+	assert(a->blocks[1] != b->blocks[1]);
+	assert(a->blocks[1]->pages[0] == b->blocks[1]->pages[0]);
+	assert(a->blocks[1]->pages[5] != b->blocks[1]->pages[5]);
+
+	/* nothing more to share the second time round */
+	assert(bitset_dedupe(tbl, a) == 0);
+	bitset_intern_free(tbl);
+
+	/* shared copies are still copied before a write */
+	VERIFY(bitset_clr(a, 3));
+	VERIFY(bitset_test_bit(b, 3, &x));
+	assert(x == 1);
+	assert(bitset_set_count(b) == IDSPERBLOCK + 1);
+
+	bitset_free(a);
+	bitset_free(b);
+}
+
+void test_sparse_directory()
+{
+	struct bitset *a = NULL, *b = NULL, *c = NULL;
+	struct bitset_iterator iter;
+	int x, n = 0;
+	int big = 0x7fff0000;
+
+	/* a bitset of nearly 2^31 bits with a handful set far apart */
+	VERIFY(bitset_alloc(big, &a));
+	VERIFY(bitset_alloc(big, &b));
+	VERIFY(bitset_set(a, 7));
+	VERIFY(bitset_set(a, big / 2));
+	VERIFY(bitset_set(a, big - 1));
+	VERIFY(bitset_set(b, big / 2));
+	VERIFY(bitset_set(b, IDSPERBLOCK * 1000 + 3));
+	assert(bitset_set_count(a) == 3);
+
+	VERIFY(bitset_dup(a, &c));
+	VERIFY(bitset_or(c, b));
+	assert(bitset_set_count(c) == 4);
+	VERIFY(bitset_test_bit(c, IDSPERBLOCK * 1000 + 3, &x));
+	assert(x == 1);
+
+	/* the copied-in block is visited by later operations on c */
+	VERIFY(bitset_subtract(c, a));
+	assert(bitset_set_count(c) == 1);
+	VERIFY(bitset_and(c, b));
+	assert(bitset_set_count(c) == 1);
+	VERIFY(bitset_and(c, a));
+	assert(bitset_set_count(c) == 0);
+
+	for (bitset_iter_init(&iter, a, BITSET_ITER_ON);
+		 !bitset_iter_at_end(&iter);
+		 bitset_iter_next(&iter))
+	{
+		n++;
+	}
+	assert(n == 3);
+
+	/* blocks of c which were occupied and are now empty are skipped */
+	for (bitset_iter_init(&iter, c, BITSET_ITER_ON);
+		 !bitset_iter_at_end(&iter);
+		 bitset_iter_next(&iter))
+	{
+		n++;
+	}
+	assert(n == 3);
+
+	/* inverting visits every block */
+	VERIFY(bitset_invert(b));
+	assert(bitset_set_count(b) == big - 2);
+
+	bitset_free(a);
+	bitset_free(b);
+	bitset_free(c);
+}
+
+/* check two bitsets have the same bits, without testing each bit of a
+ * large set */
+static void assert_same_set(struct bitset *a, struct bitset *b)
+{
+	struct bitset *c = NULL;
+
+	assert(bitset_bitcount(a) == bitset_bitcount(b));
+	VERIFY(bitset_dup(a, &c));
+	VERIFY(bitset_and(c, b));
+	assert(bitset_set_count(c) == bitset_set_count(a));
+	assert(bitset_set_count(c) == bitset_set_count(b));
+	bitset_free(c);
+}
+
+void test_sparse_blocks()
+{
+	struct bitset *a = NULL, *b = NULL, *c = NULL, *m = NULL;
+	struct bitset_intern *tbl = NULL;
+	struct bitset_iterator iter;
+	char path[] = "/tmp/bitset_test_XXXXXX";
+	int bits = IDSPERBLOCK * 1024;
+	int i, x, n, fd, allocs, bytes, allocs2, bytes2;
+	char *buf = NULL;
+	size_t size;
+
+	/* a large bitset starts with a directory sized by its occupied
+	 * blocks, not by its block count */
+	bitset_get_alloc_stats(&allocs, &bytes);
+	VERIFY(bitset_alloc(bits, &a));
+	bitset_get_alloc_stats(&allocs2, &bytes2);
+	assert(a->keys != NULL);
+	assert(bytes2 - bytes < 1024);
+
+	for (i = 0; i < 8; i++)
+		VERIFY(bitset_set(a, i * 100 * IDSPERBLOCK + i));
+	VERIFY(bitset_set(a, bits - 1));
+	VERIFY(bitset_clr(a, 0));
+	VERIFY(bitset_set(a, 0));
+	assert(a->keys != NULL && a->key_count == 9);
+	assert(bitset_set_count(a) == 9);
+	VERIFY(bitset_test_bit(a, 300 * IDSPERBLOCK + 3, &x));
+	assert(x == 1);
+	VERIFY(bitset_test_bit(a, 300 * IDSPERBLOCK + 4, &x));
+	assert(x == 0);
+
+	n = 0;
+	for (bitset_iter_init(&iter, a, BITSET_ITER_ON);
+		 !bitset_iter_at_end(&iter);
+		 bitset_iter_next(&iter))
+	{
+		n++;
+	}
+	assert(n == 9);
+
+	/* set operations add and drop keys */
+	VERIFY(bitset_alloc(bits, &b));
+	VERIFY(bitset_set(b, 100 * IDSPERBLOCK + 1));
+	VERIFY(bitset_set(b, 50 * IDSPERBLOCK));
+	VERIFY(bitset_dup(a, &c));
+	assert(c->keys != NULL);
+	VERIFY(bitset_or(c, b));
+	assert(bitset_set_count(c) == 10);
+	VERIFY(bitset_subtract(c, a));
+	assert(bitset_set_count(c) == 1);
+	VERIFY(bitset_test_bit(c, 50 * IDSPERBLOCK, &x));
+	assert(x == 1);
+	VERIFY(bitset_and(c, a));
+	assert(bitset_set_count(c) == 0);
+	bitset_free(c);
+	c = NULL;
+
+	/* save, mmap and roaring round trips */
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	VERIFY(bitset_save(a, fd));
+	lseek(fd, 0, SEEK_SET);
+	VERIFY(bitset_load(fd, &c));
+	close(fd);
+	assert(c->keys != NULL);
+	assert_same_set(a, c);
+	bitset_free(c);
+	c = NULL;
+
+	VERIFY(bitset_mmap(path, &m));
+	assert_same_set(a, m);
+	bitset_free(m);
+	m = NULL;
+	unlink(path);
+
+	VERIFY(bitset_to_roaring(a, &buf, &size));
+	VERIFY(bitset_from_roaring(buf, size, bits, &c));
+	free(buf);
+	assert(c->keys != NULL);
+	assert_same_set(a, c);
+
+	/* a diff only holds the changed blocks */
+	VERIFY(bitset_set(c, 200 * IDSPERBLOCK + 5));
+	VERIFY(bitset_clr(c, 700 * IDSPERBLOCK + 7));
+	VERIFY(bitset_set(c, 900 * IDSPERBLOCK));
+	VERIFY(bitset_diff_encode(a, c, &buf, &size));
+	assert(size < PAGESIZE * sizeof(uint64_t));
+	VERIFY(bitset_dup(a, &m));
+	VERIFY(bitset_diff_apply(m, buf, size));
+	free(buf);
+	assert_same_set(c, m);
+	bitset_free(m);
+	m = NULL;
+
+	/* equal blocks of sparse sets are shared */
+	VERIFY(bitset_set(b, 600 * IDSPERBLOCK + 6));
+	VERIFY(bitset_set(c, 600 * IDSPERBLOCK + 6));
+	VERIFY(bitset_intern_alloc(&tbl));
+	assert(bitset_dedupe(tbl, b) >= 0);
+	assert(bitset_dedupe(tbl, c) >= 1);
+	assert(bitset_block_lookup(b, 600) == bitset_block_lookup(c, 600));
+	bitset_intern_free(tbl);
+	bitset_free(b);
+	bitset_free(c);
+	b = NULL;
+	c = NULL;
+
+	/* shrinking drops the keys past the end, and growing keeps the rest */
+	VERIFY(bitset_resize(a, 500 * IDSPERBLOCK));
+	assert(a->keys != NULL && a->key_count == 5);
+	assert(bitset_set_count(a) == 5);
+	VERIFY(bitset_resize(a, bits));
+	assert(a->keys != NULL && bitset_set_count(a) == 5);
+	VERIFY(bitset_test_bit(a, bits - 1, &x));
+	assert(x == 0);
+
+	/* a directory with more than 1 in 16 blocks occupied is made dense */
+	for (i = 0; i < 1024; i += 8)
+		VERIFY(bitset_set(a, i * IDSPERBLOCK + 9));
+	assert(a->keys == NULL);
+	assert(bitset_set_count(a) == 5 + 128);
+	VERIFY(bitset_test_bit(a, 400 * IDSPERBLOCK + 4, &x));
+	assert(x == 1);
+
+	/* a dense directory grown large with few blocks occupied is made sparse */
+	VERIFY(bitset_alloc(IDSPERBLOCK * 10, &b));
+	assert(b->keys == NULL);
+	VERIFY(bitset_set(b, IDSPERBLOCK * 3 + 3));
+	VERIFY(bitset_resize(b, bits));
+	assert(b->keys != NULL && b->key_count == 1);
+	VERIFY(bitset_set(b, bits - 2));
+	assert(bitset_set_count(b) == 2);
+
+	/* concurrent inserts need a dense directory */
+	assert(bitset_set_concurrent(b, 1) == ERRINPUT);
+	VERIFY(bitset_set_dense(b));
+	assert(b->keys == NULL);
+	assert(bitset_set_count(b) == 2);
+	VERIFY(bitset_test_bit(b, IDSPERBLOCK * 3 + 3, &x));
+	assert(x == 1);
+
+	bitset_free(a);
+	bitset_free(b);
+}
+
+void test_resize()
+{
+	struct bitset *a = NULL, *b = NULL, *c = NULL;
+	int x;
+
+	VERIFY(bitset_alloc(IDSPERBLOCK * 2 + 100, &a));
+	VERIFY(bitset_set(a, 5));
+	VERIFY(bitset_set(a, IDSPERBLOCK * 2 + 99));
+	VERIFY(bitset_dup(a, &b));
+
+	/* growing keeps the blocks shared with the copy */
+	VERIFY(bitset_resize(a, IDSPERBLOCK * 10));
+	assert(bitset_bitcount(a) == IDSPERBLOCK * 10);
+	assert(a->blocks[0] == b->blocks[0]);
+	assert(bitset_set_count(a) == 2);
+	VERIFY(bitset_set(a, IDSPERBLOCK * 9));
+	VERIFY(bitset_test_bit(b, 5, &x));
+	assert(x == 1);
+
+	/* a larger bitset ORed into a smaller one only keeps the bits in range */
+	VERIFY(bitset_set(a, IDSPERBLOCK * 2 + 100));
+	VERIFY(bitset_or(b, a));
+	assert(bitset_set_count(b) == 2);
+
+	/* the missing blocks of a smaller operand count as empty */
+	VERIFY(bitset_dup(a, &c));
+	VERIFY(bitset_and(c, b));
+	assert(bitset_set_count(c) == 2);
+	VERIFY(bitset_subtract(a, b));
+	assert(bitset_set_count(a) == 2);
+	VERIFY(bitset_or(c, a));
+	assert(bitset_set_count(c) == 4);
+
+	/* shrinking drops the bits past the new end, even mid-block */
+	VERIFY(bitset_resize(c, IDSPERBLOCK * 2 + 100));
+	assert(bitset_set_count(c) == 2);
+	VERIFY(bitset_resize(c, IDSPERBLOCK * 3));
+	VERIFY(bitset_test_bit(c, IDSPERBLOCK * 2 + 100, &x));
+	assert(x == 0);
+	VERIFY(bitset_resize(c, 0));
+	assert(bitset_set_count(c) == 0);
+	assert(bitset_resize(c, -1) == ERRINPUT);
+
+	/* the tail is cleared in a copy of a shared last block */
+	bitset_free(b);
+	b = NULL;
+	VERIFY(bitset_set(a, IDSPERBLOCK * 9 + 5));
+	VERIFY(bitset_dup(a, &b));
+	VERIFY(bitset_resize(b, IDSPERBLOCK * 9 + 1));
+	assert(bitset_set_count(b) == bitset_set_count(a) - 1);
+	VERIFY(bitset_test_bit(a, IDSPERBLOCK * 9 + 5, &x));
+	assert(x == 1);
+
+	bitset_free(a);
+	bitset_free(b);
+	bitset_free(c);
+}
+
+void test_small()
+{
+	struct bitset *a = NULL, *b = NULL, *c = NULL, *big = NULL;
+	struct bitset_iterator iter;
+	char *buf = NULL;
+	size_t size;
+	int i, x, n, allocs, bytes, allocs2, bytes2;
+	int bits[] = { 900, 5, 70000 };
+
+	bitset_get_alloc_stats(&allocs, &bytes);
+	VERIFY(bitset_alloc_small(IDSPERBLOCK * 100, &a));
+	VERIFY(bitset_set(a, 3));
+	VERIFY(bitset_set_bulk(a, bits, 3));
+	VERIFY(bitset_toggle_bit(a, 3));
+	VERIFY(bitset_toggle_bit(a, 4));
+	VERIFY(bitset_clr(a, 900));
+
+	/* only the struct itself was allocated */
+	bitset_get_alloc_stats(&allocs2, &bytes2);
+	assert(bytes2 - bytes == sizeof(struct bitset));
+	assert(a->small && a->blocks == NULL);
+	assert(bitset_set_count(a) == 3);
+	VERIFY(bitset_test_bit(a, 70000, &x));
+	assert(x == 1);
+
+	n = 0;
+	for (bitset_iter_init(&iter, a, BITSET_ITER_ON);
+		 !bitset_iter_at_end(&iter);
+		 bitset_iter_next(&iter))
+	{
+		assert(bitset_iter_get(&iter) == 1);
+		assert(bitset_iter_index(&iter) == (n == 0 ? 4 : n == 1 ? 5 : 70000));
+		n++;
+	}
+	assert(n == 3);
+
+	/* operations with a large set probe it directly */
+	VERIFY(bitset_alloc(IDSPERBLOCK * 100, &big));
+	for (i = 0; i < IDSPERBLOCK * 2; i += 2)
+		VERIFY(bitset_set(big, i));
+
+	VERIFY(bitset_dup(a, &b));
+	VERIFY(bitset_and(b, big));
+	assert(b->small && bitset_set_count(b) == 2);
+	VERIFY(bitset_subtract(b, a));
+	assert(b->small && bitset_set_count(b) == 0);
+
+	VERIFY(bitset_dup(big, &c));
+	VERIFY(bitset_and(c, a));
+	assert(c->small && bitset_set_count(c) == 2);
+	bitset_free(c);
+	c = NULL;
+
+	VERIFY(bitset_dup(big, &c));
+	VERIFY(bitset_subtract(c, a));
+	assert(!c->small && bitset_set_count(c) == IDSPERBLOCK - 2);
+	VERIFY(bitset_or(c, a));
+	assert(bitset_set_count(c) == IDSPERBLOCK + 1);
+
+	/* exported in the block formats */
+	VERIFY(bitset_to_roaring(a, &buf, &size));
+	bitset_free(b);
+	b = NULL;
+	VERIFY(bitset_from_roaring(buf, size, IDSPERBLOCK * 100, &b));
+	assert(bitset_set_count(b) == 3);
+	free(buf);
+
+	/* the set moves to blocks once it overflows */
+	for (i = 0; i < BITSET_SMALL_IDS; i++)
+		VERIFY(bitset_set(a, 1000 + i));
+	assert(!a->small);
+	assert(bitset_set_count(a) == BITSET_SMALL_IDS + 3);
+	VERIFY(bitset_test_bit(a, 70000, &x));
+	assert(x == 1);
+
+	bitset_free(a);
+	bitset_free(b);
+	bitset_free(c);
+	bitset_free(big);
+}
+
+void test_fast()
+{
+	struct bitset *a = NULL, *b = NULL, *s = NULL;
+	int i;
+
+	VERIFY(bitset_alloc(IDSPERBLOCK * 3, &a));
+
+	/* the first write to a page goes through bitset_set */
+	for (i = 0; i < IDSPERBLOCK * 3; i += 7)
+		VERIFY(bitset_set_fast(a, i));
+	VERIFY(bitset_set_fast(a, 7));
+	assert(bitset_set_count(a) == (IDSPERBLOCK * 3 + 6) / 7);
+	for (i = 0; i < IDSPERBLOCK * 3; i++)
+		assert(bitset_test_fast(a, i) == (i % 7 == 0));
+
+	/* shared pages are still copied before a write */
+	VERIFY(bitset_dup(a, &b));
+	VERIFY(bitset_clr_fast(a, 14));
+	VERIFY(bitset_clr_fast(a, 15));
+	assert(bitset_test_fast(a, 14) == 0 && bitset_test_fast(b, 14) == 1);
+	assert(bitset_set_count(a) == bitset_set_count(b) - 1);
+
+	VERIFY(bitset_alloc_small(1000, &s));
+	VERIFY(bitset_set_fast(s, 500));
+	assert(bitset_test_fast(s, 500) && !bitset_test_fast(s, 499));
+
+	bitset_free(a);
+	bitset_free(b);
+	bitset_free(s);
+}
+
+void test_blocksize()
+{
+	struct bitset *a = NULL, *b = NULL, *c = NULL, *r = NULL;
+	struct bitset_iterator iter;
+	char *buf = NULL;
+	size_t size;
+	FILE *f;
+	int i, n, size_bits = IDSPERBLOCK * 3 + 100;
+
+	assert(bitset_alloc_blocksize(100, BLOCKSIZE + 1, &a) == ERRINPUT);
+	assert(bitset_alloc_blocksize(100, BITSET_MIN_BLOCKSIZE / 2, &a) == ERRINPUT);
+	assert(bitset_alloc_blocksize(100, BITSET_MAX_BLOCKSIZE * 2, &a) == ERRINPUT);
+	assert(a == NULL);
+
+	/* one page blocks, and the largest blocks, against the default */
+	VERIFY(bitset_alloc_blocksize(size_bits, BITSET_MIN_BLOCKSIZE, &a));
+	VERIFY(bitset_alloc_blocksize(size_bits, BITSET_MAX_BLOCKSIZE, &b));
+	VERIFY(bitset_alloc(size_bits, &c));
+	assert(a->block_count == (size_bits + IDSPERPAGE - 1) / IDSPERPAGE && b->block_count == 2);
+
+	for (i = 0; i < size_bits; i += 5)
+		VERIFY(bitset_set(a, i));
+	for (i = 0; i < size_bits; i += 3)
+		VERIFY(bitset_set_fast(b, i));
+	for (i = IDSPERBLOCK; i < size_bits; i += 2)
+		VERIFY(bitset_set(c, i));
+	assert(bitset_set_count(a) == (size_bits + 4) / 5);
+	assert(bitset_test_fast(b, IDSPERBLOCK * 3 + 99) && !bitset_test_fast(b, IDSPERBLOCK * 3 + 98));
+
+	n = 0;
+	for (bitset_iter_init(&iter, a, BITSET_ITER_ON); !bitset_iter_at_end(&iter); bitset_iter_next(&iter))
+		assert(bitset_iter_index(&iter) == 5 * n++);
+	assert(n == bitset_set_count(a));
+
+	/* operations across block sizes keep the block size of A */
+	VERIFY(bitset_intersect(a, b, &r));
+	assert(r->block_shift == a->block_shift && bitset_set_count(r) == (size_bits + 14) / 15);
+	VERIFY(bitset_or(r, c));
+	VERIFY(bitset_subtract(r, b));
+	for (i = 0; i < size_bits; i++)
+		assert(bitset_test_fast(r, i) == ((i % 15 == 0 || (i >= IDSPERBLOCK && i % 2 == 0)) && i % 3 != 0));
+	bitset_free(r);
+	r = NULL;
+
+	/* the block size is saved with the bitset */
+	f = tmpfile();
+	assert(f != NULL);
+	VERIFY(bitset_save(a, fileno(f)));
+	lseek(fileno(f), 0, SEEK_SET);
+	VERIFY(bitset_load(fileno(f), &r));
+	assert(r->block_shift == a->block_shift);
+	assert_same_bits(a, r);
+	fclose(f);
+	bitset_free(r);
+	r = NULL;
+
+	/* roaring containers are always default sized blocks */
+	VERIFY(bitset_to_roaring(b, &buf, &size));
+	VERIFY(bitset_from_roaring(buf, size, size_bits, &r));
+	assert_same_bits(b, r);
+	free(buf);
+	bitset_free(r);
+
+	bitset_free(a);
+	bitset_free(b);
+	bitset_free(c);
+}
+
+void test_stats()
+{
+	struct bitset *a = NULL, *b = NULL;
+	struct bitset_stats st;
+	int i;
+
+	/* the counters are only kept when the library is built with them */
+	if (bitset_get_stats(NULL, &st) == ERRNOTIMPL)
+	{
+		assert(bitset_reset_stats(NULL) == ERRNOTIMPL);
+		return;
+	}
+
+	VERIFY(bitset_reset_stats(NULL));
+	VERIFY(bitset_alloc(IDSPERBLOCK * 8, &a));
+	for (i = 0; i < 4; i++)
+		VERIFY(bitset_set(a, i * IDSPERBLOCK));
+	VERIFY(bitset_get_stats(a, &st));
+	assert(st.blocks_allocated == 4 && st.blocks_copied == 0);
+
+	/* writing to a copy copies the block and then the page */
+	VERIFY(bitset_dup(a, &b));
+	VERIFY(bitset_set(b, 1));
+	VERIFY(bitset_get_stats(b, &st));
+	assert(st.blocks_allocated == 0 && st.blocks_copied == 1);
+	VERIFY(bitset_get_stats(NULL, &st));
+	assert(st.blocks_allocated == 4 && st.pages_allocated == 5 && st.pages_copied == 1);
+	assert(st.bytes_copied == sizeof(struct bitset_page *) * PAGECOUNT + sizeof(uint64_t) * PAGESIZE);
+
+	/* the OR only runs the kernel on the block which differs */
+	VERIFY(bitset_reset_stats(a));
+	VERIFY(bitset_or(a, b));
+	VERIFY(bitset_get_stats(a, &st));
+	assert(st.or_blocks == 1 && st.shared_skips == 3 && st.null_skips == 4);
+	assert(bitset_set_count(a) == 5);
+	VERIFY(bitset_get_stats(NULL, &st));
+	assert(st.or_blocks == 1 && st.page_kernels == 1);
+
+	bitset_free(a);
+	bitset_free(b);
+
+	VERIFY(bitset_get_stats(NULL, &st));
+	assert(st.blocks_freed == 5 && st.pages_freed == 5);
+
+	VERIFY(bitset_reset_stats(NULL));
+	VERIFY(bitset_get_stats(NULL, &st));
+	assert(st.blocks_allocated == 0 && st.pages_copied == 0);
+}
+
 void test_iter_all()
 {
 	struct bitset *b = NULL;
@@ -668,11 +2060,31 @@ int main(int argc, char **argv)
 	RUN_TEST(test_set_all_bits);
 	RUN_TEST(test_clear_bit);
 	RUN_TEST(test_toggle_bit);
+	RUN_TEST(test_set_concurrent);
 	RUN_TEST(test_dup);
+	RUN_TEST(test_page_cow);
+	RUN_TEST(test_threadsafe_dup);
+	RUN_TEST(test_snapshot);
 	RUN_TEST(test_or);
 	RUN_TEST(test_and);
 	RUN_TEST(test_subtract);
 	RUN_TEST(test_invert);
+	RUN_TEST(test_set_bulk);
+	RUN_TEST(test_parallel_ops);
+	RUN_TEST(test_save_load);
+	RUN_TEST(test_mmap);
+	RUN_TEST(test_shm);
+	RUN_TEST(test_roaring);
+	RUN_TEST(test_journal);
+	RUN_TEST(test_diff);
+	RUN_TEST(test_dedupe);
+	RUN_TEST(test_sparse_directory);
+	RUN_TEST(test_sparse_blocks);
+	RUN_TEST(test_resize);
+	RUN_TEST(test_small);
+	RUN_TEST(test_fast);
+	RUN_TEST(test_blocksize);
+	RUN_TEST(test_stats);
 	RUN_TEST(test_iter_all);
 	RUN_TEST(test_iter_on);
 
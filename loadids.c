@@ -1,78 +1,927 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "bitset.h"
 
-int main(int argc, char **argv)
+#define MAXTHREADS	64
+
+/* number of IDs parsed before they are inserted into the bitset */
+#define BATCHSIZE	65536
+
+/* size of the reads done when the input is not a regular file */
+#define READSIZE	(4*1024*1024)
+
+/* input formats */
+#define FMT_TEXT	0	/* one decimal ID per line */
+#define FMT_U32		1	/* little-endian uint32 IDs */
+#define FMT_U64		2	/* little-endian uint64 IDs */
+#define FMT_VARINT	3	/* sorted IDs as LEB128 varint deltas from the previous ID */
+
+/* a binary input may start with a magic header naming its format */
+#define MAGICLEN	8
+
+static const char *format_names[] = { "text", "u32", "u64", "varint" };
+static const char *format_magic[] = { NULL, "BSIDU32\n", "BSIDU64\n", "BSIDVAR\n" };
+
+/* a loader thread parses and inserts the IDs in one chunk of the input */
+struct loader {
+	/* the chunk [start, end) of the input to load.  the chunk starts at the
+	 * beginning of a line and ends after a newline or at the end of input */
+	const char *start;
+	const char *end;
+
+	/* the format of the input and, for varint input, the last ID decoded */
+	int format;
+	uint64_t prev;
+
+	/* the start of the input, and the number of lines and bytes before it,
+	 * used to find where in the input a bad ID is */
+	const char *base;
+	long base_line;
+	long base_offset;
+
+	/* the bitset the IDs go into, and whether it is shared with the other
+	 * loader threads */
+	struct bitset *bset;
+	int shared;
+
+	/* IDs parsed but not yet inserted */
+	int *batch;
+	int batch_count;
+
+	/* results */
+	int ids;
+	double parse_time;
+	double insert_time;
+	int ret;
+
+	pthread_t thread;
+};
+
+static int maxid = 999999999;
+
+static double now(void)
 {
-	FILE *in = NULL;
-	char *p, line[80];
-	int i, j, id, ids, bs, bc, fb, err;
-	int allocs, bytes_allocated;
-	int ret = 0;
-	struct bitset *bset = NULL;
-	struct bitset_block *blk;
-	int maxid = 999999999;
+	struct timespec ts;
 
-	printf("BlockSize = %d, IdsPerBlock = %d, IdCount = %d, BlockCount = %d\n", 
-		BLOCKSIZE, IDSPERBLOCK, maxid+1, BLOCKCOUNT(maxid+1));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-	printf("sizeof bitset_block = %lu, sizeof bitset = %lu\n", sizeof(struct bitset_block), sizeof(struct bitset));
+static double rate(int n, double t)
+{
+	return t > 0 ? n / t / 1e6 : 0;
+}
 
-	ret = bitset_alloc(maxid+1, &bset);
-	if (ret != OK) 
+/* test if all 8 bytes of v are ASCII digits */
+static inline int is_eight_digits(uint64_t v)
+{
+	return ((v & 0xf0f0f0f0f0f0f0f0ull) |
+		(((v + 0x0606060606060606ull) & 0xf0f0f0f0f0f0f0f0ull) >> 4)) == 0x3333333333333333ull;
+}
+
+/* convert 8 ASCII digits loaded little-endian into v to their value, using
+ * three multiplies instead of eight */
+static inline uint32_t parse_eight_digits(uint64_t v)
+{
+	const uint64_t mask = 0x000000ff000000ffull;
+	const uint64_t mul1 = 100 + (1000000ull << 32);
+	const uint64_t mul2 = 1 + (10000ull << 32);
+
+	v -= 0x3030303030303030ull;
+	v = (v * 10) + (v >> 8);
+	v = (((v & mask) * mul1) + (((v >> 16) & mask) * mul2)) >> 32;
+
+	return (uint32_t)v;
+}
+
+/* parse the line [p, eol) as an ID.  the line must hold only decimal digits,
+ * optionally followed by a carriage return.  returns 0 on success, 1 if the
+ * line is not a number and 2 if the number is out of range */
+static int parse_id(const char *p, const char *eol, int *id_out)
+{
+	uint64_t v, id = 0;
+
+	if (eol > p && eol[-1] == '\r')
+		eol--;
+
+	if (p == eol)
+		return 1;
+
+	/* an ID never has more than 16 digits, so anything longer is out of
+	 * range if it is a number at all */
+	if (eol - p > 16)
 	{
-		printf("Error %d allocating bitset\n", ret);
-		return ret;
+		for (; p < eol; p++)
+		{
+			if (*p < '0' || *p > '9')
+				return 1;
+		}
+		return 2;
 	}
 
-	if (argc != 2)
+	if (eol - p >= 8)
 	{
-		in = stdin;
+		memcpy(&v, p, sizeof(v));
+		if (!is_eight_digits(v))
+			return 1;
+		id = parse_eight_digits(v);
+		p += 8;
 	}
+
+	for (; p < eol; p++)
+	{
+		if (*p < '0' || *p > '9')
+			return 1;
+		id = id * 10 + (*p - '0');
+	}
+
+	if (id > (uint64_t)maxid)
+		return 2;
+
+	*id_out = (int)id;
+	return 0;
+}
+
+/* report a line that could not be loaded */
+static void bad_line(struct loader *ld, const char *line, const char *eol, int err)
+{
+	const char *p;
+	long n = ld->base_line + 1;
+
+	/* only count lines once something has gone wrong */
+	for (p = ld->base; (p = memchr(p, '\n', line - p)) != NULL; p++)
+		n++;
+
+	if (err == 1)
+		fprintf(stderr, "line %ld: cannot parse '%.*s' as integer\n", n, (int)(eol - line), line);
 	else
+		fprintf(stderr, "line %ld: id '%.*s' out of range\n", n, (int)(eol - line), line);
+}
+
+/* in partition mode the IDs are not inserted as they are parsed.  they are
+ * split by block into PARTITIONS ranges of blocks, each small enough for its
+ * words to stay in cache, and held in a bounded buffer per partition which
+ * is spilled to a temp file when it fills.  once the input is read each
+ * partition is inserted in turn, in sorted chunks, so the inserts touch one
+ * small range of blocks at a time however the input is ordered */
+#define PARTITIONS	256
+
+struct partitions {
+	/* blocks in each partition, and the number of IDs buffered for each */
+	int blocks;
+	int cap;
+
+	/* the buffers, cap IDs per partition, and how full each one is */
+	int *ids;
+	int fill[PARTITIONS];
+
+	/* the temp file for each partition, opened when its buffer first fills */
+	FILE *spill[PARTITIONS];
+	long spilled;
+};
+
+static struct partitions *partitions = NULL;
+
+/* set up partition mode using about mb megabytes for the buffers */
+static int partitions_init(int bitcount, int mb)
+{
+	struct partitions *pt;
+
+	if ((pt = (struct partitions *)calloc(1, sizeof(struct partitions))) == NULL)
+		return ERRMEM;
+
+	pt->blocks = (BLOCKCOUNT(bitcount) + PARTITIONS - 1) / PARTITIONS;
+	pt->cap = (int)((size_t)mb * 1024 * 1024 / sizeof(int) / PARTITIONS);
+	if (pt->cap < 1024)
+		pt->cap = 1024;
+
+	if ((pt->ids = (int *)malloc(sizeof(int) * pt->cap * PARTITIONS)) == NULL)
+	{
+		free(pt);
+		return ERRMEM;
+	}
+
+	partitions = pt;
+
+	return 0;
+}
+
+/* write the buffer of partition i to its temp file */
+static int partition_spill(struct partitions *pt, int i)
+{
+	if (pt->spill[i] == NULL && (pt->spill[i] = tmpfile()) == NULL)
+	{
+		fprintf(stderr, "cannot create a temp file\n");
+		return 1;
+	}
+
+	if (fwrite(pt->ids + (size_t)i * pt->cap, sizeof(int), pt->fill[i], pt->spill[i]) != (size_t)pt->fill[i])
+	{
+		fprintf(stderr, "error writing a temp file\n");
+		return 1;
+	}
+
+	pt->spilled += pt->fill[i];
+	pt->fill[i] = 0;
+
+	return 0;
+}
+
+/* add n IDs to their partitions */
+static int partition_ids(struct partitions *pt, const int *ids, int n)
+{
+	int i, p, ret;
+
+	for (i = 0; i < n; i++)
 	{
-		in = fopen(argv[1], "r");
-		if (in == NULL) 
+		p = ids[i] / IDSPERBLOCK / pt->blocks;
+		if (pt->fill[p] == pt->cap && (ret = partition_spill(pt, p)) != 0)
+			return ret;
+		pt->ids[(size_t)p * pt->cap + pt->fill[p]++] = ids[i];
+	}
+
+	return 0;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+	int x = *(const int *)a, y = *(const int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* sort n IDs and insert them */
+static int partition_insert(struct bitset *bset, int *ids, int n)
+{
+	int err;
+
+	qsort(ids, n, sizeof(int), compare_ids);
+	if ((err = bitset_set_bulk(bset, ids, n)) != OK)
+	{
+		fprintf(stdout, "Error %d in bitset_set\n", err);
+		return err;
+	}
+
+	return 0;
+}
+
+/* insert every partition into bset, one after another, and free them.  if
+ * bset is NULL the partitions are only freed */
+static int partitions_finish(struct partitions *pt, struct bitset *bset)
+{
+	double t = now();
+	int i, n, ret = 0;
+	int *buf;
+
+	for (i = 0; bset != NULL && i < PARTITIONS; i++)
+	{
+		buf = pt->ids + (size_t)i * pt->cap;
+
+		/* the buffer holds the last IDs, so insert them before it is reused
+		 * to read back the spilled ones */
+		if ((ret = partition_insert(bset, buf, pt->fill[i])) != 0)
+			break;
+
+		if (pt->spill[i] == NULL)
+			continue;
+
+		rewind(pt->spill[i]);
+		while (ret == 0 && (n = fread(buf, sizeof(int), pt->cap, pt->spill[i])) > 0)
+			ret = partition_insert(bset, buf, n);
+	}
+
+	if (bset != NULL)
+		printf("partitioned insert: %0.3f s, %ld ids spilled to temp files\n", now() - t, pt->spilled);
+
+	for (i = 0; i < PARTITIONS; i++)
+	{
+		if (pt->spill[i] != NULL)
+			fclose(pt->spill[i]);
+	}
+	free(pt->ids);
+	free(pt);
+
+	return ret;
+}
+
+/* insert the batch of parsed IDs into the loader's bitset */
+static int insert_batch(struct loader *ld)
+{
+	int i, err = OK;
+	double t = now();
+
+	if (partitions != NULL)
+	{
+		if ((err = partition_ids(partitions, ld->batch, ld->batch_count)) != 0)
+			return err;
+	}
+	else if (ld->shared)
+	{
+		for (i = 0; i < ld->batch_count; i++)
 		{
-			fprintf(stderr, "cannot open %s\n", argv[1]);
-			return 1;
+			if ((err = bitset_set_concurrent(ld->bset, ld->batch[i])) != OK)
+				break;
+		}
+	}
+	else
+	{
+		err = bitset_set_bulk(ld->bset, ld->batch, ld->batch_count);
+	}
+
+	if (err != OK)
+	{
+		fprintf(stdout, "Error %d in bitset_set\n", err);
+		return err;
+	}
+
+	ld->insert_time += now() - t;
+	ld->ids += ld->batch_count;
+	ld->batch_count = 0;
+
+	return 0;
+}
+
+/* add an ID to the batch, inserting the batch if it is full.  *t is the
+ * time parsing of the batch started */
+static inline int add_id(struct loader *ld, int id, double *t)
+{
+	int ret;
+
+	ld->batch[ld->batch_count] = id;
+	if (++ld->batch_count < BATCHSIZE)
+		return 0;
+
+	ld->parse_time += now() - *t;
+	ret = insert_batch(ld);
+	*t = now();
+
+	return ret;
+}
+
+/* parse the lines in [p, end) into batches of IDs, inserting each batch as
+ * it fills.  unless final is set, a last line without a newline is left
+ * for the next call.  *stop is set to the first byte not loaded */
+static int load_text(struct loader *ld, const char *p, const char *end, int final, const char **stop)
+{
+	const char *eol;
+	double t = now();
+	int id, ret = 0;
+
+	for (; p < end; p = eol + 1)
+	{
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+		{
+			if (!final)
+				break;
+			eol = end;
+		}
+
+		if ((ret = parse_id(p, eol, &id)) != 0)
+		{
+			bad_line(ld, p, eol, ret);
+			return 2;
+		}
+
+		if ((ret = add_id(ld, id, &t)) != 0)
+			return ret;
+	}
+
+	ld->parse_time += now() - t;
+	*stop = p < end ? p : end;
+
+	return 0;
+}
+
+/* report a binary ID that could not be loaded */
+static int bad_id(struct loader *ld, const char *p, uint64_t id)
+{
+	fprintf(stderr, "offset %ld: id %llu out of range\n",
+		ld->base_offset + (long)(p - ld->base), (unsigned long long)id);
+	return 2;
+}
+
+/* load raw little-endian IDs of width bytes from [p, end) */
+static int load_raw(struct loader *ld, const char *p, const char *end, int width, int final, const char **stop)
+{
+	uint32_t v32;
+	uint64_t v;
+	double t = now();
+	int ret;
+
+	for (; end - p >= width; p += width)
+	{
+		if (width == 4)
+		{
+			memcpy(&v32, p, sizeof(v32));
+			v = le32toh(v32);
+		}
+		else
+		{
+			memcpy(&v, p, sizeof(v));
+			v = le64toh(v);
+		}
+
+		if (v > (uint64_t)maxid)
+			return bad_id(ld, p, v);
+
+		if ((ret = add_id(ld, (int)v, &t)) != 0)
+			return ret;
+	}
+
+	ld->parse_time += now() - t;
+	*stop = p;
+
+	if (final && p != end)
+	{
+		fprintf(stderr, "input ends with a partial %d byte id\n", width);
+		return 2;
+	}
+
+	return 0;
+}
+
+/* load varint delta coded IDs from [p, end) */
+static int load_varint(struct loader *ld, const char *p, const char *end, int final, const char **stop)
+{
+	const unsigned char *q;
+	uint64_t v;
+	double t = now();
+	int shift, ret;
+
+	for (; p < end; p = (const char *)q)
+	{
+		/* decode one varint, stopping if it runs past the end of the data */
+		v = 0;
+		for (q = (const unsigned char *)p, shift = 0; q < (const unsigned char *)end && shift < 64; shift += 7)
+		{
+			v |= (uint64_t)(*q & 0x7f) << shift;
+			if ((*q++ & 0x80) == 0)
+				break;
 		}
+
+		if (shift >= 64)
+			return bad_id(ld, p, v);
+		if (q == (const unsigned char *)end && (q[-1] & 0x80))
+			break;
+
+		if (v > (uint64_t)maxid - ld->prev)
+			return bad_id(ld, p, ld->prev + v);
+		ld->prev += v;
+
+		if ((ret = add_id(ld, (int)ld->prev, &t)) != 0)
+			return ret;
+	}
+
+	ld->parse_time += now() - t;
+	*stop = p;
+
+	if (final && p != end)
+	{
+		fprintf(stderr, "input ends with a partial varint\n");
+		return 2;
 	}
 
-	printf("Loading IDs into bitset\n");
+	return 0;
+}
+
+/* load the IDs in [p, end) in the loader's format */
+static int load_data(struct loader *ld, const char *p, const char *end, int final, const char **stop)
+{
+	switch (ld->format)
+	{
+	case FMT_U32:
+		return load_raw(ld, p, end, 4, final, stop);
+	case FMT_U64:
+		return load_raw(ld, p, end, 8, final, stop);
+	case FMT_VARINT:
+		return load_varint(ld, p, end, final, stop);
+	default:
+		return load_text(ld, p, end, final, stop);
+	}
+}
+
+static void *loader_thread(void *arg)
+{
+	struct loader *ld = (struct loader *)arg;
+	const char *stop;
+
+	if ((ld->ret = load_data(ld, ld->start, ld->end, 1, &stop)) == 0)
+		ld->ret = insert_batch(ld);
+
+	return NULL;
+}
+
+/* look for a magic header at the start of the input.  returns the length
+ * of the header, or -1 if it contradicts the format given on the command
+ * line */
+static int detect_format(const char *p, size_t n, int *format)
+{
+	int f;
+
+	for (f = FMT_U32; f <= FMT_VARINT; f++)
+	{
+		if (n >= MAGICLEN && memcmp(p, format_magic[f], MAGICLEN) == 0)
+		{
+			if (*format != -1 && *format != f)
+			{
+				fprintf(stderr, "input has a %s header but %s format was given\n",
+					format_names[f], format_names[*format]);
+				return -1;
+			}
+			*format = f;
+			return MAGICLEN;
+		}
+	}
+
+	if (*format == -1)
+		*format = FMT_TEXT;
+
+	return 0;
+}
+
+/* find the start of the first line at or after p */
+static const char *line_start(const char *base, const char *p, const char *end)
+{
+	if (p == base || p[-1] == '\n')
+		return p;
+
+	if ((p = memchr(p, '\n', end - p)) == NULL)
+		return end;
+
+	return p + 1;
+}
+
+/* load a memory mapped file with nthreads loader threads.  each thread
+ * inserts into its own bitset which is merged into bset at the end, unless
+ * shared is set in which case they all insert into bset concurrently */
+static int load_parallel(const char *data, size_t size, int format, int nthreads, int shared, struct bitset *bset, int *ids)
+{
+	struct loader loaders[MAXTHREADS];
+	double t, parse = 0, insert = 0, merge;
+	int i, ret = 0, started = 0, hdr;
+	size_t width, split;
+
+	memset(loaders, 0, sizeof(loaders));
+
+	if ((hdr = detect_format(data, size, &format)) < 0)
+		return 2;
+
+	/* a varint stream can only be decoded from the start */
+	if (format == FMT_VARINT)
+		nthreads = 1;
+
+	/* split the file into chunks at line or ID boundaries */
+	width = format == FMT_U32 ? 4 : 8;
+	for (i = 0; i < nthreads; i++)
+	{
+		loaders[i].format = format;
+		loaders[i].base = data;
+		loaders[i].start = i == 0 ? data + hdr : loaders[i-1].end;
+
+		split = hdr + (size - hdr) * (i + 1) / nthreads;
+		if (format == FMT_TEXT)
+			loaders[i].end = line_start(data, data + split, data + size);
+		else if (i == nthreads - 1)
+			loaders[i].end = data + size;
+		else
+			loaders[i].end = data + split - (split - hdr) % width;
+	}
 
-	ids = 0;
-	while (fgets(line, sizeof(line)-1, in) != NULL) 
+	if (shared)
 	{
-		id = strtoul(line, &p, 10);
-		if (p == line)
+		/* blocks can only be installed concurrently in a dense directory */
+		if ((ret = bitset_set_dense(bset)) != OK)
 		{
-			fprintf(stderr, "cannot parse %s as integer\n", line);
-			ret = 2;
+			printf("Error %d allocating the block directory\n", ret);
+			return ret;
+		}
+		bitset_set_threadsafe(1);
+	}
+	else if (nthreads > 1)
+	{
+		/* let the merge use the thread pool */
+		bitset_set_threads(nthreads, 64);
+	}
+
+	t = now();
+	for (i = 0; i < nthreads; i++)
+	{
+		if (shared || nthreads == 1)
+		{
+			loaders[i].bset = bset;
+			loaders[i].shared = shared;
+		}
+		else if ((ret = bitset_alloc(bitset_bitcount(bset), &loaders[i].bset)) != OK)
+		{
+			printf("Error %d allocating bitset\n", ret);
+			break;
+		}
+
+		if ((loaders[i].batch = (int *)malloc(sizeof(int) * BATCHSIZE)) == NULL)
+		{
+			ret = ERRMEM;
+			break;
+		}
+
+		if (pthread_create(&loaders[i].thread, NULL, loader_thread, &loaders[i]) != 0)
+		{
+			fprintf(stderr, "cannot start loader thread\n");
+			ret = 1;
+			break;
+		}
+		started++;
+	}
+
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(loaders[i].thread, NULL);
+		if (ret == 0)
+			ret = loaders[i].ret;
+	}
+	printf("parse and insert: %0.3f s\n", now() - t);
+
+	*ids = 0;
+	for (i = 0; i < started; i++)
+	{
+		printf("thread %d: %d ids, parse %0.3f s (%0.2f M ids/s), insert %0.3f s (%0.2f M ids/s)\n",
+			i, loaders[i].ids,
+			loaders[i].parse_time, rate(loaders[i].ids, loaders[i].parse_time),
+			loaders[i].insert_time, rate(loaders[i].ids, loaders[i].insert_time));
+		*ids += loaders[i].ids;
+		parse += loaders[i].parse_time;
+		insert += loaders[i].insert_time;
+	}
+	printf("total: %d ids, parse %0.2f M ids/s per thread, insert %0.2f M ids/s per thread\n",
+		*ids, rate(*ids, parse), rate(*ids, insert));
+
+	/* merge the private bitsets */
+	t = now();
+	for (i = 0; i < nthreads; i++)
+	{
+		if (loaders[i].bset != NULL && loaders[i].bset != bset)
+		{
+			if (ret == 0 && (ret = bitset_or(bset, loaders[i].bset)) != OK)
+				printf("Error %d in bitset_or\n", ret);
+			bitset_free(loaders[i].bset);
+		}
+		free(loaders[i].batch);
+	}
+	merge = now() - t;
+	if (!shared && nthreads > 1)
+		printf("merge: %0.3f s\n", merge);
+
+	return ret;
+}
+
+/* load IDs from a stream which cannot be mapped, using large reads */
+static int load_stream(int fd, int format, struct bitset *bset, int *ids)
+{
+	struct loader ld;
+	char *buf = NULL, *p;
+	const char *stop;
+	size_t have = 0, cap = READSIZE;
+	ssize_t got;
+	double t = now();
+	int ret = 0, hdr;
+
+	memset(&ld, 0, sizeof(ld));
+	ld.bset = bset;
+	ld.format = -1;
+
+	buf = (char *)malloc(cap);
+	ld.batch = (int *)malloc(sizeof(int) * BATCHSIZE);
+	if (buf == NULL || ld.batch == NULL)
+	{
+		ret = ERRMEM;
+		goto exit;
+	}
+
+	for (;;)
+	{
+		/* a line longer than the buffer needs a bigger buffer */
+		if (have == cap)
+		{
+			cap *= 2;
+			if ((p = (char *)realloc(buf, cap)) == NULL)
+			{
+				ret = ERRMEM;
+				goto exit;
+			}
+			buf = p;
+		}
+
+		if ((got = read(fd, buf + have, cap - have)) < 0)
+		{
+			fprintf(stderr, "error reading input\n");
+			ret = 1;
 			goto exit;
 		}
+		have += got;
 
-		if (id < 0 || id > maxid) 
+		/* the format is known once the first bytes are in */
+		p = buf;
+		if (ld.format == -1)
 		{
-			fprintf(stderr, "id %d out of range\n", id);
-			ret = 2;
+			if (have < MAGICLEN && got > 0)
+				continue;
+
+			ld.format = format;
+			if ((hdr = detect_format(buf, have, &ld.format)) < 0)
+			{
+				ret = 2;
+				goto exit;
+			}
+			p += hdr;
+			ld.base_offset = hdr;
+		}
+
+		/* load what is complete and keep any partial line or ID */
+		ld.base = p;
+		if ((ret = load_data(&ld, p, buf + have, got == 0, &stop)) != 0)
 			goto exit;
+		if (got == 0)
+			break;
+
+		for (; (p = memchr(p, '\n', stop - p)) != NULL; p++)
+			ld.base_line++;
+		ld.base_offset += stop - ld.base;
+
+		have = buf + have - stop;
+		memmove(buf, stop, have);
+	}
+
+	if ((ret = insert_batch(&ld)) != 0)
+		goto exit;
+
+	*ids = ld.ids;
+
+	t = now() - t;
+	printf("read, parse and insert: %0.3f s (%0.2f M ids/s)\n", t, rate(*ids, t));
+	printf("parse %0.3f s (%0.2f M ids/s), insert %0.3f s (%0.2f M ids/s)\n",
+		ld.parse_time, rate(*ids, ld.parse_time),
+		ld.insert_time, rate(*ids, ld.insert_time));
+
+exit:
+	free(buf);
+	free(ld.batch);
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t threads] [-s] [-m mb] [-f format] [file]\n", prog);
+	fprintf(stderr, "  -t threads  load the file with this many threads\n");
+	fprintf(stderr, "  -s          threads insert into one shared bitset instead of merging\n");
+	fprintf(stderr, "  -m mb       partition the IDs by block using mb megabytes of buffers,\n");
+	fprintf(stderr, "              spilling to temp files, and insert a partition at a time.\n");
+	fprintf(stderr, "              for large unsorted input.  loads with one thread\n");
+	fprintf(stderr, "  -f format   input format: text (one decimal ID per line), u32 or u64\n");
+	fprintf(stderr, "              (raw little-endian IDs) or varint (sorted IDs as LEB128\n");
+	fprintf(stderr, "              deltas).  binary input may instead start with a BSIDU32,\n");
+	fprintf(stderr, "              BSIDU64 or BSIDVAR header line.  the default is text\n");
+	fprintf(stderr, "input is read from stdin if no file is given\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct stat st;
+	char *data = NULL;
+	int fd = -1;
+	int i, j, ids, bs, bc, fb, opt;
+	int allocs, bytes_allocated;
+	int nthreads = 1, shared = 0, format = -1, mb = 0;
+	int ret = 0;
+	struct bitset *bset = NULL;
+	struct bitset_block *blk;
+
+	while ((opt = getopt(argc, argv, "t:sm:f:")) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAXTHREADS)
+			{
+				fprintf(stderr, "threads must be 1 - %d\n", MAXTHREADS);
+				return 1;
+			}
+			break;
+
+		case 's':
+			shared = 1;
+			break;
+
+		case 'm':
+			mb = atoi(optarg);
+			if (mb < 1)
+			{
+				fprintf(stderr, "mb must be at least 1\n");
+				return 1;
+			}
+			break;
+
+		case 'f':
+			for (format = FMT_TEXT; format <= FMT_VARINT; format++)
+			{
+				if (strcmp(optarg, format_names[format]) == 0)
+					break;
+			}
+			if (format > FMT_VARINT)
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		default:
+			usage(argv[0]);
+			return 1;
 		}
+	}
 
-#if 0
-		printf("setting bit %d of long %d to on\n", id%64, id/64);
-#endif
-		if ((err = bitset_set(bset, id)) != OK) 
+	if (argc - optind > 1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("BlockSize = %d, IdsPerBlock = %d, IdCount = %d, BlockCount = %d\n",
+		BLOCKSIZE, IDSPERBLOCK, maxid+1, BLOCKCOUNT(maxid+1));
+
+	printf("sizeof bitset_block = %lu, sizeof bitset = %lu\n", sizeof(struct bitset_block), sizeof(struct bitset));
+
+	ret = bitset_alloc(maxid+1, &bset);
+	if (ret != OK)
+	{
+		printf("Error %d allocating bitset\n", ret);
+		return ret;
+	}
+
+	/* the partitions are filled by a single loader */
+	if (mb > 0)
+	{
+		if ((ret = partitions_init(maxid+1, mb)) != 0)
 		{
-			fprintf(stdout, "Error %d in bitset_set\n", err);
-			return err;
+			printf("Error %d allocating partitions\n", ret);
+			goto exit;
 		}
+		nthreads = 1;
+		shared = 0;
+	}
+
+	if (optind == argc)
+	{
+		fd = 0;
+	}
+	else if ((fd = open(argv[optind], O_RDONLY)) < 0)
+	{
+		fprintf(stderr, "cannot open %s\n", argv[optind]);
+		ret = 1;
+		goto exit;
+	}
+
+	/* map regular files so the loaders parse straight out of the page cache */
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+			data = NULL;
+		else
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	if (data != NULL)
+	{
+		printf("Loading IDs into bitset with %d threads\n", nthreads);
+		ret = load_parallel(data, st.st_size, format, nthreads, shared, bset, &ids);
+	}
+	else
+	{
+		printf("Loading IDs into bitset\n");
+		ret = load_stream(fd, format, bset, &ids);
+	}
+
+	if (ret != 0)
+		goto exit;
 
-		ids++;
+	if (partitions != NULL)
+	{
+		ret = partitions_finish(partitions, bset);
+		partitions = NULL;
+		if (ret != 0)
+			goto exit;
 	}
 
 #if 0
@@ -82,11 +931,11 @@ int main(int argc, char **argv)
 	bc = 0;
 	fb = 0;
 
-	for (i = 0; i < BLOCKCOUNT; i++) 
+	for (i = 0; i < BLOCKCOUNT; i++)
 	{
-		if (bset->blocks[i] != NULL)
+		if (bitset_block_lookup(bset, i) != NULL)
 		{
-			blk = bset->blocks[i];
+			blk = bitset_block_lookup(bset, i);
 
 			fb++;
 
@@ -101,7 +950,7 @@ int main(int argc, char **argv)
 
 			printf("block %4d [%09d - %09d]: %5d filled\n",
 				i, i*IDSPERBLOCK, ((i+1)*IDSPERBLOCK)-1, bc);
-		} 
+		}
 		else
 		{
 			printf("block %4d [%09d - %09d]: %5d filled\n",
@@ -118,7 +967,7 @@ int main(int argc, char **argv)
 	fprintf(stdout, "Counting set bits\n");
 
 	filled = 0;
-	for (i = 0; i <= MAXID; i++) 
+	for (i = 0; i <= MAXID; i++)
 	{
 		if (ISSET(bitset,i))
 			filled++;
@@ -132,9 +981,19 @@ int main(int argc, char **argv)
 	ret = 0;
 
 exit:
-	if (in != stdin) 
+	if (partitions != NULL)
+	{
+		partitions_finish(partitions, NULL);
+	}
+
+	if (data != NULL)
+	{
+		munmap(data, st.st_size);
+	}
+
+	if (fd > 0)
 	{
-		fclose(in);
+		close(fd);
 	}
 
 	bitset_free(bset);